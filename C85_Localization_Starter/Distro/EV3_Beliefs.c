@@ -0,0 +1,1625 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Histogram localization beliefs - see EV3_Beliefs.h.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<math.h>
+#ifdef __AVX2__
+#include<immintrin.h>
+#endif
+#include "EV3_Map.h"
+#include "EV3_Beliefs.h"
+
+// exp(x) for x <= 0, which is all the belief code needs (log-beliefs are never above logZ).
+// x = k*ln(2) + r with |r| <= ln(2)/2, exp(r) from its Taylor series to degree 11 (relative
+// error below 1e-12) and 2^k put straight into the exponent bits. Several times faster than
+// the library exp(), which matters as the normalization pass calls it for every live pose
+static inline double exp_neg(double x){
+  union { double d; int64_t i; } two_k;
+  double k, r, e;
+  if (x < -700.0) return 0.0;
+  k = floor(x*1.4426950408889634 + 0.5);
+  r = (x - k*6.93147180369123816490e-01) - k*1.90821492927058770002e-10;
+  e = 1.0/39916800;
+  e = e*r + 1.0/3628800;
+  e = e*r + 1.0/362880;
+  e = e*r + 1.0/40320;
+  e = e*r + 1.0/5040;
+  e = e*r + 1.0/720;
+  e = e*r + 1.0/120;
+  e = e*r + 1.0/24;
+  e = e*r + 1.0/6;
+  e = e*r + 0.5;
+  e = e*r + 1.0;
+  e = e*r + 1.0;
+  two_k.i = (int64_t)(k + 1023) << 52;
+  return e*two_k.d;
+}
+
+// log(x) for x > 0. x = m*2^e with m in [sqrt(1/2), sqrt(2)), log(m) = 2*atanh(z) with
+// z = (m-1)/(m+1), |z| < 0.172, from its series to z^17 (relative error below 1e-14)
+static inline double log_pos(double x){
+  union { double d; int64_t i; } u;
+  double m, z, z2, s;
+  int e;
+  u.d = x;
+  e = (int)((u.i >> 52) & 0x7ff) - 1023;
+  u.i = (u.i & 0x000fffffffffffffLL) | 0x3ff0000000000000LL;
+  m = u.d;
+  if (m > 1.4142135623730951) {
+    m *= 0.5;
+    e++;
+  }
+  z = (m - 1.0)/(m + 1.0);
+  z2 = z*z;
+  s = 1.0/17;
+  s = s*z2 + 1.0/15;
+  s = s*z2 + 1.0/13;
+  s = s*z2 + 1.0/11;
+  s = s*z2 + 1.0/9;
+  s = s*z2 + 1.0/7;
+  s = s*z2 + 1.0/5;
+  s = s*z2 + 1.0/3;
+  s = s*z2 + 1.0;
+  return 2.0*z*s + e*0.6931471805599453;
+}
+
+#define BELIEF_LINE (64/(int)sizeof(belief_t))  // Plane entries per cache line
+
+// a stored belief as a double. Fixed point keeps -infinity as BELIEF_Q_NONE
+static inline double belief_load(belief_t v){
+#if BELIEF_PRECISION == BELIEF_FIXED16
+  return v == BELIEF_Q_NONE ? -HUGE_VAL : v*(1.0/BELIEF_Q_SCALE);
+#else
+  return v;
+#endif
+}
+
+// a double as a stored belief, rounded to the nearest step and saturated in fixed point
+static inline belief_t belief_store(double x){
+#if BELIEF_PRECISION == BELIEF_FIXED16
+  if (x == -HUGE_VAL) return BELIEF_Q_NONE;
+  x *= BELIEF_Q_SCALE;
+  if (x <= -32767.0) return -32767;
+  if (x >= 32767.0) return 32767;
+  return (belief_t)floor(x + 0.5);
+#else
+  return (belief_t)x;
+#endif
+}
+
+static int motion_class_of(int x, int y, int sx, int sy);
+static void hyp_enter(belief_state *bs);
+static void hyp_normalize(belief_state *bs);
+static void hyp_measure(belief_state *bs, uint8_t scan);
+static void hyp_motion(belief_state *bs, int touchRed);
+static void observed(belief_state *bs, int converged, double p, int scan);
+
+typedef struct belief_job
+{
+ belief_state *bs;
+ const uint8_t *rot;        // Measurement: the scan rotated to each direction
+ int touchRed;              // Motion
+ double ref;                // Normalization: starting maximum. hyp_enter(): the cut.
+                            // beliefs_mix_uniform(): the uniform log-belief
+ double keep;               // beliefs_mix_uniform(): log of the weight the belief keeps
+ int position;              // updateBeliefByBuilding(): the building, and its colour code
+ int code;
+} belief_job;
+
+// run fn over every tile, on the pool if there is one
+static void run_tiles(belief_state *bs, pool_task fn, belief_job *job){
+  if (bs->pool != NULL) {
+    pool_run(bs->pool, bs->tiles, fn, job);
+    return;
+  }
+  for (int t = 0; t < bs->tiles; t++)
+  {
+    fn(job, t);
+  }
+}
+
+// the intersections [*from, *to) of a tile
+static inline void tile_range(const belief_state *bs, int tile, int *from, int *to){
+  *from = tile*BELIEF_TILE;
+  *to = *from + BELIEF_TILE < bs->n ? *from + BELIEF_TILE : bs->n;
+}
+
+// log(exp(a) + exp(b))
+static inline double log_add(double a, double b){
+  double m = a > b ? a : b;
+  if (m == -HUGE_VAL) return m;
+  return m + log_pos(1.0 + exp_neg(-fabs(a - b)));
+}
+
+// allocate beliefs for a map of nx by ny intersections, initialized to uniform.
+// Returns 1 on success, 0 if out of memory
+int beliefs_init(belief_state *bs, int nx, int ny){
+  bs->sx = nx;
+  bs->sy = ny;
+  bs->n = nx*ny;
+  bs->stride = (bs->n + BELIEF_LINE - 1) & ~(BELIEF_LINE - 1);   // whole cache lines per plane
+  bs->block = (belief_t *)alloc_aligned((size_t)bs->stride*8*sizeof(belief_t));
+  bs->motion_class = NULL;
+  bs->motion = NULL;
+  bs->hyp = bs->hyp_next = NULL;
+  bs->pool = NULL;
+  bs->tiles = (bs->n + BELIEF_TILE - 1)/BELIEF_TILE;
+  bs->tile = NULL;
+  if (bs->block == NULL) {
+    fprintf(stderr, "Out of memory allocating space for beliefs\n");
+    return 0;
+  }
+  // the padding past n is never read as a belief, but the vector loops touch it
+  memset(bs->block, 0, (size_t)bs->stride*8*sizeof(belief_t));
+  for (int d = 0; d < 4; d++)
+  {
+    bs->l[d] = bs->block + d*bs->stride;
+    bs->scratch[d] = bs->block + (4 + d)*bs->stride;
+  }
+  bs->motion_class = (unsigned char *)malloc(bs->n);
+  bs->motion = (motion_stencil (*)[2][4])malloc(MOTION_CLASSES*sizeof(*bs->motion));
+  // a motion update can push each hypothesis into 4 poses before pruning
+  bs->hyp = (belief_hyp *)malloc(4*BELIEF_TOPK*sizeof(belief_hyp));
+  bs->hyp_next = (belief_hyp *)malloc(4*BELIEF_TOPK*sizeof(belief_hyp));
+  bs->tile = (belief_tile *)malloc(bs->tiles*sizeof(belief_tile));
+  if (bs->motion_class == NULL || bs->motion == NULL || bs->hyp == NULL || bs->hyp_next == NULL || bs->tile == NULL) {
+    fprintf(stderr, "Out of memory allocating space for beliefs\n");
+    beliefs_free(bs);
+    return 0;
+  }
+  for (int i = 0; i < bs->n; i++)
+  {
+    bs->motion_class[i] = motion_class_of(i%nx, i/nx, nx, ny);
+  }
+  beliefs_set_motion(bs, BELIEF_P_OVER, BELIEF_P_UNDER);
+  beliefs_set_convergence(bs, BELIEF_CONVERGE_RATIO, BELIEF_CONVERGE_ENTROPY);
+  beliefs_uniform(bs);
+  return 1;
+}
+
+void beliefs_free(belief_state *bs){
+  beliefs_set_threads(bs, 1);
+  free(bs->tile);
+  bs->tile = NULL;
+  free(bs->block);
+  free(bs->motion_class);
+  free(bs->motion);
+  free(bs->hyp);
+  free(bs->hyp_next);
+  bs->block = NULL;
+  bs->motion_class = NULL;
+  bs->motion = NULL;
+  bs->hyp = bs->hyp_next = NULL;
+  for (int d = 0; d < 4; d++)
+  {
+    bs->l[d] = NULL;
+    bs->scratch[d] = NULL;
+  }
+}
+
+// use threads threads (the caller included) for the dense passes, 1 for none. Maps of a
+// single tile never need more. Returns 1 on success, 0 if the pool could not be started
+int beliefs_set_threads(belief_state *bs, int threads){
+  if (bs->pool != NULL) {
+    pool_free(bs->pool);
+    free(bs->pool);
+    bs->pool = NULL;
+  }
+  if (threads <= 1 || bs->tiles <= 1) return 1;
+  bs->pool = (work_pool *)malloc(sizeof(work_pool));
+  if (bs->pool == NULL || !pool_init(bs->pool, threads)) {
+    fprintf(stderr, "Unable to start threads for the belief updates\n");
+    free(bs->pool);
+    bs->pool = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// uniform probability for each location and direction
+void beliefs_uniform(belief_state *bs){
+  for (int j = 0; j < 4; j++)
+  {
+    for (int i = 0; i < bs->n; i++)
+    {
+      bs->l[j][i] = belief_store(0);
+    }
+  }
+  bs->logZ = log((double)bs->n*4);
+  bs->mean_l = 0;
+  bs->max_i = 0;
+  bs->max_dir = 0;
+  bs->max_l = bs->second_l = 0;
+  bs->sec_i = 0;
+  bs->sec_dir = 1;
+  bs->hyp_mode = 0;
+  bs->nhyp = 0;
+  bs->shift = 0;
+  bs->obs_p = 1;
+  bs->surprise = 0;
+  bs->scan_read = 0;
+}
+
+// leave hypothesis mode: write the floor and the hypotheses back into the planes
+void beliefs_dense(belief_state *bs){
+  if (!bs->hyp_mode) return;
+  for (int j = 0; j < 4; j++)
+  {
+    for (int i = 0; i < bs->n; i++)
+    {
+      bs->l[j][i] = belief_store(bs->floor_l);
+    }
+  }
+  for (int k = 0; k < bs->nhyp; k++)
+  {
+    bs->l[bs->hyp[k].dir][bs->hyp[k].i] = belief_store(bs->hyp[k].l);
+  }
+  bs->hyp_mode = 0;
+  bs->nhyp = 0;
+}
+
+// fixed part of a snapshot, followed by the hypotheses or by the four planes (stored as
+// belief_t, so only a build of the same BELIEF_PRECISION can load it)
+typedef struct belief_snapshot
+{
+  int sx, sy, hyp_mode, nhyp, surprise;
+  int max_i, max_dir, sec_i, sec_dir, precision;
+  double logZ, mean_l, max_l, second_l, floor_l, shift, obs_p;
+} belief_snapshot;
+
+// bytes beliefs_snapshot() writes for the belief as it is now
+size_t beliefs_snapshot_size(belief_state *bs){
+  if (bs->hyp_mode) return sizeof(belief_snapshot) + (size_t)bs->nhyp*sizeof(belief_hyp);
+  return sizeof(belief_snapshot) + (size_t)bs->n*4*sizeof(belief_t);
+}
+
+// copy the belief into buf, which must hold beliefs_snapshot_size() bytes. In hypothesis mode
+// only the hypotheses are stored
+void beliefs_snapshot(belief_state *bs, unsigned char *buf){
+  belief_snapshot h;
+  memset(&h, 0, sizeof(h));
+  h.sx = bs->sx;
+  h.sy = bs->sy;
+  h.hyp_mode = bs->hyp_mode;
+  h.nhyp = bs->nhyp;
+  h.surprise = bs->surprise;
+  h.max_i = bs->max_i;
+  h.max_dir = bs->max_dir;
+  h.sec_i = bs->sec_i;
+  h.sec_dir = bs->sec_dir;
+  h.precision = BELIEF_PRECISION;
+  h.logZ = bs->logZ;
+  h.mean_l = bs->mean_l;
+  h.max_l = bs->max_l;
+  h.second_l = bs->second_l;
+  h.floor_l = bs->floor_l;
+  h.shift = bs->shift;
+  h.obs_p = bs->obs_p;
+  memcpy(buf, &h, sizeof(h));
+  buf += sizeof(h);
+  if (bs->hyp_mode) {
+    memcpy(buf, bs->hyp, (size_t)bs->nhyp*sizeof(belief_hyp));
+    return;
+  }
+  for (int d = 0; d < 4; d++)
+  {
+    memcpy(buf + (size_t)d*bs->n*sizeof(belief_t), bs->l[d], (size_t)bs->n*sizeof(belief_t));
+  }
+}
+
+// load a belief written by beliefs_snapshot() for a map of the same size. Returns 1 on
+// success, 0 (leaving the belief as it was) if buf does not hold a belief for this map
+int beliefs_restore(belief_state *bs, const unsigned char *buf, size_t len){
+  belief_snapshot h;
+  if (len < sizeof(h)) return 0;
+  memcpy(&h, buf, sizeof(h));
+  if (h.sx != bs->sx || h.sy != bs->sy || h.precision != BELIEF_PRECISION) return 0;
+  if (h.hyp_mode && (h.nhyp < 0 || h.nhyp > 4*BELIEF_TOPK || len != sizeof(h) + (size_t)h.nhyp*sizeof(belief_hyp))) return 0;
+  if (!h.hyp_mode && len != sizeof(h) + (size_t)bs->n*4*sizeof(belief_t)) return 0;
+  buf += sizeof(h);
+
+  bs->hyp_mode = h.hyp_mode;
+  bs->nhyp = h.hyp_mode ? h.nhyp : 0;
+  if (h.hyp_mode) {
+    memcpy(bs->hyp, buf, (size_t)h.nhyp*sizeof(belief_hyp));
+    for (int d = 0; d < 4; d++)
+    {
+      for (int i = 0; i < bs->n; i++)
+      {
+        bs->scratch[d][i] = belief_store(-HUGE_VAL);
+      }
+    }
+  } else {
+    for (int d = 0; d < 4; d++)
+    {
+      memcpy(bs->l[d], buf + (size_t)d*bs->n*sizeof(belief_t), (size_t)bs->n*sizeof(belief_t));
+    }
+  }
+  bs->surprise = h.surprise;
+  bs->max_i = h.max_i;
+  bs->max_dir = h.max_dir;
+  bs->sec_i = h.sec_i;
+  bs->sec_dir = h.sec_dir;
+  bs->logZ = h.logZ;
+  bs->mean_l = h.mean_l;
+  bs->max_l = h.max_l;
+  bs->second_l = h.second_l;
+  bs->floor_l = h.floor_l;
+  bs->shift = h.shift;
+  bs->obs_p = h.obs_p;
+  return 1;
+}
+
+// probability the robot is at intersection i facing direction (a search through the
+// hypotheses in hypothesis mode)
+double beliefsGet(belief_state *bs, int i, int direction){
+  if (bs->hyp_mode) {
+    for (int k = 0; k < bs->nhyp; k++)
+    {
+      if (bs->hyp[k].i == i && bs->hyp[k].dir == direction) return exp_neg(bs->hyp[k].l - bs->logZ);
+    }
+    return exp_neg(bs->floor_l - bs->logZ);
+  }
+  return exp_neg(belief_load(bs->l[direction][i]) - bs->logZ);
+}
+
+// entropy of the belief, in nats. log(4*n) when uniform, 0 when certain
+double beliefsEntropy(belief_state *bs){
+  double h = bs->logZ - bs->mean_l;
+  return h > 0 ? h : 0;
+}
+
+// print the beliefs array (in hypothesis mode, the hypotheses and the floor)
+void printBeliefs(belief_state *bs){
+  int length = bs->n;
+  if (bs->hyp_mode) {
+    for (int k = 0; k < bs->nhyp; k++)
+    {
+      printf("(%d,%d) %d: %f\n ", bs->hyp[k].i%bs->sx, bs->hyp[k].i/bs->sx, bs->hyp[k].dir, exp_neg(bs->hyp[k].l - bs->logZ));
+    }
+    printf("all others: %f\n ", exp_neg(bs->floor_l - bs->logZ));
+    return;
+  }
+  for (int i = 0; i < length; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      printf("%f ", beliefsGet(bs, i, j));
+    }
+    printf("\n ");
+  }
+}
+
+// subtract shift from every stored belief, to keep them near 0 where they are precise. In
+// fixed point the shift is a whole number of steps, so the planes shift without rounding
+static void rebaseBeliefs(belief_state *bs, double shift){
+#if BELIEF_PRECISION == BELIEF_FIXED16
+  shift = floor(shift*BELIEF_Q_SCALE + 0.5)/BELIEF_Q_SCALE;
+#endif
+  bs->shift += shift;
+  bs->logZ -= shift;
+  bs->mean_l -= shift;
+  bs->max_l -= shift;
+  bs->second_l -= shift;
+  if (bs->hyp_mode) {
+    for (int k = 0; k < bs->nhyp; k++)
+    {
+      bs->hyp[k].l -= shift;
+    }
+    bs->floor_l -= shift;
+    return;
+  }
+  for (int j = 0; j < 4; j++)
+  {
+    belief_t *l = bs->l[j];
+    for (int i = 0; i < bs->n; i++)
+    {
+      l[i] = belief_store(belief_load(l[i]) - shift);
+    }
+  }
+}
+
+// the normalization pass over one tile. Sums are taken relative to the largest belief seen
+// so far (starting from ref, the previous maximum, which is usually still the maximum), and
+// rescaled in the rare case a larger one turns up. Also finds the tile's two most likely
+// poses, and counts the poses within BELIEF_LIVE_RATIO of the maximum
+static void normalize_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  belief_state *bs = job->bs;
+  belief_tile *r = &bs->tile[tile];
+  double m = job->ref, sum = 0, suml = 0;
+  double best = -HUGE_VAL, second = -HUGE_VAL;
+  double live_cut = log(BELIEF_LIVE_RATIO);
+  int best_i = -1, best_dir = 0, sec_i = -1, sec_dir = 0;
+  int live = 0, from, to;
+
+  tile_range(bs, tile, &from, &to);
+  for (int j = 0; j < 4; j++)
+  {
+    const belief_t *l = bs->l[j];
+    for (int i = from; i < to; i++)
+    {
+      double v = belief_load(l[i]);
+      double x = v - m;
+      if (x < BELIEF_LOG_CUTOFF) continue;
+      if (x > 0) {
+        double e = exp_neg(-x);
+        sum *= e;
+        suml *= e;
+        m = v;
+        x = 0;
+      }
+      // nearly every pose is below the runner-up, test that first
+      if (v > second) {
+        if (v > best) {
+          second = best;
+          sec_i = best_i;
+          sec_dir = best_dir;
+          best = v;
+          best_i = i;
+          best_dir = j;
+        } else {
+          second = v;
+          sec_i = i;
+          sec_dir = j;
+        }
+      }
+      double e = exp_neg(x);
+      sum += e;
+      suml += e*v;
+      live += x > live_cut;
+    }
+  }
+  r->best = best;
+  r->best_i = best_i;
+  r->best_dir = best_dir;
+  r->second = second;
+  r->sec_i = sec_i;
+  r->sec_dir = sec_dir;
+  r->live = live;
+  r->logsum = sum > 0 ? m + log(sum) : -HUGE_VAL;
+  r->mean = sum > 0 ? suml/sum : 0;
+}
+
+// normalize the beliefs array. A single log-sum-exp pass that recomputes logZ, and on the way
+// finds the most likely pose, the runner-up and the entropy. The tiles' partial results are
+// combined in tile order. Also counts the poses within BELIEF_LIVE_RATIO of the best, to
+// decide whether to switch to hypothesis mode
+void normalizeBeliefs(belief_state *bs){
+  if (bs->hyp_mode) {
+    hyp_normalize(bs);
+    return;
+  }
+  belief_job job;
+  double sum = 0, suml = 0;
+  double best = -HUGE_VAL, second = -HUGE_VAL;
+  int max_i = bs->max_i, max_dir = bs->max_dir, sec_i = -1, sec_dir = 0;
+  int live = 0;
+  double top = -HUGE_VAL;
+
+  job.bs = bs;
+  job.ref = belief_load(bs->l[bs->max_dir][bs->max_i]);
+  run_tiles(bs, normalize_tile, &job);
+  for (int t = 0; t < bs->tiles; t++)
+  {
+    if (bs->tile[t].logsum > top) top = bs->tile[t].logsum;
+  }
+  for (int t = 0; t < bs->tiles; t++)
+  {
+    const belief_tile *r = &bs->tile[t];
+    double e = exp_neg(r->logsum - top);
+    sum += e;
+    suml += e*r->mean;
+    live += r->live;
+    if (r->best_i < 0) continue;
+    if (r->best > best) {
+      // the old best or the tile's runner-up is now second
+      if (best >= r->second) {
+        second = best;
+        sec_i = max_i;
+        sec_dir = max_dir;
+      } else {
+        second = r->second;
+        sec_i = r->sec_i;
+        sec_dir = r->sec_dir;
+      }
+      best = r->best;
+      max_i = r->best_i;
+      max_dir = r->best_dir;
+    } else if (r->best > second) {
+      second = r->best;
+      sec_i = r->best_i;
+      sec_dir = r->best_dir;
+    }
+  }
+  // poses skipped by the cutoff are below best + BELIEF_LOG_CUTOFF, if the runner-up was
+  // among them only that bound is known
+  if (sec_i < 0 || second < best + BELIEF_LOG_CUTOFF) {
+    second = best + BELIEF_LOG_CUTOFF;
+    sec_i = -1;
+  }
+  bs->max_i = max_i;
+  bs->max_dir = max_dir;
+  bs->max_l = best;
+  bs->second_l = second;
+  bs->sec_i = sec_i;
+  bs->sec_dir = sec_dir;
+  bs->logZ = top + log(sum);
+  bs->mean_l = suml/sum;
+  if (fabs(bs->logZ) > BELIEF_REBASE) rebaseBeliefs(bs, bs->logZ);
+  // live is counted against each tile's running maximum, so it can only overestimate
+  if (live <= BELIEF_TOPK) hyp_enter(bs);
+}
+// return whether the belief has converged on one pose: the most likely pose is at least
+// converge_ratio times as likely as the runner-up, or the entropy is down to converge_entropy
+// (either test is off when its threshold is 0). O(1), from what the updates keep track of.
+// The ratio must clear BELIEF_QUANTUM as well, what rounding the stored beliefs can add
+int beliefsHasUnipueMax(belief_state *bs){
+  if (bs->converge_ratio > 0 && bs->max_l - bs->second_l >= log(bs->converge_ratio) + BELIEF_QUANTUM) return 1;
+  return bs->converge_entropy > 0 && beliefsEntropy(bs) <= bs->converge_entropy;
+}
+
+// set the convergence thresholds used by beliefsHasUnipueMax()
+void beliefs_set_convergence(belief_state *bs, double ratio, double entropy){
+  bs->converge_ratio = ratio;
+  bs->converge_entropy = entropy;
+}
+
+// the most likely location and direction (kept up to date by every update), returns its
+// probability
+double beliefsArgMax(belief_state *bs, int *x, int *y, int *direction){
+  *x = bs->max_i%bs->sx;
+  *y = bs->max_i/bs->sx;
+  *direction = bs->max_dir;
+  return beliefsGet(bs, bs->max_i, bs->max_dir);
+}
+
+// record the likelihood p of the observation just applied, under the belief before it. An
+// implausible one counts towards beliefs_kidnapped() if the belief had converged, or if the
+// last one was implausible too. A plausible scan clears the count - a plausible drive does
+// not, as nearly every drive is one that touches no red
+static void observed(belief_state *bs, int converged, double p, int scan){
+  bs->obs_p = p < 0 ? 0 : (p > 1 ? 1 : p);
+  if (bs->obs_p >= BELIEF_KIDNAP_P) {
+    if (scan) bs->surprise = 0;
+  }
+  else if (converged || bs->surprise > 0) bs->surprise++;
+}
+
+// whether the last BELIEF_KIDNAP_COUNT observations were all implausible under the belief -
+// the robot is most likely not where the belief says, it was moved or the localization was
+// wrong
+int beliefs_kidnapped(belief_state *bs){
+  return bs->surprise >= BELIEF_KIDNAP_COUNT;
+}
+
+// mix the uniform belief into one tile, see beliefs_mix_uniform()
+static void mix_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  belief_state *bs = job->bs;
+  int from, to;
+  tile_range(bs, tile, &from, &to);
+  for (int j = 0; j < 4; j++)
+  {
+    belief_t *l = bs->l[j];
+    for (int i = from; i < to; i++)
+    {
+      l[i] = belief_store(log_add(belief_load(l[i]) + job->keep, job->ref));
+    }
+  }
+}
+
+// mix a uniform belief into the current one with weight w: every pose gets at least w/(4n) of
+// the probability, and the belief keeps the rest. Localization can then start over from
+// wherever the robot is, without throwing away the belief if it was right after all
+void beliefs_mix_uniform(belief_state *bs, double w){
+  belief_job job;
+  job.bs = bs;
+  job.keep = log(1.0 - w);
+  job.ref = bs->logZ + log(w/(4.0*bs->n));
+  if (bs->hyp_mode) {
+    for (int k = 0; k < bs->nhyp; k++)
+    {
+      bs->hyp[k].l = log_add(bs->hyp[k].l + job.keep, job.ref);
+    }
+    if (bs->nhyp < 4*bs->n) bs->floor_l = log_add(bs->floor_l + job.keep, job.ref);
+  } else {
+    run_tiles(bs, mix_tile, &job);
+  }
+  bs->surprise = 0;
+  normalizeBeliefs(bs);
+}
+
+// Sparse update: the poses matching the scan come from the inverted index and gain
+// log(BELIEF_MATCH_FACTOR). If P is the probability they held, the total grows by a factor
+// 1 + (M-1)P, and the expected log-belief by the matching poses' share of it - so logZ,
+// mean_l and the argmax are all updated from the matching poses alone. The runner-up is the
+// best of the matching poses, the old maximum and the old runner-up: every other pose is
+// unchanged and was no more likely than the old runner-up, which can only have gained
+static void measure_sparse(belief_state *bs, uint8_t scan){
+  const double a = log(BELIEF_MATCH_FACTOR);
+  double p_match = 0, dmean = 0;
+  double best = belief_load(bs->l[bs->max_dir][bs->max_i]);
+  double second;
+
+  // the old runner-up's value after the update (only a bound is known if sec_i is -1)
+  if (bs->sec_i >= 0) {
+    second = belief_load(bs->l[bs->sec_dir][bs->sec_i]);
+    second += map_sig[bs->sec_i] == sig_rotate[scan][bs->sec_dir] ? a : 0;
+  } else {
+    second = bs->second_l + a;
+  }
+  for (uint32_t k = sig_index_start[scan]; k < sig_index_start[scan + 1]; k++)
+  {
+    int i = sig_index[k] >> 2, d = sig_index[k] & 3;
+    belief_t *l = &bs->l[d][i];
+    double v = belief_load(*l);
+    double p = exp_neg(v - bs->logZ);
+    p_match += p;
+    dmean += p*(BELIEF_MATCH_FACTOR*(v + a) - v);
+    *l = belief_store(v + a);
+    v = belief_load(*l);
+    if (v > best) {
+      if (bs->max_i != i || bs->max_dir != d) {
+        second = best;
+        bs->sec_i = bs->max_i;
+        bs->sec_dir = bs->max_dir;
+      }
+      best = v;
+      bs->max_i = i;
+      bs->max_dir = d;
+    } else if (v > second && (i != bs->max_i || d != bs->max_dir)) {
+      second = v;
+      bs->sec_i = i;
+      bs->sec_dir = d;
+    }
+  }
+  bs->max_l = best;
+  bs->second_l = second < best ? second : best;
+  double growth = 1.0 + (BELIEF_MATCH_FACTOR - 1.0)*p_match;
+  bs->mean_l = (bs->mean_l + dmean)/growth;
+  bs->logZ += log(growth);
+  if (fabs(bs->logZ) > BELIEF_REBASE) rebaseBeliefs(bs, bs->logZ);
+}
+
+// Dense update: the scan matches direction d at intersection i when the building the robot
+// sees at position k is map[i][(k+d)%4], that is when map_sig[i] == sig_rotate[scan][d] (see
+// EV3_Map.h). The 4 rotations are looked up once, then each intersection costs 4 byte
+// compares and no branches. Every matching (intersection, direction) gains
+// log(BELIEF_MATCH_FACTOR), for intersections [from, to)
+static void measure_scalar(belief_state *bs, const uint8_t *rot, int from, int to){
+  const double gain[2] = {0.0, log(BELIEF_MATCH_FACTOR)};
+  for (int i = from; i < to; i++)
+  {
+    uint8_t m = map_sig[i];
+    for (int j = 0; j < 4; j++)
+    {
+      bs->l[j][i] = belief_store(belief_load(bs->l[j][i]) + gain[m == rot[j]]);
+    }
+  }
+}
+
+#ifdef __AVX2__
+#if BELIEF_PRECISION == BELIEF_FIXED16
+// same as measure_scalar(), 16 intersections at a time (from must be a multiple of 16).
+// Saturating adds match belief_store(), and -infinity is left alone. Returns the index of the
+// first intersection left for the scalar loop
+static int measure_avx2(belief_state *bs, const uint8_t *rot, int from, int to){
+  const __m256i gain = _mm256_set1_epi16(belief_store(log(BELIEF_MATCH_FACTOR)));
+  const __m256i none = _mm256_set1_epi16(BELIEF_Q_NONE);
+  __m256i r[4];
+  int i;
+
+  for (int j = 0; j < 4; j++)
+  {
+    r[j] = _mm256_set1_epi16(rot[j]);
+  }
+  for (i = from; i + 16 <= to; i += 16)
+  {
+    __m256i m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(map_sig + i)));
+    for (int j = 0; j < 4; j++)
+    {
+      __m256i l = _mm256_load_si256((const __m256i *)(bs->l[j] + i));
+      __m256i mask = _mm256_andnot_si256(_mm256_cmpeq_epi16(l, none), _mm256_cmpeq_epi16(m, r[j]));
+      _mm256_store_si256((__m256i *)(bs->l[j] + i), _mm256_adds_epi16(l, _mm256_and_si256(gain, mask)));
+    }
+  }
+  return i;
+}
+#elif BELIEF_PRECISION == BELIEF_FLOAT
+// same as measure_scalar(), 8 intersections at a time (from must be a multiple of 8). Returns
+// the index of the first intersection left for the scalar loop
+static int measure_avx2(belief_state *bs, const uint8_t *rot, int from, int to){
+  const __m256 gain = _mm256_set1_ps((float)log(BELIEF_MATCH_FACTOR));
+  __m256i r[4];
+  int i;
+
+  for (int j = 0; j < 4; j++)
+  {
+    r[j] = _mm256_set1_epi32(rot[j]);
+  }
+  for (i = from; i + 8 <= to; i += 8)
+  {
+    long long word;
+    memcpy(&word, map_sig + i, sizeof(word));
+    __m256i m = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(word));
+    for (int j = 0; j < 4; j++)
+    {
+      __m256 mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(m, r[j]));
+      __m256 l = _mm256_add_ps(_mm256_load_ps(bs->l[j] + i), _mm256_and_ps(gain, mask));
+      _mm256_store_ps(bs->l[j] + i, l);
+    }
+  }
+  return i;
+}
+#else
+// same as measure_scalar(), 4 intersections at a time (from must be a multiple of 4). Returns
+// the index of the first intersection left for the scalar loop
+static int measure_avx2(belief_state *bs, const uint8_t *rot, int from, int to){
+  const __m256d gain = _mm256_set1_pd(log(BELIEF_MATCH_FACTOR));
+  __m256i r[4];
+  int i;
+
+  for (int j = 0; j < 4; j++)
+  {
+    r[j] = _mm256_set1_epi64x(rot[j]);
+  }
+  for (i = from; i + 4 <= to; i += 4)
+  {
+    int word;
+    memcpy(&word, map_sig + i, sizeof(int));
+    __m256i m = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(word));
+    for (int j = 0; j < 4; j++)
+    {
+      __m256d mask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(m, r[j]));
+      __m256d l = _mm256_add_pd(_mm256_load_pd(bs->l[j] + i), _mm256_and_pd(gain, mask));
+      _mm256_store_pd(bs->l[j] + i, l);
+    }
+  }
+  return i;
+}
+#endif
+#endif
+
+// the dense measurement kernel over one tile
+static void measure_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  int from, to;
+  tile_range(job->bs, tile, &from, &to);
+#ifdef __AVX2__
+  from = measure_avx2(job->bs, job->rot, from, to);
+#endif
+  measure_scalar(job->bs, job->rot, from, to);
+}
+
+// measurement update. Walks the inverted index when the scan matches fewer than a quarter of
+// all poses, otherwise makes a dense pass over the planes
+void updateBeliefByColor(belief_state *bs, int *tl, int *tr, int *br, int *bl){
+  uint8_t scan = color_signature(*tl, *tr, *br, *bl);
+  int converged = beliefsHasUnipueMax(bs);
+  double before = bs->logZ + bs->shift;
+  belief_job job;
+
+  if (bs->hyp_mode) {
+    hyp_measure(bs, scan);
+  } else if (sig_index_start[scan + 1] - sig_index_start[scan] < (uint32_t)bs->n) {
+    measure_sparse(bs, scan);
+  } else {
+    job.bs = bs;
+    job.rot = sig_rotate[scan];
+    run_tiles(bs, measure_tile, &job);
+    normalizeBeliefs(bs);
+  }
+  // the total grew by 1 + (M-1)P, P the probability the poses matching the scan held
+  double growth = exp(bs->logZ + bs->shift - before);
+  observed(bs, converged, (growth - 1.0)/(BELIEF_MATCH_FACTOR - 1.0), 1);
+}
+
+// the per-building kernel over one tile. Facing d, the building at position k is the map's
+// building (k+d)%4, whose code is that pair of bits of map_sig[]
+static void building_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  belief_state *bs = job->bs;
+  const double gain[2] = {0.0, log(BELIEF_BUILDING_FACTOR)};
+  int from, to;
+  tile_range(bs, tile, &from, &to);
+  for (int j = 0; j < 4; j++)
+  {
+    belief_t *l = bs->l[j];
+    int shift = 2*((job->position + j) & 3);
+    for (int i = from; i < to; i++)
+    {
+      l[i] = belief_store(belief_load(l[i]) + gain[((map_sig[i] >> shift) & 3) == job->code]);
+    }
+  }
+}
+
+// streamed measurement update, the robot read colour at position (0-3 clockwise from the
+// top-left, as in updateBeliefByColor()). Every pose whose building there is that colour
+// gains log(BELIEF_BUILDING_FACTOR). The first building of a scan records what
+// beliefs_scan_done() needs
+void updateBeliefByBuilding(belief_state *bs, int position, int colour){
+  int code = color_signature(colour, 0, 0, 0) & 3;
+  // the share of all poses that see this colour at any one position
+  double share = (double)sig_code_count[code]/(4.0*bs->n);
+  belief_job job;
+
+  if (bs->scan_read == 0) {
+    bs->scan_converged = beliefsHasUnipueMax(bs);
+    bs->scan_before = bs->logZ + bs->shift;
+    bs->scan_base = 0;
+  }
+  bs->scan_read++;
+  bs->scan_base += log_pos(1.0 + (BELIEF_BUILDING_FACTOR - 1.0)*share);
+  if (bs->hyp_mode) {
+    const double a = log(BELIEF_BUILDING_FACTOR);
+    double rest = 4.0*bs->n - bs->nhyp;
+    int matched = 0;
+    for (int k = 0; k < bs->nhyp; k++)
+    {
+      if (((map_sig[bs->hyp[k].i] >> (2*((position + bs->hyp[k].dir) & 3))) & 3) == code) {
+        bs->hyp[k].l += a;
+        matched++;
+      }
+    }
+    // the floor scales by the average gain of the poses it stands for
+    if (rest > 0) {
+      double f = ((double)sig_code_count[code] - matched)/rest;
+      f = f < 0 ? 0 : (f > 1 ? 1 : f);
+      bs->floor_l += log_pos(1.0 + (BELIEF_BUILDING_FACTOR - 1.0)*f);
+    }
+    hyp_normalize(bs);
+    return;
+  }
+  job.bs = bs;
+  job.position = position & 3;
+  job.code = code;
+  run_tiles(bs, building_tile, &job);
+  normalizeBeliefs(bs);
+}
+
+// whether the buildings of the streamed scan still unread can no longer change the most
+// likely pose: each can raise a pose by log(BELIEF_BUILDING_FACTOR) at most, and the
+// runner-up (a bound on every other pose) is further behind than all of them together
+int beliefs_scan_settled(belief_state *bs){
+  int unread = 4 - bs->scan_read;
+  return unread <= 0 || bs->max_l - bs->second_l > unread*log(BELIEF_BUILDING_FACTOR) + BELIEF_QUANTUM;
+}
+
+// end a streamed scan (however many buildings were read) and record how likely it was: the
+// growth of the total, between what a belief that knows nothing would see and what one sure
+// of a pose that matched every building read would
+void beliefs_scan_done(belief_state *bs){
+  if (bs->scan_read == 0) return;
+  double growth = exp(bs->logZ + bs->shift - bs->scan_before);
+  double base = exp(bs->scan_base), full = pow(BELIEF_BUILDING_FACTOR, bs->scan_read);
+  observed(bs, bs->scan_converged, full > base ? (growth - base)/(full - base) : 1.0, 1);
+  bs->scan_read = 0;
+}
+
+static const int step_x[4] = {0, 1, 0, -1};   // Intersection step for each direction
+static const int step_y[4] = {-1, 0, 1, 0};
+
+typedef struct motion_outcome
+{
+ int x, y, dir;             // Where the robot ends up
+ int red;                   // Whether it touched the red border on the way
+ double p;
+} motion_outcome;
+
+// the poses a robot at (x,y) facing dir can end up in after driving forward to the next
+// intersection, under the motion model in EV3_Beliefs.h. Returns the number of outcomes
+static int motion_outcomes(int x, int y, int dir, int sx, int sy, double p_over, double p_under,
+                           motion_outcome *out){
+  int ax = x + step_x[dir], ay = y + step_y[dir];
+  int bx = ax + step_x[dir], by = ay + step_y[dir];
+  int back = (dir + 2)%4;
+  int n = 0;
+  motion_outcome o;
+
+  o.red = 0;
+  if (ax >= 0 && ax < sx && ay >= 0 && ay < sy) {
+    o.x = ax; o.y = ay; o.dir = dir; o.p = 1.0 - p_over - p_under;
+    out[n++] = o;
+    if (bx >= 0 && bx < sx && by >= 0 && by < sy) {
+      o.x = bx; o.y = by; o.dir = dir; o.p = p_over;
+    } else {
+      // past the last intersection, into the border and back
+      o.x = ax; o.y = ay; o.dir = back; o.red = 1; o.p = p_over;
+    }
+    out[n++] = o;
+  } else {
+    // facing the border, turns around on red and comes back
+    o.x = x; o.y = y; o.dir = back; o.red = 1; o.p = 1.0 - p_over - p_under;
+    out[n++] = o;
+    ax = x - step_x[dir];
+    ay = y - step_y[dir];
+    if (ax >= 0 && ax < sx && ay >= 0 && ay < sy) {
+      o.x = ax; o.y = ay;
+    }
+    o.p = p_over;
+    out[n++] = o;
+  }
+  o.x = x; o.y = y; o.dir = dir; o.red = 0; o.p = p_under;
+  out[n++] = o;
+  return n;
+}
+
+// boundary class of intersection (x,y), from its distance (capped at 2) to each border
+static int motion_class_of(int x, int y, int sx, int sy){
+  int l = x < 2 ? x : 2, r = sx - 1 - x < 2 ? sx - 1 - x : 2;
+  int t = y < 2 ? y : 2, b = sy - 1 - y < 2 ? sy - 1 - y : 2;
+  return l + 3*(r + 3*(t + 3*b));
+}
+
+// add probability w of moving from the source at offset/dir to a stencil
+static void add_term(motion_stencil *st, int offset, int dir, double w){
+  for (int k = 0; k < st->count; k++)
+  {
+    if (st->term[k].offset == offset && st->term[k].dir == dir) {
+      st->term[k].logw += w;
+      return;
+    }
+  }
+  st->term[st->count].offset = offset;
+  st->term[st->count].dir = dir;
+  st->term[st->count].logw = w;
+  st->count++;
+}
+
+// (re)build the motion tables for the given model. Each class's stencils are found from one
+// intersection of that class, by running the model for every pose within two intersections
+// of it and keeping the moves that end there
+void beliefs_set_motion(belief_state *bs, double p_over, double p_under){
+  int done[MOTION_CLASSES];
+  motion_outcome out[4];
+
+  bs->p_over = p_over;
+  bs->p_under = p_under;
+  memset(done, 0, sizeof(done));
+  memset(bs->motion, 0, MOTION_CLASSES*sizeof(*bs->motion));
+  for (int i = 0; i < bs->n; i++)
+  {
+    int c = bs->motion_class[i];
+    int x = i%bs->sx, y = i/bs->sx;
+    if (done[c]) continue;
+    done[c] = 1;
+    for (int py = y - 2; py <= y + 2; py++)
+    {
+      for (int px = x - 2; px <= x + 2; px++)
+      {
+        if (px < 0 || px >= bs->sx || py < 0 || py >= bs->sy) continue;
+        for (int d = 0; d < 4; d++)
+        {
+          int k = motion_outcomes(px, py, d, bs->sx, bs->sy, p_over, p_under, out);
+          for (int j = 0; j < k; j++)
+          {
+            if (out[j].x != x || out[j].y != y || out[j].p <= 0) continue;
+            for (int t = 0; t < 2; t++)
+            {
+              double w = out[j].p*(out[j].red == t ? 1.0 : BELIEF_MOTION_MISS);
+              add_term(&bs->motion[c][t][out[j].dir], (px + py*bs->sx) - i, d, w);
+            }
+          }
+        }
+      }
+    }
+  }
+  for (int c = 0; c < MOTION_CLASSES; c++)
+  {
+    for (int t = 0; t < 2; t++)
+    {
+      for (int d = 0; d < 4; d++)
+      {
+        motion_stencil *st = &bs->motion[c][t][d];
+        for (int k = 0; k < st->count; k++)
+        {
+          st->term[k].logw = log(st->term[k].logw);
+        }
+      }
+    }
+  }
+}
+
+// the motion update for destinations [from, to) in the plane dst, which all share the stencil
+// st of count terms. The stencil is read once for the whole run, every source is a fixed
+// offset into one plane, so the loop over the run has no table lookups. Always inlined, so the
+// calls with a constant count get their own copy with the terms unrolled
+static inline __attribute__((always_inline)) void motion_run(const belief_state *bs, belief_t *dst,
+                                                              const motion_stencil *st, int count,
+                                                              int from, int to){
+  const belief_t *src[MOTION_MAX_TERMS];
+  double w[MOTION_MAX_TERMS];
+  for (int k = 0; k < count; k++)
+  {
+    src[k] = bs->l[st->term[k].dir] + st->term[k].offset;
+    w[k] = st->term[k].logw;
+  }
+  for (int i = from; i < to; i++)
+  {
+    double v[MOTION_MAX_TERMS];
+    double m = -HUGE_VAL, sum = 0;
+    for (int k = 0; k < count; k++)
+    {
+      v[k] = belief_load(src[k][i]) + w[k];
+      m = v[k] > m ? v[k] : m;
+    }
+    if (count == 1 || m == -HUGE_VAL) {
+      dst[i] = belief_store(m);
+      continue;
+    }
+    for (int k = 0; k < count; k++)
+    {
+      if (v[k] - m > BELIEF_LOG_CUTOFF) sum += exp_neg(v[k] - m);
+    }
+    dst[i] = belief_store(m + log_pos(sum));
+  }
+}
+
+#ifdef __AVX2__
+// 4 stored beliefs from p (any alignment) as doubles, and back
+static inline __m256d belief_load4(const belief_t *p){
+#if BELIEF_PRECISION == BELIEF_FIXED16
+  __m256d q = _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)p)));
+  __m256d none = _mm256_cmp_pd(q, _mm256_set1_pd(BELIEF_Q_NONE), _CMP_EQ_OQ);
+  return _mm256_blendv_pd(_mm256_mul_pd(q, _mm256_set1_pd(1.0/BELIEF_Q_SCALE)), _mm256_set1_pd(-HUGE_VAL), none);
+#elif BELIEF_PRECISION == BELIEF_FLOAT
+  return _mm256_cvtps_pd(_mm_loadu_ps(p));
+#else
+  return _mm256_loadu_pd(p);
+#endif
+}
+
+static inline void belief_store4(belief_t *p, __m256d x){
+#if BELIEF_PRECISION == BELIEF_FIXED16
+  __m256d none = _mm256_cmp_pd(x, _mm256_set1_pd(-HUGE_VAL), _CMP_EQ_OQ);
+  __m256d q = _mm256_floor_pd(_mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(BELIEF_Q_SCALE)), _mm256_set1_pd(0.5)));
+  q = _mm256_min_pd(_mm256_max_pd(q, _mm256_set1_pd(-32767.0)), _mm256_set1_pd(32767.0));
+  q = _mm256_blendv_pd(q, _mm256_set1_pd(BELIEF_Q_NONE), none);
+  __m128i w = _mm256_cvtpd_epi32(q);
+  _mm_storel_epi64((__m128i *)p, _mm_packs_epi32(w, w));
+#elif BELIEF_PRECISION == BELIEF_FLOAT
+  _mm_storeu_ps(p, _mm256_cvtpd_ps(x));
+#else
+  _mm256_storeu_pd(p, x);
+#endif
+}
+
+// exp_neg() for 4 values in [BELIEF_LOG_CUTOFF, 0], same reduction and series. 2^k is built
+// by adding k to 2^52 + 1023 and moving the low mantissa bits into the exponent
+static inline __m256d exp_neg4(__m256d x){
+  static const double c[12] = {1.0/39916800, 1.0/3628800, 1.0/362880, 1.0/40320, 1.0/5040, 1.0/720,
+                               1.0/120, 1.0/24, 1.0/6, 0.5, 1.0, 1.0};
+  __m256d k = _mm256_floor_pd(_mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)), _mm256_set1_pd(0.5)));
+  __m256d r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(k, _mm256_set1_pd(6.93147180369123816490e-01))),
+                            _mm256_mul_pd(k, _mm256_set1_pd(1.90821492927058770002e-10)));
+  __m256d e = _mm256_set1_pd(c[0]);
+  for (int j = 1; j < 12; j++)
+  {
+    e = _mm256_add_pd(_mm256_mul_pd(e, r), _mm256_set1_pd(c[j]));
+  }
+  __m256i two_k = _mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd(k, _mm256_set1_pd(4503599627371519.0))), 52);
+  return _mm256_mul_pd(e, _mm256_castsi256_pd(two_k));
+}
+
+// log_pos() for 4 values of at least 1, same reduction and series
+static inline __m256d log_pos4(__m256d x){
+  const __m256i mant = _mm256_set1_epi64x(0x000fffffffffffffLL), one = _mm256_set1_epi64x(0x3ff0000000000000LL);
+  const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+  __m256i bits = _mm256_castpd_si256(x);
+  // the exponent field as a double: its 11 bits put in the mantissa of 2^52, less 2^52
+  __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(magic))), magic);
+  __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mant), one));
+  __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+  m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+  e = _mm256_add_pd(_mm256_sub_pd(e, _mm256_set1_pd(1023.0)), _mm256_and_pd(big, _mm256_set1_pd(1.0)));
+  __m256d z = _mm256_div_pd(_mm256_sub_pd(m, _mm256_set1_pd(1.0)), _mm256_add_pd(m, _mm256_set1_pd(1.0)));
+  __m256d z2 = _mm256_mul_pd(z, z);
+  __m256d s = _mm256_set1_pd(1.0/17);
+  for (int j = 15; j >= 1; j -= 2)
+  {
+    s = _mm256_add_pd(_mm256_mul_pd(s, z2), _mm256_set1_pd(1.0/j));
+  }
+  return _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), z), s),
+                       _mm256_mul_pd(e, _mm256_set1_pd(0.6931471805599453)));
+}
+
+// motion_run() for a 3-term stencil, 4 destinations at a time and without a branch: the
+// cutoff and the all -infinity case are masks. Returns the first destination left for
+// motion_run()
+static int motion_run3_avx2(const belief_state *bs, belief_t *dst, const motion_stencil *st, int from, int to){
+  const belief_t *src[3];
+  __m256d w[3];
+  const __m256d ninf = _mm256_set1_pd(-HUGE_VAL), cutoff = _mm256_set1_pd(BELIEF_LOG_CUTOFF);
+  int i;
+  for (int k = 0; k < 3; k++)
+  {
+    src[k] = bs->l[st->term[k].dir] + st->term[k].offset;
+    w[k] = _mm256_set1_pd(st->term[k].logw);
+  }
+  for (i = from; i + 4 <= to; i += 4)
+  {
+    __m256d v[3], sum = _mm256_setzero_pd();
+    for (int k = 0; k < 3; k++)
+    {
+      v[k] = _mm256_add_pd(belief_load4(src[k] + i), w[k]);
+    }
+    __m256d m = _mm256_max_pd(_mm256_max_pd(v[0], v[1]), v[2]);
+    __m256d dead = _mm256_cmp_pd(m, ninf, _CMP_EQ_OQ);
+    __m256d base = _mm256_andnot_pd(dead, m);
+    for (int k = 0; k < 3; k++)
+    {
+      __m256d x = _mm256_sub_pd(v[k], base);
+      __m256d live = _mm256_cmp_pd(x, cutoff, _CMP_GT_OQ);
+      sum = _mm256_add_pd(sum, _mm256_and_pd(live, exp_neg4(_mm256_max_pd(x, cutoff))));
+    }
+    __m256d l = _mm256_add_pd(m, log_pos4(_mm256_max_pd(sum, _mm256_set1_pd(1.0))));
+    belief_store4(dst + i, _mm256_blendv_pd(l, ninf, dead));
+  }
+  return i;
+}
+#endif
+
+// the motion update for the destinations in one tile. The sources can be up to two rows
+// outside it, they are read from the current planes, which nothing writes during the pass.
+// The tile is walked in runs of one boundary class - most of every row away from the border
+// is a single run of the interior class, whose stencils all have 3 terms (exact, over and
+// under, none of them near red)
+static void motion_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  belief_state *bs = job->bs;
+  int t = job->touchRed, from, to;
+  tile_range(bs, tile, &from, &to);
+  for (int i = from, end; i < to; i = end)
+  {
+    int c = bs->motion_class[i];
+    for (end = i + 1; end < to && bs->motion_class[end] == c; end++);
+    for (int d = 0; d < 4; d++)
+    {
+      const motion_stencil *st = &bs->motion[c][t][d];
+      if (st->count == 3) {
+        int k = i;
+#ifdef __AVX2__
+        k = motion_run3_avx2(bs, bs->scratch[d], st, i, end);
+#endif
+        motion_run(bs, bs->scratch[d], st, 3, k, end);
+      }
+      else motion_run(bs, bs->scratch[d], st, st->count, i, end);
+    }
+  }
+}
+
+// motion update, the robot drove to the next intersection (turning around at the border if
+// touchRed is set). Each destination pose combines its sources from the table for its
+// boundary class, reading the current planes and writing the scratch planes, which then
+// become current
+void updateBeliefByAction(belief_state *bs, int touchRed){
+  int converged = beliefsHasUnipueMax(bs);
+  double before = bs->logZ + bs->shift;
+  belief_job job;
+  if (bs->hyp_mode) {
+    hyp_motion(bs, touchRed ? 1 : 0);
+  } else {
+    job.bs = bs;
+    job.touchRed = touchRed ? 1 : 0;
+    run_tiles(bs, motion_tile, &job);
+    for (int d = 0; d < 4; d++)
+    {
+      belief_t *tmp = bs->l[d];
+      bs->l[d] = bs->scratch[d];
+      bs->scratch[d] = tmp;
+    }
+    normalizeBeliefs(bs);
+  }
+  // every pose moves all of its probability, scaled by BELIEF_MOTION_MISS where the move
+  // disagrees with touchRed - what is left is the likelihood of touchRed
+  observed(bs, converged, exp(bs->logZ + bs->shift - before), 0);
+}
+
+// Hypothesis mode (see EV3_Beliefs.h). While in it, the scratch planes are all -HUGE_VAL
+// and serve as a map from pose to its entry in the next hypothesis list, so the motion update
+// can merge poses reached from several hypotheses without sorting. A slot holds the index of
+// the entry (below 4*BELIEF_TOPK, exact in every belief_t) and the log-beliefs are merged in
+// the list itself, in double whatever BELIEF_PRECISION is
+
+// count the poses of a tile above the cut, and the probability of those below it
+static void hyp_count_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  belief_state *bs = job->bs;
+  belief_tile *r = &bs->tile[tile];
+  double low = job->ref - log(BELIEF_LIVE_RATIO) + BELIEF_LOG_CUTOFF;
+  int from, to;
+  tile_range(bs, tile, &from, &to);
+  r->count = 0;
+  r->residual = 0;
+  for (int j = 0; j < 4; j++)
+  {
+    const belief_t *l = bs->l[j];
+    for (int i = from; i < to; i++)
+    {
+      double v = belief_load(l[i]);
+      if (v > job->ref) r->count++;
+      else if (v > low) r->residual += exp_neg(v - bs->logZ);
+    }
+  }
+}
+
+// copy a tile's poses above the cut into the hypothesis list, and clear its scratch planes
+static void hyp_gather_tile(void *arg, int tile){
+  belief_job *job = (belief_job *)arg;
+  belief_state *bs = job->bs;
+  belief_hyp *h = bs->hyp + bs->tile[tile].offset;
+  int from, to;
+  tile_range(bs, tile, &from, &to);
+  for (int j = 0; j < 4; j++)
+  {
+    const belief_t *l = bs->l[j];
+    belief_t none = belief_store(-HUGE_VAL);
+    for (int i = from; i < to; i++)
+    {
+      double v = belief_load(l[i]);
+      if (v > job->ref) {
+        h->i = i;
+        h->dir = j;
+        h->l = v;
+        h++;
+      }
+      bs->scratch[j][i] = none;
+    }
+  }
+}
+
+// switch to hypothesis mode if the poses within BELIEF_LIVE_RATIO of the best one hold all
+// but BELIEF_SPARSE_RESIDUAL of the probability
+static void hyp_enter(belief_state *bs){
+  belief_job job;
+  double residual = 0;
+  int k = 0;
+
+  job.bs = bs;
+  job.ref = belief_load(bs->l[bs->max_dir][bs->max_i]) + log(BELIEF_LIVE_RATIO);
+  run_tiles(bs, hyp_count_tile, &job);
+  for (int t = 0; t < bs->tiles; t++)
+  {
+    bs->tile[t].offset = k;
+    k += bs->tile[t].count;
+    residual += bs->tile[t].residual;
+  }
+  if (k > BELIEF_TOPK || residual > BELIEF_SPARSE_RESIDUAL || k == 4*bs->n) return;
+
+  run_tiles(bs, hyp_gather_tile, &job);
+  bs->nhyp = k;
+  bs->floor_l = bs->logZ + log((residual > 1e-300 ? residual : 1e-300)/(4.0*bs->n - k));
+  bs->hyp_mode = 1;
+  hyp_normalize(bs);
+}
+
+// logZ, entropy and argmax from the hypotheses and the floor. Goes back to dense mode if the
+// floor holds more than BELIEF_DENSE_RESIDUAL of the probability
+static void hyp_normalize(belief_state *bs){
+  double rest = 4.0*bs->n - bs->nhyp;
+  double m, sum, suml, floor_e;
+  int best = -1, second = -1;
+
+  // every pose can be a hypothesis on a small map, the floor then stands for nothing
+  if (rest == 0) bs->floor_l = -HUGE_VAL;
+  m = bs->floor_l;
+
+  for (int k = 0; k < bs->nhyp; k++)
+  {
+    if (best < 0 || bs->hyp[k].l > bs->hyp[best].l) {
+      second = best;
+      best = k;
+    } else if (second < 0 || bs->hyp[k].l > bs->hyp[second].l) {
+      second = k;
+    }
+  }
+  if (best >= 0 && bs->hyp[best].l > m) m = bs->hyp[best].l;
+  floor_e = exp_neg(bs->floor_l - m);
+  sum = rest*floor_e;
+  suml = floor_e > 0 ? rest*floor_e*bs->floor_l : 0;
+  for (int k = 0; k < bs->nhyp; k++)
+  {
+    double e = exp_neg(bs->hyp[k].l - m);
+    sum += e;
+    suml += e*bs->hyp[k].l;
+  }
+  bs->logZ = m + log(sum);
+  bs->mean_l = suml/sum;
+  if (best < 0 || rest*floor_e/sum > BELIEF_DENSE_RESIDUAL) {
+    beliefs_dense(bs);
+    normalizeBeliefs(bs);
+    return;
+  }
+  // the runner-up is the second hypothesis, or the floor if that is more likely
+  bs->sec_i = -1;
+  bs->second_l = rest > 0 ? bs->floor_l : -HUGE_VAL;
+  if (second >= 0 && bs->hyp[second].l >= bs->second_l) {
+    bs->sec_i = bs->hyp[second].i;
+    bs->sec_dir = bs->hyp[second].dir;
+    bs->second_l = bs->hyp[second].l;
+  }
+  // keep the most likely hypothesis first
+  belief_hyp tmp = bs->hyp[0];
+  bs->hyp[0] = bs->hyp[best];
+  bs->hyp[best] = tmp;
+  bs->max_i = bs->hyp[0].i;
+  bs->max_dir = bs->hyp[0].dir;
+  bs->max_l = bs->hyp[0].l;
+  if (fabs(bs->logZ) > BELIEF_REBASE) rebaseBeliefs(bs, bs->logZ);
+}
+
+// measurement update in hypothesis mode. The floor stands for 4n - nhyp poses, of which the
+// index says how many match the scan - it is scaled by their average likelihood
+static void hyp_measure(belief_state *bs, uint8_t scan){
+  const uint8_t *rot = sig_rotate[scan];
+  const double a = log(BELIEF_MATCH_FACTOR);
+  int matched = 0;
+  double rest = 4.0*bs->n - bs->nhyp;
+  double f;
+
+  for (int k = 0; k < bs->nhyp; k++)
+  {
+    if (map_sig[bs->hyp[k].i] == rot[bs->hyp[k].dir]) {
+      bs->hyp[k].l += a;
+      matched++;
+    }
+  }
+  if (rest > 0) {
+    f = ((double)(sig_index_start[scan + 1] - sig_index_start[scan]) - matched)/rest;
+    f = f < 0 ? 0 : (f > 1 ? 1 : f);
+    bs->floor_l += log_pos(1.0 + (BELIEF_MATCH_FACTOR - 1.0)*f);
+  }
+  hyp_normalize(bs);
+}
+
+// move hypotheses [from, nhyp) to the floor
+static void hyp_drop(belief_state *bs, int from){
+  if (from == bs->nhyp) return;
+  double total = bs->floor_l + log(4.0*bs->n - bs->nhyp);
+  for (int k = from; k < bs->nhyp; k++)
+  {
+    total = log_add(total, bs->hyp[k].l);
+  }
+  bs->nhyp = from;
+  bs->floor_l = total - log(4.0*bs->n - from);
+}
+
+// reorder the hypotheses so the BELIEF_TOPK most likely come first (quickselect)
+static void hyp_select(belief_state *bs){
+  int lo = 0, hi = bs->nhyp - 1;
+  while (lo < hi)
+  {
+    double pivot = bs->hyp[(lo + hi)/2].l;
+    int a = lo, b = hi;
+    while (a <= b)
+    {
+      while (bs->hyp[a].l > pivot) a++;
+      while (bs->hyp[b].l < pivot) b--;
+      if (a <= b) {
+        belief_hyp tmp = bs->hyp[a];
+        bs->hyp[a++] = bs->hyp[b];
+        bs->hyp[b--] = tmp;
+      }
+    }
+    if (BELIEF_TOPK - 1 <= b) hi = b;
+    else if (BELIEF_TOPK - 1 >= a) lo = a;
+    else break;
+  }
+}
+
+// motion update in hypothesis mode. Every hypothesis is pushed through the motion model, the
+// poses reached are merged through the scratch planes, and each gets the inflow from the
+// floor. The floor is scaled by the average likelihood of touchRed: the fraction of poses
+// facing the border touch red on the way
+static void hyp_motion(belief_state *bs, int touchRed){
+  double facing = 2.0*(bs->sx + bs->sy)/(4.0*bs->n);
+  double red = touchRed ? facing + (1.0 - facing)*BELIEF_MOTION_MISS : (1.0 - facing) + facing*BELIEF_MOTION_MISS;
+  motion_outcome out[4];
+  belief_hyp *next = bs->hyp_next;
+  belief_t none = belief_store(-HUGE_VAL);
+  int count = 0;
+
+  for (int k = 0; k < bs->nhyp; k++)
+  {
+    int n = motion_outcomes(bs->hyp[k].i%bs->sx, bs->hyp[k].i/bs->sx, bs->hyp[k].dir, bs->sx, bs->sy,
+                            bs->p_over, bs->p_under, out);
+    for (int j = 0; j < n; j++)
+    {
+      if (out[j].p <= 0) continue;
+      int i = out[j].x + out[j].y*bs->sx;
+      belief_t *slot = &bs->scratch[out[j].dir][i];
+      double v = bs->hyp[k].l + log(out[j].p*(out[j].red == touchRed ? 1.0 : BELIEF_MOTION_MISS));
+      if (*slot == none) {
+        *slot = (belief_t)count;
+        next[count].i = i;
+        next[count].dir = out[j].dir;
+        next[count].l = v;
+        count++;
+      } else {
+        belief_hyp *h = &next[(int)*slot];
+        h->l = log_add(h->l, v);
+      }
+    }
+  }
+  bs->floor_l += log(red);
+  for (int k = 0; k < count; k++)
+  {
+    next[k].l = log_add(next[k].l, bs->floor_l);
+    bs->scratch[next[k].dir][next[k].i] = none;
+  }
+  bs->hyp_next = bs->hyp;
+  bs->hyp = next;
+  bs->nhyp = count;
+  // poses that fell more than BELIEF_LIVE_RATIO below the best go into the floor, and so do
+  // the least likely ones if there are still more than BELIEF_TOPK
+  double cut = -HUGE_VAL;
+  for (int k = 0; k < count; k++)
+  {
+    if (next[k].l > cut) cut = next[k].l;
+  }
+  cut += log(BELIEF_LIVE_RATIO);
+  int live = 0;
+  for (int k = 0; k < count; k++)
+  {
+    if (next[k].l > cut) {
+      belief_hyp tmp = next[live];
+      next[live++] = next[k];
+      next[k] = tmp;
+    }
+  }
+  hyp_drop(bs, live);
+  if (bs->nhyp > BELIEF_TOPK) {
+    hyp_select(bs);
+    hyp_drop(bs, BELIEF_TOPK);
+  }
+  hyp_normalize(bs);
+}
+
+// turn update, the robot turned in place by quarter_turns clockwise quarter turns (1 right,
+// 2 around, 3 left; negative values turn left). A robot facing d now faces d+quarter_turns,
+// so the plane for d becomes the plane for d+quarter_turns
+void updateBeliefByTurn(belief_state *bs, int quarter_turns){
+  int k = ((quarter_turns%4) + 4)%4;
+  belief_t *planes[4];
+  if (k == 0) return;
+  for (int h = 0; h < bs->nhyp; h++)
+  {
+    bs->hyp[h].dir = (bs->hyp[h].dir + k)%4;
+  }
+  for (int d = 0; d < 4; d++)
+  {
+    planes[(d + k)%4] = bs->l[d];
+  }
+  for (int d = 0; d < 4; d++)
+  {
+    bs->l[d] = planes[d];
+  }
+  bs->max_dir = (bs->max_dir + k)%4;
+  bs->sec_dir = (bs->sec_dir + k)%4;
+}
+
+// number of scan signatures, the scan model spreads over all of them
+#define SCAN_OUTCOMES 256
+
+// entropy (nats) of the predicted next observation, given hist[red][s] - the probability that
+// the robot touches red (or not) and ends where the map shows signature s. The scan then
+// reads s with likelihood M/(M+255) and any other signature with 1/(M+255)
+static double observation_entropy(const double hist[2][SCAN_OUTCOMES]){
+  const double M = BELIEF_MATCH_FACTOR, norm = 1.0/(M + SCAN_OUTCOMES - 1);
+  double h = 0;
+  for (int r = 0; r < 2; r++)
+  {
+    double total = 0, base;
+    int empty = 0;
+    for (int s = 0; s < SCAN_OUTCOMES; s++)
+    {
+      total += hist[r][s];
+    }
+    if (total <= 0) continue;
+    base = total*norm;
+    for (int s = 0; s < SCAN_OUTCOMES; s++)
+    {
+      if (hist[r][s] > 0) {
+        double p = base + (M - 1.0)*hist[r][s]*norm;
+        h -= p*log(p);
+      } else {
+        empty++;
+      }
+    }
+    h -= empty*base*log(base);
+  }
+  return h;
+}
+
+// exploration planner. For each action at an intersection - drive straight on, turn right,
+// turn around or turn left (0..3 clockwise quarter turns) and then drive to the next
+// intersection - predicts the next observation (touching red, and the scan there) under the
+// current belief and the motion model. The scan noise is the same whatever the action, so the
+// expected information gain of an action is the entropy of its predicted observation less the
+// entropy of the scan model alone. Returns the action with the most gain per second of
+// expected time (turning, driving, a U-turn on red, the next scan), and leaves the gain of
+// each action (nats) in gain[] if it is not NULL
+int beliefs_plan(belief_state *bs, double *gain){
+  double hist[4][2][SCAN_OUTCOMES];
+  const double M = BELIEF_MATCH_FACTOR, norm = 1.0/(M + SCAN_OUTCOMES - 1);
+  const double noise = -(M*norm*log(M*norm) + (SCAN_OUTCOMES - 1)*norm*log(norm));
+  double seconds[4] = {0, 0, 0, 0};
+  double cut = bs->max_l + log(BELIEF_PLAN_CUTOFF), floor_p = 0;
+  motion_outcome out[4];
+  int best = 0;
+  double best_rate = -1;
+
+  memset(hist, 0, sizeof(hist));
+  for (int k = 0; k < (bs->hyp_mode ? bs->nhyp : 4*bs->n); k++)
+  {
+    int i, d;
+    double l;
+    if (bs->hyp_mode) {
+      i = bs->hyp[k].i;
+      d = bs->hyp[k].dir;
+      l = bs->hyp[k].l;
+    } else {
+      i = k%bs->n;
+      d = k/bs->n;
+      l = belief_load(bs->l[d][i]);
+    }
+    if (l < cut) continue;
+    double p = exp_neg(l - bs->logZ);
+    for (int q = 0; q < 4; q++)
+    {
+      int n = motion_outcomes(i%bs->sx, i/bs->sx, (d + q)%4, bs->sx, bs->sy, bs->p_over, bs->p_under, out);
+      for (int j = 0; j < n; j++)
+      {
+        int dest = out[j].x + out[j].y*bs->sx;
+        // what a robot facing out[j].dir there scans, see EV3_Map.h
+        uint8_t s = sig_rotate[map_sig[dest]][(4 - out[j].dir)%4];
+        double w = p*out[j].p;
+        hist[q][out[j].red][s] += w;
+        seconds[q] += w*(out[j].red ? BELIEF_TIME_DRIVE + 2*BELIEF_TIME_TURN : BELIEF_TIME_DRIVE);
+      }
+    }
+  }
+  // the floor's poses are spread over the map, their scans follow the whole map's signatures
+  if (bs->hyp_mode && bs->floor_l > -HUGE_VAL) {
+    floor_p = (4.0*bs->n - bs->nhyp)*exp_neg(bs->floor_l - bs->logZ);
+  }
+
+  for (int q = 0; q < 4; q++)
+  {
+    double mass = 0;
+    for (int s = 0; s < SCAN_OUTCOMES && floor_p > 0; s++)
+    {
+      hist[q][0][s] += floor_p*(sig_index_start[s + 1] - sig_index_start[s])/(4.0*bs->n);
+    }
+    for (int s = 0; s < SCAN_OUTCOMES; s++)
+    {
+      mass += hist[q][0][s] + hist[q][1][s];
+    }
+    double g = observation_entropy(hist[q]) - noise;
+    double t = (mass > 0 ? seconds[q]/mass : BELIEF_TIME_DRIVE) + (q == 2 ? 2 : (q ? 1 : 0))*BELIEF_TIME_TURN + BELIEF_TIME_SCAN;
+    g = g > 0 ? g : 0;
+    if (gain) gain[q] = g;
+    if (g/t > best_rate) {
+      best_rate = g/t;
+      best = q;
+    }
+  }
+  return best;
+}
+
+// return the first direction in which the two sets of building colours match, -1 if none
+int color_match(int *tl1, int *tr1, int *br1, int *bl1, int *tl2, int *tr2, int *br2, int *bl2){
+  const uint8_t *rot = sig_rotate[color_signature(*tl1, *tr1, *br1, *bl1)];
+  uint8_t s = color_signature(*tl2, *tr2, *br2, *bl2);
+  // bit d set when direction d matches, the lowest set bit is the answer
+  int hits = (rot[0] == s) | ((rot[1] == s) << 1) | ((rot[2] == s) << 2) | ((rot[3] == s) << 3);
+  return hits ? __builtin_ctz(hits) : -1;
+}
@@ -0,0 +1,298 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Histogram localization beliefs. A belief_state holds, for every intersection in the map and
+ each of the 4 directions the robot could be facing, the (log of the) belief that the robot
+ is there:
+
+    l[0][i] <---- belief the robot is at intersection with index i, facing UP
+    l[1][i] <---- belief the robot is at intersection with index i, facing RIGHT
+    l[2][i] <---- belief the robot is at intersection with index i, facing DOWN
+    l[3][i] <---- belief the robot is at intersection with index i, facing LEFT
+
+ with intersections in the same raster order as the map[][] array. Each direction is its own
+ contiguous plane (structure of arrays), so an update streams through the planes with unit
+ stride and can process several intersections per vector instruction.
+
+ Storage is sized from the parsed map and allocated on the heap in one block, each plane
+ 64-byte aligned and padded to a whole number of cache lines. A second set of planes is kept
+ for the motion update to write into - so no update needs stack space proportional to the map.
+
+ Beliefs are stored as unnormalized log-probabilities, the probability of a pose is
+ exp(l[d][i] - logZ). Measurement and motion updates are additions, so repeated likelihood
+ factors can never underflow a belief to 0 however long the robot runs. Normalization is
+ lazy: only logZ is kept up to date, and the stored values are rebased only when they drift
+ far enough from 0 to lose precision.
+
+ normalizeBeliefs() recomputes logZ with a single fused log-sum-exp pass, which also finds
+ the most likely pose, the runner-up and the entropy of the belief. Poses more than
+ BELIEF_LOG_CUTOFF below the most likely one add less than the rounding error of the sum, so
+ the pass skips their exp().
+
+ Every update keeps the most likely pose, the runner-up and the entropy current, so
+ beliefsHasUnipueMax() is O(1): the belief has converged once the best pose is
+ converge_ratio times as likely as the runner-up, or once its entropy is down to
+ converge_entropy. A tie, however exact, never passes the ratio test.
+
+ The motion update is driven by transition tables compiled from the map. Every intersection
+ falls into one of up to 81 boundary classes, by its distance (0, 1, or 2 or more) to each of
+ the four borders, and all intersections of a class move the same way. For each class, each
+ touchRed outcome and each destination direction, the table lists the source poses (as an
+ index offset and a direction) and the log-probability of moving from each to the
+ destination. The motion model, for a robot at an intersection driving forward:
+
+    exact  (1 - p_over - p_under)  stops at the next intersection
+    over   p_over                  misses a yellow and stops one intersection further on
+    under  p_under                 stops without reaching the next intersection
+
+ A robot facing the border hits red, turns around and drives back; it ends at the same
+ intersection facing the other way (or, on an overshoot, one beyond it). Outcomes that
+ disagree with whether red was actually touched are scaled by BELIEF_MOTION_MISS. The update
+ reads one set of planes and writes the other, then swaps them. It goes along each row in
+ runs of one class, taking the stencil once per run: all of a row but the two intersections
+ at either end is one run, and away from the border its stencils are the same 3 terms, which
+ get a copy of the kernel with the loop over the terms unrolled - and with AVX2, a kernel that
+ does 4 destinations at a time with vector versions of the exp and log, with no branches.
+
+ Turning in place at an intersection only changes which direction each plane stands for, so
+ updateBeliefByTurn() remaps the plane pointers (and the argmax direction) in O(1), whatever
+ the size of the map. The planes are separate arrays, so there is no data to put back in
+ order afterwards - every other update goes through l[] and sees the turned belief.
+
+ After a few scans nearly all the probability is on a handful of poses, and sweeping the
+ whole map on every update is wasted work. Once the poses within BELIEF_LIVE_RATIO of the best
+ one are at most BELIEF_TOPK and hold all but BELIEF_SPARSE_RESIDUAL of the probability, the
+ belief switches to hypothesis mode: a list of those poses, plus a floor - one log-belief
+ shared by every other pose. Updates then cost O(number of hypotheses):
+
+ * measurement - each hypothesis is checked against the scan, the floor is scaled by the
+   average likelihood of the poses it stands for (from the inverted index counts)
+ * motion - each hypothesis is pushed through the motion model and merged with the inflow
+   from the floor, the floor is scaled by the average red/no-red likelihood. If there are
+   more than BELIEF_TOPK hypotheses afterwards, the least likely go into the floor
+ * turn - the hypotheses' directions are rotated
+
+ When the floor's share of the probability grows past BELIEF_DENSE_RESIDUAL the robot looks
+ lost, the belief is written back into the planes and updates go back to dense mode.
+ Anything that reads l[] directly must check hyp_mode first, or call beliefs_dense().
+
+ In dense mode, a measurement update touches only the poses that match the scan (found
+ through the inverted index in EV3_Map.h) - log(BELIEF_MATCH_FACTOR) is added to their
+ beliefs, and logZ, the argmax and the entropy are updated from those poses alone. When a
+ scan matches a large fraction of the map, walking the index is slower than a straight pass,
+ so the measurement update falls back to a dense kernel that compares the signature of the
+ scan against map_sig[] for all four rotations at once, followed by normalizeBeliefs(). With
+ AVX2 (build with -march=native on a machine that has it) the dense kernel runs 4
+ intersections per instruction, otherwise a scalar loop does the same work.
+
+ beliefs_plan() picks where to go next from an intersection: straight on, right, around or
+ left. It predicts, for each, the distribution of the next observation (red or not, and the
+ scan at the next intersection) and returns the one with the most expected information gain
+ per second of expected motion and scan time. It costs one pass over the poses within
+ BELIEF_PLAN_CUTOFF of the best (the hypotheses, in hypothesis mode), with 4 actions each.
+
+ On large maps the dense passes - the measurement kernel, the motion update, normalization
+ and the scan for hypothesis mode - run on a thread pool (EV3_Pool.h) set up by
+ beliefs_set_threads(). The intersections are split into tiles of BELIEF_TILE, small enough
+ for one tile's planes to stay in L2 cache, and each pass is a job with one task per tile.
+ The motion stencil reads up to two rows beyond its tile; the source planes are read-only
+ during the pass, so a tile reads its halo straight from its neighbours' rows and there is
+ nothing to exchange. Each tile keeps its own partial sums, maximum and runner-up in
+ tile[], and they are combined in tile order afterwards, so the result is the same to the
+ last bit whatever the number of threads. A map of one tile runs on the calling thread.
+
+ Every update also records how likely its observation was under the belief before it, in
+ obs_p - for a scan, the probability the poses matching it held, for a drive, that of the
+ red border being touched (or not) as it was. Both come from the change in logZ, so they cost
+ nothing. Once the belief has converged, an observation less likely than BELIEF_KIDNAP_P is
+ implausible, and BELIEF_KIDNAP_COUNT of them in a row (one can be a misread) make
+ beliefs_kidnapped() true: the robot is not where the belief says. beliefs_mix_uniform()
+ then mixes a uniform belief back in, so localization can carry on from wherever the robot
+ is. The old belief keeps only a small share (1 - BELIEF_KIDNAP_MIX): the implausible scans
+ have already been applied to it and favour poses that happen to fit them, which would
+ otherwise win the next few scans against the robot's real pose.
+
+ A scan can also be streamed in one building at a time with updateBeliefByBuilding(), as
+ the robot reads them. That needs a model that factors over the buildings: each building
+ that matches the map multiplies a pose by BELIEF_BUILDING_FACTOR, whose 4th power is
+ BELIEF_MATCH_FACTOR, so a pose that matches the whole scan gains as much as it would from
+ updateBeliefByColor(), but one that matches three buildings is no longer treated like one
+ that matches none. After each building, beliefs_scan_settled() says whether the buildings
+ still unread can change the most likely pose - they can raise no pose by more than
+ BELIEF_BUILDING_FACTOR each - so the robot can cut the scan short. beliefs_scan_done()
+ ends the scan and records its likelihood for beliefs_kidnapped(), scaled so that a belief
+ sure of a pose that matched every building read scores 1, and one that knows nothing scores
+ 0.
+
+ The planes' storage precision is chosen at compile time with BELIEF_PRECISION (e.g.
+ -DBELIEF_PRECISION=1 on the g++ line): double (the default), float for half the memory and
+ bandwidth, or 16-bit fixed point (BELIEF_Q_SCALE steps per nat) for a quarter. Only the
+ planes change - logZ, the sums of the normalization pass, the hypotheses and everything
+ derived from them stay double, and each value is converted as it is loaded or stored. To
+ keep the stored values where the narrow types are precise, they are rebased once logZ
+ drifts BELIEF_REBASE from 0, which for float and fixed point is a few scans. Fixed point
+ saturates instead of overflowing, keeps -infinity as BELIEF_Q_NONE, and its range leaves
+ more than 100 nats below the best pose, far past BELIEF_LOG_CUTOFF. The ratio test in
+ beliefsHasUnipueMax() demands an extra BELIEF_QUANTUM, so that rounding of the stored values
+ alone can never make a tie pass it. Tools/belief_bench reports the memory, bandwidth and
+ accuracy of each precision.
+
+ beliefs_snapshot() copies the belief into a flat buffer (the hypotheses alone in hypothesis
+ mode, the four planes otherwise) and beliefs_restore() loads one back, so a run can be
+ checkpointed and picked up again (EV3_Checkpoint.h). The motion model, thresholds and
+ threads are settings, not state, and are not part of it.
+
+*/
+
+#ifndef __beliefs_header
+#define __beliefs_header
+
+#include<stddef.h>
+#include<stdint.h>
+#include "EV3_Pool.h"
+
+#define BELIEF_MATCH_FACTOR 6561.0  // Likelihood ratio of a matching scan (9^4)
+#define BELIEF_BUILDING_FACTOR 9.0  // Likelihood ratio of one matching building, when streamed
+#define BELIEF_LOG_CUTOFF -50.0     // Log-ratio to the best pose below which exp() is skipped
+#define BELIEF_CONVERGE_RATIO 10.0  // Converged once the best pose is this many times the runner-up
+#define BELIEF_CONVERGE_ENTROPY 0.0 // or once the entropy (nats) is down to this, 0 for off
+#define BELIEF_MOTION_MISS 1e-6     // Likelihood of a move that disagrees with touchRed
+#define BELIEF_P_OVER 0.05          // Default chance of driving past the next intersection
+#define BELIEF_P_UNDER 0.05         // Default chance of stopping short of it
+#define BELIEF_TOPK 2048            // Most hypotheses kept in hypothesis mode
+#define BELIEF_LIVE_RATIO 1e-9      // Poses less likely than this, relative to the best, are floor
+#define BELIEF_SPARSE_RESIDUAL 1e-4 // Switch to hypothesis mode when the floor holds less than this
+#define BELIEF_DENSE_RESIDUAL 1e-2  // and back to dense mode when it holds more than this
+#define BELIEF_TIME_DRIVE 4.0       // Seconds to drive to the next intersection (for planning)
+#define BELIEF_TIME_TURN 2.0        // Seconds per quarter turn at an intersection
+#define BELIEF_TIME_SCAN 8.0        // Seconds for an intersection scan
+#define BELIEF_PLAN_CUTOFF 1e-9     // Poses less likely than this, relative to the best, are
+                                    // not planned for
+#define BELIEF_KIDNAP_P 0.01        // Observations less likely than this under a converged
+                                    // belief are implausible
+#define BELIEF_KIDNAP_COUNT 2       // This many implausible observations in a row mean the
+                                    // robot was moved
+#define BELIEF_KIDNAP_MIX 0.999     // Weight of the uniform belief mixed in to localize again
+#define BELIEF_TILE 2048            // Intersections per task of the parallel passes
+#define MOTION_CLASSES 81           // Boundary classes, 3 distance classes to each border
+
+#define BELIEF_DOUBLE 0             // Values of BELIEF_PRECISION
+#define BELIEF_FLOAT 1
+#define BELIEF_FIXED16 2
+#ifndef BELIEF_PRECISION
+#define BELIEF_PRECISION BELIEF_DOUBLE
+#endif
+
+#if BELIEF_PRECISION == BELIEF_FIXED16
+typedef int16_t belief_t;
+#define BELIEF_Q_SCALE 256.0        // Fixed point steps per nat
+#define BELIEF_Q_NONE INT16_MIN     // Stands for -infinity
+#define BELIEF_QUANTUM (2.0/BELIEF_Q_SCALE)  // Rounding a stored value can add to a difference
+#define BELIEF_REBASE 16.0          // Rebase the stored beliefs once logZ gets this far from 0
+#elif BELIEF_PRECISION == BELIEF_FLOAT
+typedef float belief_t;
+#define BELIEF_QUANTUM 1e-5
+#define BELIEF_REBASE 16.0
+#else
+typedef double belief_t;
+#define BELIEF_QUANTUM 0.0
+#define BELIEF_REBASE 1e6
+#endif
+#define MOTION_MAX_TERMS 8          // Most source poses any destination can have
+
+typedef struct motion_term
+{
+ int offset;                // Source intersection index, relative to the destination
+ int dir;                   // Source direction
+ double logw;               // log-probability of the move from the source
+} motion_term;
+
+typedef struct motion_stencil
+{
+ int count;
+ motion_term term[MOTION_MAX_TERMS];
+} motion_stencil;
+
+typedef struct belief_hyp
+{
+ int i, dir;                // Pose
+ double l;                  // Log-belief
+} belief_hyp;
+
+typedef struct belief_tile
+{
+ double logsum;             // log of the sum of exp(l) over the tile
+ double mean;               // Expected value of l over the tile
+ double best, second;       // Most likely pose in the tile and the runner-up
+ int best_i, best_dir, sec_i, sec_dir;
+ int live;                  // Poses within BELIEF_LIVE_RATIO of m
+ int count;                 // hyp_enter(): poses above the cut, and where they go in hyp[]
+ int offset;
+ double residual;           // hyp_enter(): probability of the poses below it
+} belief_tile;
+
+typedef struct belief_state
+{
+ int sx, sy;                // Map size (intersections along x and y)
+ int n;                     // Number of intersections, sx*sy
+ int stride;                // Entries between the start of consecutive planes
+ belief_t *l[4];            // Log-belief planes, one per direction, n entries each
+ belief_t *scratch[4];      // Second set of planes for the motion update
+ belief_t *block;           // The allocation holding all 8 planes
+ double logZ;               // log of the sum of exp(l), probability = exp(l[d][i] - logZ)
+ double mean_l;             // Expected value of l under the belief, entropy = logZ - mean_l
+ int max_i, max_dir;        // Most likely pose
+ double max_l;              // and its log-belief
+ int sec_i, sec_dir;        // Runner-up pose, sec_i is -1 when only a bound is known
+ double second_l;           // Runner-up log-belief (or an upper bound on it)
+ double converge_ratio;     // Thresholds for beliefsHasUnipueMax()
+ double converge_entropy;
+ unsigned char *motion_class;               // Boundary class of each intersection
+ motion_stencil (*motion)[2][4];            // [class][touchRed][destination direction]
+ double p_over, p_under;                    // Motion model the tables were built for
+ int hyp_mode;              // 1 in hypothesis mode, the planes are stale then
+ belief_hyp *hyp;           // Hypotheses, nhyp of them
+ belief_hyp *hyp_next;      // Second list for the motion update
+ int nhyp;
+ double floor_l;            // Log-belief of every pose that is not a hypothesis
+ work_pool *pool;           // Threads for the dense passes, NULL for the calling thread only
+ belief_tile *tile;         // Partial results of the dense passes, one per tile
+ int tiles;
+ double shift;              // Total subtracted from the stored beliefs by rebasing
+ double obs_p;              // Likelihood of the last observation under the belief before it
+ int surprise;              // Implausible observations in a row, see beliefs_kidnapped()
+ int scan_read;             // Buildings of the streamed scan so far, 0 between scans
+ int scan_converged;        // Whether the belief had converged before the streamed scan
+ double scan_before;        // logZ + shift before it
+ double scan_base;          // log of the growth a belief that knows nothing would see
+} belief_state;
+
+int beliefs_init(belief_state *bs, int nx, int ny);
+void beliefs_free(belief_state *bs);
+void beliefs_uniform(belief_state *bs);
+void beliefs_dense(belief_state *bs);
+double beliefsGet(belief_state *bs, int i, int direction);
+double beliefsEntropy(belief_state *bs);
+void printBeliefs(belief_state *bs);
+void normalizeBeliefs(belief_state *bs);
+int beliefsHasUnipueMax(belief_state *bs);
+double beliefsArgMax(belief_state *bs, int *x, int *y, int *direction);
+void updateBeliefByColor(belief_state *bs, int *tl, int *tr, int *br, int *bl);
+void updateBeliefByBuilding(belief_state *bs, int position, int colour);
+int beliefs_scan_settled(belief_state *bs);
+void beliefs_scan_done(belief_state *bs);
+void beliefs_set_motion(belief_state *bs, double p_over, double p_under);
+void beliefs_set_convergence(belief_state *bs, double ratio, double entropy);
+int beliefs_set_threads(belief_state *bs, int threads);
+int beliefs_kidnapped(belief_state *bs);
+void beliefs_mix_uniform(belief_state *bs, double w);
+size_t beliefs_snapshot_size(belief_state *bs);
+void beliefs_snapshot(belief_state *bs, unsigned char *buf);
+int beliefs_restore(belief_state *bs, const unsigned char *buf, size_t len);
+void updateBeliefByAction(belief_state *bs, int touchRed);
+void updateBeliefByTurn(belief_state *bs, int quarter_turns);
+int beliefs_plan(belief_state *bs, double *gain);
+int color_match(int *tl1, int *tr1, int *br1, int *bl1, int *tl2, int *tr2, int *br2, int *bl2);
+
+#endif
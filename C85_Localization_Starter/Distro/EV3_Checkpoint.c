@@ -0,0 +1,135 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Mission checkpoints - see EV3_Checkpoint.h for the file layout.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include "EV3_Map.h"
+#include "EV3_Checkpoint.h"
+
+static_assert(sizeof(mission_state) == 36, "mission layout is part of the file format");
+static_assert(sizeof(checkpoint_header) == 68, "checkpoint header layout is part of the file format");
+
+static uint32_t fnv1a(uint32_t h, const unsigned char *p, size_t len)
+{
+  for (size_t k = 0; k < len; k++)
+  {
+    h = (h ^ p[k])*16777619u;
+  }
+  return h;
+}
+
+// make a rename in the directory holding filename durable
+static void sync_dir(const char *filename)
+{
+  char dir[1024];
+  const char *slash = strrchr(filename, '/');
+  int fd;
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else {
+    size_t len = slash == filename ? 1 : (size_t)(slash - filename);
+    if (len >= sizeof(dir)) return;
+    memcpy(dir, filename, len);
+    dir[len] = '\0';
+  }
+  fd = open(dir, O_RDONLY);
+  if (fd < 0) return;
+  fsync(fd);
+  close(fd);
+}
+
+// write the mission and the belief to filename, replacing it atomically. Returns 1 on success
+int checkpoint_save(const char *filename, const mission_state *m, belief_state *bs)
+{
+  checkpoint_header h;
+  unsigned char *buf;
+  size_t len = beliefs_snapshot_size(bs);
+  char tmp[1024];
+  FILE *f;
+  int ok;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp)) return 0;
+  buf = (unsigned char *)malloc(len);
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory writing checkpoint %s\n", filename);
+    return 0;
+  }
+  beliefs_snapshot(bs, buf);
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, 8);
+  h.sx = sx;
+  h.sy = sy;
+  h.map_hash = map_hash();
+  h.belief_bytes = (uint32_t)len;
+  h.mission = *m;
+  h.checksum = fnv1a(fnv1a(2166136261u, (const unsigned char *)&h.mission, sizeof(mission_state)), buf, len);
+
+  f = fopen(tmp, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to create checkpoint %s\n", tmp);
+    free(buf);
+    return 0;
+  }
+  ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(buf, 1, len, f) == len;
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  free(buf);
+  if (!ok || rename(tmp, filename) != 0) {
+    fprintf(stderr, "Unable to write checkpoint %s\n", filename);
+    remove(tmp);
+    return 0;
+  }
+  sync_dir(filename);
+  return 1;
+}
+
+// read a checkpoint for the parsed map into m and bs. Returns 1 on success, 0 (leaving both
+// as they were) if there is none or it does not check out
+int checkpoint_load(const char *filename, mission_state *m, belief_state *bs)
+{
+  checkpoint_header h;
+  unsigned char *buf;
+  FILE *f = fopen(filename, "rb");
+  int ok;
+
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open checkpoint %s\n", filename);
+    return 0;
+  }
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CHECKPOINT_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s is not a checkpoint\n", filename);
+    fclose(f);
+    return 0;
+  }
+  if (h.sx != sx || h.sy != sy || h.map_hash != map_hash()) {
+    fprintf(stderr, "Checkpoint %s was saved for a different map\n", filename);
+    fclose(f);
+    return 0;
+  }
+  buf = (unsigned char *)malloc(h.belief_bytes > 0 ? h.belief_bytes : 1);
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory reading checkpoint %s\n", filename);
+    fclose(f);
+    return 0;
+  }
+  ok = fread(buf, 1, h.belief_bytes, f) == h.belief_bytes && fgetc(f) == EOF;
+  fclose(f);
+  ok = ok && h.checksum == fnv1a(fnv1a(2166136261u, (const unsigned char *)&h.mission, sizeof(mission_state)), buf, h.belief_bytes);
+  ok = ok && beliefs_restore(bs, buf, h.belief_bytes);
+  free(buf);
+  if (!ok) {
+    fprintf(stderr, "Checkpoint %s is corrupt\n", filename);
+    return 0;
+  }
+  *m = h.mission;
+  return 1;
+}
@@ -0,0 +1,64 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Mission checkpoints. The Bluetooth link to the robot can drop in the middle of a run, and
+ the laptop side can crash or be killed with it. To avoid localizing from scratch after a
+ reconnect, EV3_Localization saves the belief (beliefs_snapshot() in EV3_Beliefs.h), the
+ mission - target, phase and last known pose - and the colour calibration it classified
+ with to a small binary file after every update, and --resume picks the run up from it.
+
+ File layout:
+
+    checkpoint_header       (includes the mission_state)
+    belief snapshot         (belief_bytes bytes)
+
+ checkpoint_save() writes to <file>.tmp, syncs it, and renames it over <file>, so the
+ checkpoint on disk is always a complete one - the old one until the rename, the new one
+ after. checkpoint_load() checks the magic, the map it was saved for and a checksum over
+ the mission and the belief before touching anything.
+
+ A checkpoint saved with a drive pending (PENDING_DRIVE) was written just before the robot
+ set off for the next intersection: the drive may or may not have happened, and the robot
+ must finish it before the belief is good again.
+
+*/
+
+#ifndef __checkpoint_header
+#define __checkpoint_header
+
+#include<stdint.h>
+#include "EV3_Beliefs.h"
+
+#define CHECKPOINT_MAGIC "EV3CKP01"
+#define MISSION_LOCALIZE 0          // Working out where the robot is
+#define MISSION_TARGET 1            // Localized, driving to the target
+#define MISSION_DONE 2              // At the target
+#define PENDING_NONE 0              // Belief is up to date with the robot
+#define PENDING_DRIVE 1             // Saved just before driving to the next intersection
+
+typedef struct mission_state
+{
+ int32_t dest_x, dest_y;    // Target intersection
+ int32_t phase;             // MISSION_LOCALIZE, MISSION_TARGET or MISSION_DONE
+ int32_t pending;           // PENDING_NONE or PENDING_DRIVE
+ int32_t x, y, dir;         // Most likely pose when saved
+ uint32_t profile;          // color_profile_id() of the calibration in use
+ uint32_t seq;              // Checkpoints written so far in this run
+} mission_state;
+
+typedef struct checkpoint_header
+{
+ char magic[8];             // CHECKPOINT_MAGIC
+ int32_t sx, sy;            // Map size
+ uint32_t map_hash;         // map_hash() of the map
+ uint32_t belief_bytes;     // Size of the belief snapshot after the header
+ uint32_t checksum;         // FNV-1a over the mission and the belief snapshot
+ uint32_t pad;
+ mission_state mission;
+} checkpoint_header;
+
+int checkpoint_save(const char *filename, const mission_state *m, belief_state *bs);
+int checkpoint_load(const char *filename, mission_state *m, belief_state *bs);
+
+#endif
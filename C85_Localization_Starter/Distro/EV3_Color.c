@@ -0,0 +1,345 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Colour sensor signal management - see EV3_Color.h for an overview.
+
+*/
+
+#include<string.h>
+#include<stdlib.h>
+#include<math.h>
+#include "EV3_Color.h"
+#include "EV3_ColorModel.h"
+
+const char color_names[6]={'r','g','b','k','y','w'};
+
+int color_metric = COLOR_METRIC_RGB;
+
+static int tables_ready = 0;
+static int recip[COLOR_RAW_MAX+1];          // (1<<20)/i, recip[0] unused
+static int lab_f[4096];                     // Lab f(t) for t=i/1024, scaled by 1024
+static long long inv_white[3];              // (1<<40)/(white point X,Y,Z scaled by 4096)
+static color_hsv ref_hsv[COLOR_MODEL_SIZE];  // Model prototypes in each colour space
+static color_lab ref_lab[COLOR_MODEL_SIZE];
+
+// the HSV prototypes again, one array per component and padded to a multiple of 8 with
+// prototypes too far away to ever be nearest, so what_color_hsv() can score them all in
+// one fixed-length loop the compiler vectorizes
+#define HSV_LANES ((COLOR_MODEL_SIZE + 7) & ~7)
+#define HSV_PAD_V (1 << 14)
+static int hsv_h[HSV_LANES], hsv_s[HSV_LANES], hsv_v[HSV_LANES], hsv_w[HSV_LANES];
+
+// index of a colour character in color_names[], white for anything unknown
+static int color_slot(char c)
+{
+  for (int i = 0; i < 5; i++)
+  {
+    if (color_names[i] == c) return i;
+  }
+  return 5;
+}
+
+// reset the filter, the first sample pushed afterwards becomes the debounced colour
+void color_filter_init(color_filter *f, int hold)
+{
+  memset(f, 0, sizeof(color_filter));
+  f->hold = hold < 1 ? 1 : hold;
+}
+
+// add a classified sample to the filter. Returns 1 and fills in ev (if not NULL) when the
+// debounced colour changes, 0 otherwise
+int color_filter_push(color_filter *f, char c, color_event *ev)
+{
+  int votes[6] = {0, 0, 0, 0, 0, 0};
+  int winner;
+
+  f->ring[f->head] = c;
+  f->head = (f->head + 1) % COLOR_FILTER_LEN;
+  if (f->count < COLOR_FILTER_LEN) f->count++;
+
+  if (f->state == 0) {
+    f->state = c;
+    f->confidence = 1.0;
+    return 0;
+  }
+
+  for (int i = 0; i < f->count; i++)
+  {
+    votes[color_slot(f->ring[i])]++;
+  }
+
+  // ties go to the current colour, so a 50/50 window never flips the state
+  winner = color_slot(f->state);
+  for (int i = 0; i < 6; i++)
+  {
+    if (votes[i] > votes[winner]) winner = i;
+  }
+
+  if (color_names[winner] == f->state) {
+    f->run = 0;
+    f->candidate = 0;
+    f->confidence = (double)votes[winner]/(double)f->count;
+    return 0;
+  }
+
+  if (color_names[winner] == f->candidate) {
+    f->run++;
+  } else {
+    f->candidate = color_names[winner];
+    f->run = 1;
+  }
+  if (f->run < f->hold) {
+    return 0;
+  }
+
+  if (ev != NULL) {
+    ev->from = f->state;
+    ev->to = f->candidate;
+    ev->confidence = (double)votes[winner]/(double)f->count;
+  }
+  f->state = f->candidate;
+  f->confidence = (double)votes[winner]/(double)f->count;
+  f->candidate = 0;
+  f->run = 0;
+  return 1;
+}
+
+// build the lookup tables for the HSV and Lab paths, and convert the model prototypes
+void color_space_init(void)
+{
+  int white[3];
+
+  recip[0] = 0;
+  for (int i = 1; i <= COLOR_RAW_MAX; i++)
+  {
+    recip[i] = (1 << 20)/i;
+  }
+  for (int i = 0; i < 4096; i++)
+  {
+    double t = (double)i/1024.0;
+    double f = t > 0.008856 ? cbrt(t) : 7.787*t + 16.0/116.0;
+    lab_f[i] = (int)(f*1024.0 + 0.5);
+  }
+
+  // the mean white prototype is the Lab white point, so the sensor's own white maps to L=100
+  white[0] = white[1] = white[2] = 0;
+  for (int i = 0, n = 0; i < COLOR_MODEL_SIZE; i++)
+  {
+    if (color_model_label[i] != 'w') continue;
+    n++;
+    for (int k = 0; k < 3; k++)
+    {
+      white[k] += (color_model_proto[i][k] - white[k])/n;
+    }
+  }
+  for (int k = 0; k < 3; k++)
+  {
+    if (white[k] <= 0) white[k] = 1;
+  }
+  inv_white[0] = (1LL << 40)/(1689LL*white[0] + 1465LL*white[1] + 739LL*white[2]);
+  inv_white[1] = (1LL << 40)/(871LL*white[0] + 2929LL*white[1] + 296LL*white[2]);
+  inv_white[2] = (1LL << 40)/(79LL*white[0] + 488LL*white[1] + 3893LL*white[2]);
+  tables_ready = 1;
+
+  for (int i = 0; i < COLOR_MODEL_SIZE; i++)
+  {
+    rgb_to_hsv(color_model_proto[i], &ref_hsv[i]);
+    rgb_to_lab(color_model_proto[i], &ref_lab[i]);
+  }
+  for (int i = 0; i < HSV_LANES; i++)
+  {
+    hsv_h[i] = i < COLOR_MODEL_SIZE ? ref_hsv[i].h : 0;
+    hsv_s[i] = i < COLOR_MODEL_SIZE ? ref_hsv[i].s : 0;
+    hsv_v[i] = i < COLOR_MODEL_SIZE ? ref_hsv[i].v : HSV_PAD_V;
+    hsv_w[i] = i < COLOR_MODEL_SIZE ? ref_hsv[i].w : 0;
+  }
+}
+
+// parse a metric name ("rgb", "hsv" or "lab"), returns -1 if the name is not known
+int color_metric_from_name(const char *name)
+{
+  if (strcmp(name, "rgb") == 0) return COLOR_METRIC_RGB;
+  if (strcmp(name, "hsv") == 0) return COLOR_METRIC_HSV;
+  if (strcmp(name, "lab") == 0) return COLOR_METRIC_LAB;
+  return -1;
+}
+
+// FNV-1a over the colour model and the metric, identifies the calibration a saved run was
+// classified with
+unsigned int color_profile_id(void)
+{
+  unsigned int h = 2166136261u;
+  for (int k = 0; k < COLOR_MODEL_SIZE; k++)
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      h = (h ^ (unsigned int)color_model_proto[k][c])*16777619u;
+    }
+    h = (h ^ (unsigned char)color_model_label[k])*16777619u;
+  }
+  return (h ^ (unsigned int)color_metric)*16777619u;
+}
+
+static inline int clamp_raw(int c)
+{
+  return c < 0 ? 0 : (c > COLOR_RAW_MAX ? COLOR_RAW_MAX : c);
+}
+
+// squared redmean distance between two colors, same ordering as color_distance() without the sqrt
+long color_distance2(const int* rgba, const int* rgbb) {
+  long rmean = ((long)rgba[0] + (long)rgbb[0])/2;
+  long r = (long)rgba[0]-(long)rgbb[0];
+  long g = (long)rgba[1]-(long)rgbb[1];
+  long b = (long)rgba[2]-(long)rgbb[2];
+  return (((512+rmean)*r*r)>>8) + 4*g*g + (((767-rmean)*b*b)>>8);
+}
+
+// compute the distance between two colors
+// reference https://www.compuphase.com/cmetric.htm
+double color_distance(int* rgba, int* rgbb) {
+  return sqrt((double)color_distance2(rgba, rgbb));
+}
+
+// convert a raw sensor sample to fixed-point HSV. The hue sector is picked with selects rather
+// than branches (the sector changes sample to sample, so branches mispredict), and a grey
+// sample needs no special case since recip[0] = 0 gives it s = 0 and h = 0
+void rgb_to_hsv(const int *rgb, color_hsv *hsv)
+{
+  int r = clamp_raw(rgb[0]), g = clamp_raw(rgb[1]), b = clamp_raw(rgb[2]);
+  int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+  int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+  int delta = max - min;
+  int num = max == r ? g - b : (max == g ? b - r : r - g);
+  int base = max == r ? 0 : (max == g ? 512 : 1024);
+  int h = base + (int)((num*256*(long long)recip[delta]) >> 20);
+
+  hsv->v = max;
+  hsv->s = (delta*255*(long long)recip[max]) >> 20;
+  hsv->w = hsv->s*85;
+  hsv->h = h < 0 ? h + 1536 : h;
+}
+
+// convert a raw sensor sample to fixed-point CIELab, using the white prototype as white point
+void rgb_to_lab(const int *rgb, color_lab *lab)
+{
+  int r = clamp_raw(rgb[0]), g = clamp_raw(rgb[1]), b = clamp_raw(rgb[2]);
+  int t[3];
+  int f[3];
+
+  t[0] = (int)(((1689LL*r + 1465LL*g + 739LL*b)*inv_white[0]) >> 30);
+  t[1] = (int)(((871LL*r + 2929LL*g + 296LL*b)*inv_white[1]) >> 30);
+  t[2] = (int)(((79LL*r + 488LL*g + 3893LL*b)*inv_white[2]) >> 30);
+  for (int i = 0; i < 3; i++)
+  {
+    f[i] = lab_f[t[i] > 4095 ? 4095 : t[i]];
+  }
+  lab->L = 116*f[1] - 16*1024;
+  lab->a = 500*(f[0] - f[1]);
+  lab->b = 200*(f[1] - f[2]);
+}
+
+// squared HSV distance, hue difference is weighted by the lower of the two saturations since
+// hue means little for greys. Every term fits an int (dh*w < 2^24), and the hue fold and the
+// minimum are branch-free so the prototype loop compiles to straight-line code
+long hsv_distance(const color_hsv *p, const color_hsv *q)
+{
+  int dh = abs(p->h - q->h);
+  int w = p->w < q->w ? p->w : q->w;
+  int ds = p->s - q->s;
+  int dv = p->v - q->v;
+  dh = dh < 1536 - dh ? dh : 1536 - dh;
+  dh = (dh*w) >> 16;
+  return dh*dh + ds*ds + dv*dv;
+}
+
+// squared CIELab distance (components are scaled down to keep this well inside a long)
+long lab_distance(const color_lab *p, const color_lab *q)
+{
+  long dL = ((long)p->L - (long)q->L) >> 4;
+  long da = ((long)p->a - (long)q->a) >> 4;
+  long db = ((long)p->b - (long)q->b) >> 4;
+  return dL*dL + da*da + db*db;
+}
+
+// returns the char associated with the color given in rgb, using the selected metric
+char what_color(int* rgb) {
+  if (color_metric == COLOR_METRIC_HSV) return what_color_hsv(rgb);
+  if (color_metric == COLOR_METRIC_LAB) return what_color_lab(rgb);
+  return what_color_rgb(rgb);
+}
+
+// nearest model prototype by redmean RGB distance, ties go to the earlier prototype
+char what_color_rgb(int* rgb) {
+  int best = 0;
+  long min_dist = color_distance2(rgb, color_model_proto[0]);
+  for (int i = 1; i < COLOR_MODEL_SIZE; i++)
+  {
+    long d = color_distance2(rgb, color_model_proto[i]);
+    best = d < min_dist ? i : best;
+    min_dist = d < min_dist ? d : min_dist;
+  }
+  return color_model_label[best];
+}
+
+// nearest model prototype in fixed-point HSV
+char what_color_hsv(int* rgb) {
+  color_hsv hsv;
+  int d[HSV_LANES];
+  int best = 0;
+  int min_dist;
+  if (!tables_ready) color_space_init();
+  rgb_to_hsv(rgb, &hsv);
+  // hsv_distance() to every prototype at once
+  for (int i = 0; i < HSV_LANES; i++)
+  {
+    int dh = abs(hsv.h - hsv_h[i]);
+    int w = hsv.w < hsv_w[i] ? hsv.w : hsv_w[i];
+    int ds = hsv.s - hsv_s[i];
+    int dv = hsv.v - hsv_v[i];
+    dh = dh < 1536 - dh ? dh : 1536 - dh;
+    dh = (dh*w) >> 16;
+    d[i] = dh*dh + ds*ds + dv*dv;
+  }
+  min_dist = d[0];
+  for (int i = 1; i < COLOR_MODEL_SIZE; i++)
+  {
+    best = d[i] < min_dist ? i : best;
+    min_dist = d[i] < min_dist ? d[i] : min_dist;
+  }
+  return color_model_label[best];
+}
+
+// nearest model prototype in fixed-point CIELab
+char what_color_lab(int* rgb) {
+  color_lab lab;
+  int best = 0;
+  long min_dist;
+  if (!tables_ready) color_space_init();
+  rgb_to_lab(rgb, &lab);
+  min_dist = lab_distance(&lab, &ref_lab[0]);
+  for (int i = 1; i < COLOR_MODEL_SIZE; i++)
+  {
+    long d = lab_distance(&lab, &ref_lab[i]);
+    best = d < min_dist ? i : best;
+    min_dist = d < min_dist ? d : min_dist;
+  }
+  return color_model_label[best];
+}
+
+//convert char color values to int color values
+int change_color(char c) {
+  if (c == 'k') {
+    return 1;
+  } else if (c == 'b') {
+    return 2;
+  } else if (c == 'y') {
+    return 4;
+  } else if (c == 'g') {
+    return 3;
+  } else if (c == 'r') {
+    return 5;
+  } else {
+    return 6;
+  }
+}
@@ -0,0 +1,95 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Colour sensor signal management. Raw colour samples are classified one at a time, and then
+ passed through a streaming filter that keeps a ring buffer of the most recent samples, takes
+ a majority vote over it, and only accepts a change of colour once the vote has favoured the
+ new colour for several consecutive samples (hysteresis). The filter reports each accepted
+ change as a colour transition event, together with the fraction of the window that agreed.
+
+ Control code should react to these debounced transitions instead of raw samples - a raw
+ sample taken on the border between two colours is often a mixture of both.
+
+ Classification of a single sample is done by finding the nearest prototype in the colour
+ model (EV3_ColorModel.h, generated by Tools/color_train). Three metrics are available,
+ selected at runtime through color_metric:
+
+ * COLOR_METRIC_RGB - the 'redmean' weighted RGB distance (the original classifier)
+ * COLOR_METRIC_HSV - fixed-point HSV, hue weighted by saturation. Separates dark blue from
+                      black in shadow, where the RGB distance between them is small
+ * COLOR_METRIC_LAB - fixed-point CIELab with the white prototype as the white point.
+                      Separates yellow from white under warm lighting
+
+ The HSV and Lab paths are integer-only: divisions are replaced by a reciprocal table over
+ the sensor's raw [0, 1020] range, and the Lab cube root by a lookup table. They compare
+ squared distances, so no sqrt() is needed per sample.
+
+*/
+
+#ifndef __color_header
+#define __color_header
+
+#define COLOR_RAW_MAX 1020           // Largest value BT_read_colour_sensor_RGB() returns
+
+#define COLOR_METRIC_RGB 0
+#define COLOR_METRIC_HSV 1
+#define COLOR_METRIC_LAB 2
+
+#define COLOR_FILTER_LEN 5          // Number of recent samples kept in the vote window
+#define COLOR_FILTER_HOLD 2         // Consecutive winning votes before a new colour is accepted
+
+// A debounced change of colour
+typedef struct color_event
+{
+ char from;                 // Previous debounced colour
+ char to;                   // New debounced colour
+ double confidence;         // Fraction of the vote window agreeing with the new colour
+} color_event;
+
+typedef struct color_filter
+{
+ char ring[COLOR_FILTER_LEN];   // Most recent classified samples
+ int head;                      // Next slot to write in ring[]
+ int count;                     // Number of valid samples in ring[]
+ int hold;                      // Votes required to accept a new colour
+ char state;                    // Current debounced colour, 0 until the first sample
+ char candidate;                // Colour winning the vote but not yet accepted
+ int run;                       // Consecutive votes won by the candidate
+ double confidence;             // Fraction of the window agreeing with state
+} color_filter;
+
+// Fixed-point HSV: h in [0,1536) (256 steps per sextant), s in [0,255], v in raw sensor units
+typedef struct color_hsv
+{
+ int h, s, v;
+ int w;                    // Hue weight, s*85 (so dh*w >> 16 ~ dh*s/768)
+} color_hsv;
+
+// Fixed-point CIELab, all components scaled by 1024
+typedef struct color_lab
+{
+ int L, a, b;
+} color_lab;
+
+extern int color_metric;                // One of the COLOR_METRIC_* values
+extern const char color_names[6];       // 'r','g','b','k','y','w'
+
+void color_space_init(void);
+int color_metric_from_name(const char *name);
+unsigned int color_profile_id(void);
+long color_distance2(const int* rgba, const int* rgbb);
+double color_distance(int* rgba, int* rgbb);
+void rgb_to_hsv(const int *rgb, color_hsv *hsv);
+void rgb_to_lab(const int *rgb, color_lab *lab);
+long hsv_distance(const color_hsv *p, const color_hsv *q);
+long lab_distance(const color_lab *p, const color_lab *q);
+char what_color(int* rgb);
+char what_color_rgb(int* rgb);
+char what_color_hsv(int* rgb);
+char what_color_lab(int* rgb);
+int change_color(char c);
+void color_filter_init(color_filter *f, int hold);
+int color_filter_push(color_filter *f, char c, color_event *ev);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Colour classifier model: a set of labelled RGB prototypes in raw sensor units. what_color()
+ returns the label of the nearest prototype under the selected metric.
+
+ This file is generated by Tools/color_train from a labelled log of raw sensor samples, retrain
+ it for a new arena instead of editing it by hand:
+
+    ./color_train samples.txt -k 2 -o EV3_ColorModel.h
+
+ The defaults below are the hand-picked reference colours, one prototype per colour.
+
+*/
+
+#ifndef __color_model_header
+#define __color_model_header
+
+constexpr int COLOR_MODEL_SIZE = 6;
+
+constexpr int color_model_proto[COLOR_MODEL_SIZE][3] = {
+  {255, 60, 60},
+  {60, 170, 80},
+  {30, 70, 130},
+  {35, 45, 40},
+  {255, 255, 95},
+  {200, 230, 255},
+};
+
+constexpr char color_model_label[COLOR_MODEL_SIZE] = {'r', 'g', 'b', 'k', 'y', 'w'};
+
+#endif
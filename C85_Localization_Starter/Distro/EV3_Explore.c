@@ -0,0 +1,111 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ The localization loop - see EV3_Explore.h.
+
+*/
+
+#include<stdio.h>
+#include "EV3_Map.h"
+#include "EV3_Explore.h"
+
+typedef struct stream_scan
+{
+ belief_state *bs;
+ int colour[4];
+ int read;
+} stream_scan;
+
+static void notify(const robot_io *io, int event, int arg)
+{
+  if (io->event != NULL) io->event(io->ctx, event, arg);
+}
+
+// building_sink for a streamed scan: into the belief, and stop once the rest can not matter
+static int stream_read(void *arg, int position, int colour)
+{
+  stream_scan *s = (stream_scan *)arg;
+  s->colour[position & 3] = colour;
+  s->read++;
+  updateBeliefByBuilding(s->bs, position & 3, colour);
+  return !beliefs_scan_settled(s->bs);
+}
+
+// scan the intersection into the belief, streamed if the robot can. Returns 1 and the
+// colours in c if all four buildings were read
+static int scan(belief_state *bs, const robot_io *io, int c[4])
+{
+  if (io->scan_stream == NULL) {
+    io->scan(io->ctx, c);
+    updateBeliefByColor(bs, &c[0], &c[1], &c[2], &c[3]);
+    return 1;
+  }
+  stream_scan s;
+  s.bs = bs;
+  s.read = 0;
+  // buildings the stream stops before reading are reported as 0
+  for (int k = 0; k < 4; k++)
+  {
+    s.colour[k] = 0;
+  }
+  io->scan_stream(io->ctx, stream_read, &s);
+  beliefs_scan_done(bs);
+  for (int k = 0; k < 4; k++)
+  {
+    c[k] = s.colour[k];
+  }
+  return s.read == 4;
+}
+
+// run the localization loop on io until the pose is known, following pol (NULL for none) from
+// its root. Stops after max_scans scans if that is above 0. Leaves the pose in x, y,
+// direction and returns 1 if localization finished, 0 if it ran out of scans
+int localize(belief_state *bs, const policy *pol, const robot_io *io, int max_scans, int *x, int *y, int *direction)
+{
+  int node = pol != NULL ? 0 : -1;
+  int pose = -1;
+  int red = 0, scans = 0;
+
+  while (!beliefsHasUnipueMax(bs))
+  {
+    int c[4];
+    int turn, whole;
+
+    if (max_scans > 0 && scans == max_scans) break;
+    whole = scan(bs, io, c);
+    scans++;
+    notify(io, EXPLORE_SCANNED, 0);
+
+    // down the tree while the observations are in it. A leaf that names the pose ends the
+    // loop, leaving the tree (or an ambiguous leaf) hands over to the planner
+    if (node >= 0 && !whole) node = -1;
+    if (node >= 0) {
+      node = policy_next(pol, node, red, color_signature(c[0], c[1], c[2], c[3]));
+      if (node >= 0 && pol->node[node].action == POLICY_LEAF) {
+        pose = pol->node[node].pose;
+        node = -1;
+        if (pose >= 0) break;
+      }
+    }
+    if (beliefsHasUnipueMax(bs)) break;
+
+    turn = node >= 0 ? pol->node[node].action : beliefs_plan(bs, NULL);
+    notify(io, EXPLORE_TURN, turn);
+    if (turn != 0) io->turn(io->ctx, turn);
+    updateBeliefByTurn(bs, turn);
+
+    red = io->drive(io->ctx);
+    updateBeliefByAction(bs, red);
+    notify(io, EXPLORE_DROVE, red);
+  }
+
+  if (pose >= 0) {
+    *x = (pose >> 2)%sx;
+    *y = (pose >> 2)/sx;
+    *direction = pose & 3;
+    return 1;
+  }
+  beliefsArgMax(bs, x, y, direction);
+  return beliefsHasUnipueMax(bs);
+}
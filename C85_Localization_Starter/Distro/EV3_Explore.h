@@ -0,0 +1,49 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ The localization loop, apart from the robot. localize() scans, updates the belief, and picks
+ where to go next - down the decision tree of a precomputed policy (EV3_Policy.h) while the
+ observations stay in it, with beliefs_plan() otherwise - until beliefsHasUnipueMax() holds
+ or the tree names the pose.
+
+ It talks to the robot only through a robot_io: scan the intersection, turn in place, drive
+ to the next intersection. robot_localization() hands it the real robot; Tools/mc_eval
+ hands it a simulated one, so the same loop can be evaluated over thousands of episodes
+ without hardware. The optional event callback is told after every belief update (and
+ before every drive, when the turn is known), for printing, checkpointing and the like.
+
+ A robot that can report the buildings one at a time gives a scan_stream as well. localize()
+ then puts each building into the belief as it is read (updateBeliefByBuilding()), and tells
+ the robot to stop as soon as the rest can not change the most likely pose - on the real
+ robot that skips the drive back to the rear buildings. A scan cut short leaves the policy
+ tree, which branches on whole scans, to the planner.
+
+*/
+
+#ifndef __explore_header
+#define __explore_header
+
+#include "EV3_Beliefs.h"
+#include "EV3_Policy.h"
+
+#define EXPLORE_SCANNED 0           // Events: the scan is in the belief
+#define EXPLORE_TURN 1              // the next turn is chosen, arg is the quarter turns
+#define EXPLORE_DROVE 2             // the drive is in the belief, arg is whether red was touched
+
+typedef int (*building_sink)(void *arg, int position, int colour);  // 0 to stop the scan
+
+typedef struct robot_io
+{
+ void *ctx;
+ void (*scan)(void *ctx, int colour[4]);    // Colours (1-6) clockwise from the top-left
+ void (*scan_stream)(void *ctx, building_sink read, void *arg);  // Calls read after each building,
+                                            // may be NULL
+ void (*turn)(void *ctx, int quarter_turns);// Clockwise quarter turns in place, 1-3
+ int (*drive)(void *ctx);                   // To the next intersection, 1 if red was touched
+ void (*event)(void *ctx, int event, int arg);  // May be NULL
+} robot_io;
+
+int localize(belief_state *bs, const policy *pol, const robot_io *io, int max_scans, int *x, int *y, int *direction);
+
+#endif
@@ -88,36 +88,111 @@
 
 #include "EV3_Localization.h"
 
-int map[400][4];            // This holds the representation of the map, up to 20x20
-                            // intersections, raster ordered, 4 building colours per
-                            // intersection.
-int sx, sy;                 // Size of the map (number of intersections along x and y)
-double beliefs[400][4];     // Beliefs for each location and motion direction
+belief_state beliefs;       // Beliefs for each location and motion direction (see EV3_Beliefs.h)
 int init_angle;
 int past_angle;
 int isRotating;
+log_writer *telemetry = NULL;   // Telemetry log, NULL unless --log= was given
+int motor_power[3];         // Last commanded power for the left wheel, right wheel, and sensor arm
+int gyro_angle;             // Last gyro reading
+int behaviour = BEHAVIOUR_IDLE;
+particle_set particles;     // Continuous pose particle filter (see EV3_Particles.h)
+int use_particles = 0;      // Number of particles, 0 unless --particles= was given
+uint64_t particle_t_ns = 0; // Time and gyro angle of the last particle filter update
+int particle_gyro;
+int particle_samples = 0;   // Samples fed to the particle filter while turning
+policy loc_policy;          // Precomputed localization policy (see EV3_Policy.h)
+int use_policy = 0;         // 1 if --policy= loaded one
+const char *policy_name = NULL;
+mission_state mission;      // What the run is doing, saved with the beliefs (see EV3_Checkpoint.h)
+const char *checkpoint_name = "EV3_Localization.ckp";
+int resume = 0;             // 1 if --resume was given
+int stream_scans = 0;       // 1 if --stream was given
 
 int main(int argc, char *argv[])
 {
  char mapname[1024];
  int dest_x, dest_y, rx, ry;
  unsigned char *map_image;
+ double p_over=BELIEF_P_OVER, p_under=BELIEF_P_UNDER;
+ double converge_ratio=BELIEF_CONVERGE_RATIO, converge_entropy=BELIEF_CONVERGE_ENTROPY;
  
- memset(&map[0][0],0,400*4*sizeof(int));
  sx=0;
  sy=0;
  
  if (argc<4)
  {
-  fprintf(stderr,"Usage: EV3_Localization map_name dest_x dest_y\n");
+  fprintf(stderr,"Usage: EV3_Localization map_name dest_x dest_y [options]\n");
   fprintf(stderr,"    map_name - should correspond to a properly formatted .ppm map image\n");
   fprintf(stderr,"    dest_x, dest_y - target location for the bot within the map, -1 -1 calls calibration routine\n");
+  fprintf(stderr,"  options:\n");
+  fprintf(stderr,"    --metric=rgb|hsv|lab - colour classification metric (default rgb)\n");
+  fprintf(stderr,"    --log=file - record a binary telemetry log of the run (see EV3_Log.h)\n");
+  fprintf(stderr,"    --motion=p_over,p_under - chance of overshooting / stopping short of the next intersection\n");
+  fprintf(stderr,"    --converge=ratio,entropy - stop localizing once the best pose is ratio times the runner-up, or\n");
+  fprintf(stderr,"                               the entropy is down to entropy nats (0 turns a test off)\n");
+  fprintf(stderr,"    --particles=n - also track the pose with an n particle filter, updated on every colour sample\n");
+  fprintf(stderr,"    --policy=file - follow the decision tree built for this map by Tools/map_policy\n");
+  fprintf(stderr,"    --checkpoint=file - where to save the beliefs and mission after every update (default EV3_Localization.ckp)\n");
+  fprintf(stderr,"    --resume - carry on from the checkpoint after a dropped link or crash, instead of starting over\n");
+  fprintf(stderr,"    --stream - put each building into the beliefs as it is read, and cut scans short once the rest\n");
+  fprintf(stderr,"               can not change the most likely pose\n");
   exit(1);
  }
  strcpy(&mapname[0],argv[1]);
  dest_x=atoi(argv[2]);
  dest_y=atoi(argv[3]);
 
+ for (int i=4; i<argc; i++)
+ {
+  if (strncmp(argv[i],"--metric=",9)==0&&color_metric_from_name(argv[i]+9)>=0)
+   color_metric=color_metric_from_name(argv[i]+9);
+  else if (strncmp(argv[i],"--log=",6)==0&&telemetry==NULL)
+  {
+   telemetry=log_open(argv[i]+6);
+   if (telemetry==NULL) exit(1);
+  }
+  else if (strncmp(argv[i],"--motion=",9)==0)
+  {
+   if (sscanf(argv[i]+9,"%lf,%lf",&p_over,&p_under)!=2||p_over<0||p_under<0||p_over+p_under>=1)
+   {
+    fprintf(stderr,"Invalid motion model %s, expected p_over,p_under\n",argv[i]+9);
+    exit(1);
+   }
+  }
+  else if (strncmp(argv[i],"--converge=",11)==0)
+  {
+   if (sscanf(argv[i]+11,"%lf,%lf",&converge_ratio,&converge_entropy)!=2||(converge_ratio!=0&&converge_ratio<=1)||converge_entropy<0||(converge_ratio==0&&converge_entropy==0))
+   {
+    fprintf(stderr,"Invalid convergence test %s, expected ratio,entropy\n",argv[i]+11);
+    exit(1);
+   }
+  }
+  else if (strncmp(argv[i],"--particles=",12)==0)
+  {
+   use_particles=atoi(argv[i]+12);
+   if (use_particles<=0)
+   {
+    fprintf(stderr,"Invalid particle count %s\n",argv[i]+12);
+    exit(1);
+   }
+  }
+  else if (strncmp(argv[i],"--policy=",9)==0)
+   policy_name=argv[i]+9;
+  else if (strncmp(argv[i],"--checkpoint=",13)==0&&argv[i][13]!='\0')
+   checkpoint_name=argv[i]+13;
+  else if (strcmp(argv[i],"--resume")==0)
+   resume=1;
+  else if (strcmp(argv[i],"--stream")==0)
+   stream_scans=1;
+  else
+  {
+   fprintf(stderr,"Unknown option %s\n",argv[i]);
+   exit(1);
+  }
+ }
+ color_space_init();
+
  if (dest_x==-1&&dest_y==-1)
  {
   calibrate_sensor();
@@ -157,14 +232,72 @@ int main(int argc, char *argv[])
  }
 
  // Initialize beliefs - uniform probability for each location and direction
- for (int j=0; j<sy; j++)
-  for (int i=0; i<sx; i++)
+ if (!beliefs_init(&beliefs,sx,sy))
+ {
+  free_map();
+  free(map_image);
+  exit(1);
+ }
+ beliefs_set_motion(&beliefs,p_over,p_under);
+ beliefs_set_convergence(&beliefs,converge_ratio,converge_entropy);
+ beliefs_set_threads(&beliefs,(int)sysconf(_SC_NPROCESSORS_ONLN));
+ if (use_particles&&!particles_init(&particles,use_particles,(int)sysconf(_SC_NPROCESSORS_ONLN),map_image,rx,ry,log_now_ns()))
+ {
+  beliefs_free(&beliefs);
+  free_map();
+  free(map_image);
+  exit(1);
+ }
+ if (policy_name!=NULL)
+ {
+  if (!policy_load(&loc_policy,policy_name))
+  {
+   if (use_particles) particles_free(&particles);
+   beliefs_free(&beliefs);
+   free_map();
+   free(map_image);
+   exit(1);
+  }
+  use_policy=1;
+  printf("Policy %s: %u nodes, at most %u scans\n",policy_name,loc_policy.h.node_count,loc_policy.h.max_scans);
+ }
+
+ memset(&mission,0,sizeof(mission));
+ mission.dest_x=dest_x;
+ mission.dest_y=dest_y;
+ mission.phase=MISSION_LOCALIZE;
+ mission.pending=PENDING_NONE;
+ mission.profile=color_profile_id();
+ if (resume)
+ {
+  mission_state saved;
+  int ok=checkpoint_load(checkpoint_name,&saved,&beliefs);
+  if (ok&&saved.profile!=mission.profile)
   {
-   beliefs[i+(j*sx)][0]=1.0/(double)(sx*sy*4);
-   beliefs[i+(j*sx)][1]=1.0/(double)(sx*sy*4);
-   beliefs[i+(j*sx)][2]=1.0/(double)(sx*sy*4);
-   beliefs[i+(j*sx)][3]=1.0/(double)(sx*sy*4);
+   fprintf(stderr,"Checkpoint %s was made with a different colour calibration\n",checkpoint_name);
+   ok=0;
   }
+  if (!ok)
+  {
+   if (use_policy) policy_free(&loc_policy);
+   if (use_particles) particles_free(&particles);
+   beliefs_free(&beliefs);
+   free_map();
+   free(map_image);
+   exit(1);
+  }
+  if (saved.dest_x!=dest_x||saved.dest_y!=dest_y) printf("Resuming the mission to %d, %d from the checkpoint\n",saved.dest_x,saved.dest_y);
+  mission=saved;
+  dest_x=mission.dest_x;
+  dest_y=mission.dest_y;
+  printf("Resumed checkpoint %u: phase %d, at %d, %d facing %d\n",mission.seq,mission.phase,mission.x,mission.y,mission.dir);
+  // the tree is only good from the root, and the beliefs already hold the scans made so far
+  if (use_policy)
+  {
+   policy_free(&loc_policy);
+   use_policy=0;
+  }
+ }
   // printf("\n\n\n\n\nsx: %d, sy: %d\n", sx, sy);
 
   // printf("index %d", get_index(1,2));
@@ -227,15 +360,52 @@ int main(int argc, char *argv[])
  //        robot to complete its task should be here.
   int cx, cy, direction;
   // find_street();
-  robot_localization(&cx, &cy, &direction);
-  printf("%d, %d %d\n", cx, cy, direction);
-  // turn_at_intersection(0);
-  go_to_target(cx, cy, direction, dest_x, dest_y);
 
-  // while(!go_to_target(cx, cy, direction, dest_x, dest_y)){
-  //   robot_localization(&cx, &cy, &direction);
-  // }
-  // go_to_target(cx, cy, direction, dest_x, dest_y);
+  // the checkpoint was saved as the bot set off for the next intersection. Finish the drive -
+  // if it had already got there this takes it one further than the belief thinks, and the
+  // next scans (and kidnap detection while heading for the target) sort that out
+  if (mission.pending == PENDING_DRIVE) {
+   printf("Finishing the interrupted drive\n");
+   updateBeliefByAction(&beliefs, drive_along_street());
+   save_checkpoint(PENDING_NONE);
+   if (mission.phase == MISSION_TARGET && !track_scan()) {
+    mission.phase = MISSION_LOCALIZE;
+    beliefs_mix_uniform(&beliefs, BELIEF_KIDNAP_MIX);
+   }
+  }
+
+  if (mission.phase == MISSION_DONE) {
+   printf("The checkpoint says the target was reached already\n");
+  }
+  else {
+   if (mission.phase == MISSION_LOCALIZE) {
+    robot_localization(&cx, &cy, &direction);
+   }
+   else {
+    beliefsArgMax(&beliefs, &cx, &cy, &direction);
+   }
+   printf("%d, %d %d\n", cx, cy, direction);
+   mission.phase = MISSION_TARGET;
+   save_checkpoint(PENDING_NONE);
+   // turn_at_intersection(0);
+
+   // go_to_target() keeps tracking the belief, and gives up when its scans say the robot is not
+   // where the belief thinks. Mix a uniform belief back in and localize again from wherever the
+   // robot is - the bluetooth session and everything else carry on
+   while (!go_to_target(cx, cy, direction, dest_x, dest_y))
+   {
+    printf("Lost on the way to the target, localizing again\n");
+    beliefs_mix_uniform(&beliefs, BELIEF_KIDNAP_MIX);
+    mission.phase = MISSION_LOCALIZE;
+    save_checkpoint(PENDING_NONE);
+    robot_localization(&cx, &cy, &direction);
+    printf("%d, %d %d\n", cx, cy, direction);
+    mission.phase = MISSION_TARGET;
+    save_checkpoint(PENDING_NONE);
+   }
+   mission.phase = MISSION_DONE;
+   save_checkpoint(PENDING_NONE);
+  }
 
   // int val = go_to_target(0,4,2,2,0);
   // int val = verify_colors(0, 3, 2);
@@ -268,7 +438,12 @@ int main(int argc, char *argv[])
   // }
 
  // Cleanup and exit - DO NOT WRITE ANY CODE BELOW THIS LINE
+ log_close(telemetry);
  BT_close();
+ beliefs_free(&beliefs);
+ if (use_particles) particles_free(&particles);
+ if (use_policy) policy_free(&loc_policy);
+ free_map();
  free(map_image);
  exit(0);
 }
@@ -282,16 +457,19 @@ int find_street(void)
   * You can use the return value to indicate success or failure, or to inform the rest of your code of the state of your
   * bot after calling this function
   */
-  int rgb[3];
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
-
-  while (what_color(rgb) == 'y') {
-    BT_drive(MOTOR_A, MOTOR_D, 10);
-    BT_read_colour_sensor_RGB(PORT_2, rgb);
+  color_filter cf;
+  color_event ev;
+  set_behaviour(BEHAVIOUR_FIND_STREET);
+  color_filter_init(&cf, COLOR_FILTER_HOLD);
+  sense_color(&cf, &ev);
+
+  while (cf.state == 'y') {
+    cmd_drive(10);
+    sense_color(&cf, &ev);
   }
-  while (what_color(rgb) != 'k') {
-    while (what_color(rgb) == 'r') {
-      BT_all_stop(1);
+  while (cf.state != 'k') {
+    while (cf.state == 'r') {
+      cmd_stop(1);
       isRotating = 1;
       init_angle = get_angle();
       past_angle = get_angle();
@@ -299,53 +477,38 @@ int find_street(void)
       while (isRotating) {
         rotate_to(random_angle);
       }
-      while (what_color(rgb) == 'r'){
-        BT_drive(MOTOR_A, MOTOR_D, 10);
-        BT_read_colour_sensor_RGB(PORT_2, rgb);
+      while (cf.state == 'r'){
+        cmd_drive(10);
+        sense_color(&cf, &ev);
       }
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
     }
-    BT_drive(MOTOR_A, MOTOR_D, 10);
-    BT_read_colour_sensor_RGB(PORT_2, rgb);
+    cmd_drive(10);
+    sense_color(&cf, &ev);
   }
-  BT_all_stop(0);
+  cmd_stop(0);
 
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
   int seen_yellow = 0;
   
   while (1) {
-    while(what_color(rgb) == 'k') {
-      BT_drive(MOTOR_A, MOTOR_D, 10);
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
-      if(what_color(rgb) != 'k'){
-        for (int i = 0; i < 2; i++)
-        {
-          BT_drive(MOTOR_A, MOTOR_D, 10);
-          BT_read_colour_sensor_RGB(PORT_2, rgb);
-        }
+    // follow the street until the filter reports a debounced change off black, the filter
+    // only reports it once the sensor is clear of the transition band
+    while(cf.state == 'k') {
+      cmd_drive(10);
+      if (!sense_color(&cf, &ev) || ev.to != 'y') {
+        continue;
       }
-      if (seen_yellow && what_color(rgb) == 'y') {
-        BT_all_stop(0);
+      if (seen_yellow) {
+        cmd_stop(0);
         return 0;
       }
-
-      if (what_color(rgb) == 'y') {
-        seen_yellow = 1;
-        while (what_color(rgb) == 'y') {
-          BT_drive(MOTOR_A, MOTOR_D, 10);
-          BT_read_colour_sensor_RGB(PORT_2, rgb);
-        }
-        if(what_color(rgb) != 'y'){
-        for (int i = 0; i < 3; i++)
-        {
-          BT_drive(MOTOR_A, MOTOR_D, 10);
-          BT_read_colour_sensor_RGB(PORT_2, rgb);
-        }
-      }
+      seen_yellow = 1;
+      while (cf.state == 'y') {
+        cmd_drive(10);
+        sense_color(&cf, &ev);
       }
     }
-    BT_all_stop(0);
-    if (what_color(rgb) == 'r') {
+    cmd_stop(0);
+    if (cf.state == 'r') {
       isRotating = 1;
       init_angle = get_angle();
       past_angle = get_angle();
@@ -354,28 +517,22 @@ int find_street(void)
         rotate_to(175);
       }
 
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
+      sense_color(&cf, &ev);
 
-      while (what_color(rgb) != 'k') {
-        BT_drive(MOTOR_A, MOTOR_D, 10);
-        BT_read_colour_sensor_RGB(PORT_2, rgb);
+      while (cf.state != 'k') {
+        cmd_drive(10);
+        sense_color(&cf, &ev);
       }
-      BT_all_stop(0);
+      cmd_stop(0);
       continue;
     }
 
     //reverse until black again
-    while (what_color(rgb) != 'k') {
-      BT_drive(MOTOR_A, MOTOR_D, -10);
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
+    while (cf.state != 'k') {
+      cmd_drive(-10);
+      sense_color(&cf, &ev);
     }
-    for (int i = 0; i < 5; i++)
-    {
-      BT_drive(MOTOR_A, MOTOR_D, -10);
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
-    }
-    
-    BT_all_stop(0);
+    cmd_stop(0);
 
     isRotating = 1;
     init_angle = get_angle();
@@ -403,42 +560,30 @@ int drive_along_street(void)
   * bot after calling this function.
   */
   int hit_red = 0;
-  int rgb[3];
   int went_left = 0;
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
-
-  while (what_color(rgb) == 'y') {
-    BT_drive(MOTOR_A, MOTOR_D, 10);
-    BT_read_colour_sensor_RGB(PORT_2, rgb);
-  }
-  for (int i = 0; i < 5; i++)
-  {
-    BT_drive(MOTOR_A, MOTOR_D, 10);
+  color_filter cf;
+  color_event ev;
+  set_behaviour(BEHAVIOUR_DRIVE);
+  color_filter_init(&cf, COLOR_FILTER_HOLD);
+  sense_color(&cf, &ev);
+
+  // leave the intersection, the debounced transition off yellow means we are on the street
+  while (cf.state == 'y') {
+    cmd_drive(10);
+    sense_color(&cf, &ev);
   }
-  
-  BT_all_stop(0);
-
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
-  // int seen_yellow = 0;
+  cmd_stop(0);
   
   while (1) {
-    while(what_color(rgb) == 'k') {
-      BT_drive(MOTOR_A, MOTOR_D, 10);
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
-      if(what_color(rgb) != 'k'){
-        for (int i = 0; i < 3; i++)
-        {
-          BT_drive(MOTOR_A, MOTOR_D, 10);
-          BT_read_colour_sensor_RGB(PORT_2, rgb);
-        }
-      }
-      if (what_color(rgb) == 'y') {
-        BT_all_stop(0);
-        return hit_red;
-      }
+    while(cf.state == 'k') {
+      cmd_drive(10);
+      sense_color(&cf, &ev);
+    }
+    cmd_stop(0);
+    if (cf.state == 'y') {
+      return hit_red;
     }
-    BT_all_stop(0);
-    if (what_color(rgb) == 'r') {
+    if (cf.state == 'r') {
       hit_red = 1;
       isRotating = 1;
       init_angle = get_angle();
@@ -448,30 +593,22 @@ int drive_along_street(void)
         rotate_to(170); //changed this
       }
 
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
+      sense_color(&cf, &ev);
 
-      while (what_color(rgb) != 'k') {
-        BT_drive(MOTOR_A, MOTOR_D, 10);
-        BT_read_colour_sensor_RGB(PORT_2, rgb);
-      }
-      for (int i = 0; i < 5; i++)
-      {
-        BT_drive(MOTOR_A, MOTOR_D, 10);
+      while (cf.state != 'k') {
+        cmd_drive(10);
+        sense_color(&cf, &ev);
       }
-      BT_all_stop(0);
+      cmd_stop(0);
       continue;
     }
 
     //reverse until black again
-    while (what_color(rgb) != 'k') {
-      BT_drive(MOTOR_A, MOTOR_D, -10);
-      BT_read_colour_sensor_RGB(PORT_2, rgb);
+    while (cf.state != 'k') {
+      cmd_drive(-10);
+      sense_color(&cf, &ev);
     }
-    for (int i = 0; i < 10; i++)
-    {
-      BT_drive(MOTOR_A, MOTOR_D, -10);
-    }
-    BT_all_stop(0);
+    cmd_stop(0);
 
     isRotating = 1;
     init_angle = get_angle();
@@ -531,145 +668,112 @@ int scan_intersection(int *tl, int *tr, int *br, int *bl)
  *(tr)=-1;
  *(br)=-1;
  *(bl)=-1;
- 
- int rgb[3];
- int motor_power = 5;
-int color_buffer = 5;
- int out_color_buffer = 12;
- BT_read_colour_sensor_RGB(PORT_2, rgb);
 
-//drive forward
- while (what_color(rgb) != 'k') {
-   BT_drive(MOTOR_A, MOTOR_D, 10);
-   BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<15;i++){
-   BT_drive(MOTOR_A, MOTOR_D, 10);
- }
- BT_all_stop(0);
-
- //scan left
- while (what_color(rgb) == 'k') {
-  BT_motor_port_start(MOTOR_C, motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
-  // printf("%c %d %d %d\n",what_color(rgb), rgb[0], rgb[1],rgb[2]);
- } 
- for(int i=0;i<out_color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, motor_power);
- }
-//  BT_motor_port_stop(MOTOR_C, 0);
- BT_all_stop(0);
- BT_read_colour_sensor_RGB(PORT_2, rgb);
- *(tl) = what_color(rgb);
-
-//recenter
- while (what_color(rgb) != 'k') {
-  BT_motor_port_start(MOTOR_C, -motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, -motor_power);
- }
- BT_all_stop(0);
+ // the buildings are read one at a time by scan_buildings(), here all four of them
+ int colour[4];
+ scan_buildings(colour, NULL, NULL);
+ *(tl)=colour[0];
+ *(tr)=colour[1];
+ *(br)=colour[2];
+ *(bl)=colour[3];
+ return(0); 
+}
 
-//scan right
- while (what_color(rgb) == 'k') {
-  BT_motor_port_start(MOTOR_C, -motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<out_color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, -motor_power);
+// sweep the arm (power > 0 to the left) off the street onto a building, read its colour and
+// recentre on the street. Returns the colour character
+int sweep_building(color_filter *cf, color_event *ev, int power)
+{
+ int c;
+ while (cf->state == 'k') {
+  cmd_arm(power);
+  sense_color(cf, ev);
  }
- BT_all_stop(0);
- BT_read_colour_sensor_RGB(PORT_2, rgb);
- *(tr) = what_color(rgb);
+ cmd_stop(0);
+ c = cf->state;
 
  //recenter
- while (what_color(rgb) != 'k') {
-  BT_motor_port_start(MOTOR_C, motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, motor_power);
+ while (cf->state != 'k') {
+  cmd_arm(-power);
+  sense_color(cf, ev);
  }
- BT_all_stop(0);
+ cmd_stop(0);
+ return c;
+}
 
- //move back
- while (what_color(rgb) != 'y') {
-  BT_drive(MOTOR_A, MOTOR_D, -10);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<5;i++){
-   BT_drive(MOTOR_A, MOTOR_D, -10);
+// read the buildings around the intersection into colour[] (colour characters clockwise from
+// the top-left, 0 for any not read): the front pair from just past the intersection, then
+// the rear pair after driving back across it. Each is passed to read (if not NULL, as a
+// colour index) as soon as it is read, and a 0 from read cuts the scan short - the bot goes
+// straight back to the intersection, skipping the drive back to the rear pair if it has not
+// made it yet. Returns the number of buildings read
+int scan_buildings(int colour[4], building_sink read, void *arg)
+{
+ // Sensor management: every sample goes through the colour filter (see EV3_Color.h), and the arm
+ // and wheels only stop on a debounced transition. The filter accepts a new colour once the vote
+ // window has favoured it for COLOR_FILTER_HOLD samples, by which time the sensor is past the
+ // border between the two colours, so building colours are read from the debounced state.
+ // The 15-step drives are positioning moves that line the arm up with the row of buildings.
+ static const int position[4] = {0, 1, 3, 2};  // top-left, top-right, bottom-left, bottom-right
+ int motor_power = 5;
+ int count = 0;
+ color_filter cf;
+ color_event ev;
+ for (int k = 0; k < 4; k++)
+ {
+  colour[k] = 0;
  }
- BT_all_stop(0);
+ set_behaviour(BEHAVIOUR_SCAN);
+ color_filter_init(&cf, COLOR_FILTER_HOLD);
+ sense_color(&cf, &ev);
 
-
- //move back
- while (what_color(rgb) != 'k') {
-  BT_drive(MOTOR_A, MOTOR_D, -10);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
+//drive forward
+ while (cf.state != 'k') {
+   cmd_drive(10);
+   sense_color(&cf, &ev);
  }
  for(int i=0;i<15;i++){
-   BT_drive(MOTOR_A, MOTOR_D, -10);
+   cmd_drive(10);
  }
- BT_all_stop(0);
- 
- //scan left
- while (what_color(rgb) == 'k') {
-  BT_motor_port_start(MOTOR_C, motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- } 
- for(int i=0;i<out_color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, motor_power);
- }
-  BT_all_stop(0);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
-  *(bl) = what_color(rgb);
+ cmd_stop(0);
 
-//recenter
- while (what_color(rgb) != 'k') {
-  BT_motor_port_start(MOTOR_C, -motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, -motor_power);
- } 
- BT_all_stop(0);
-
-//scan right
- while (what_color(rgb) == 'k') {
-  BT_motor_port_start(MOTOR_C, -motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<out_color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, -motor_power);
- }
- BT_all_stop(0);
- *(br) = what_color(rgb);
+ // left, then right, in front of the intersection and then behind it
+ for (count = 0; count < 4; count++)
+ {
+  if (count == 2) {
+   //move back
+   while (cf.state != 'y') {
+    cmd_drive(-10);
+    sense_color(&cf, &ev);
+   }
+   cmd_stop(0);
 
- //recenter
- while (what_color(rgb) != 'k') {
-  BT_motor_port_start(MOTOR_C, motor_power);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
- }
- for(int i=0;i<color_buffer;i++){
-   BT_motor_port_start(MOTOR_C, motor_power);
+   //move back
+   while (cf.state != 'k') {
+    cmd_drive(-10);
+    sense_color(&cf, &ev);
+   }
+   for(int i=0;i<15;i++){
+     cmd_drive(-10);
+   }
+   cmd_stop(0);
+  }
+  colour[position[count]] = sweep_building(&cf, &ev, count%2 == 0 ? motor_power : -motor_power);
+  if (read != NULL && !read(arg, position[count], change_color(colour[position[count]]))) {
+   count++;
+   break;
+  }
  }
- BT_all_stop(0);
 
- //drive forward
- while (what_color(rgb) != 'y') {
-  BT_drive(MOTOR_A, MOTOR_D, 10);
-  BT_read_colour_sensor_RGB(PORT_2, rgb);
+ // back onto the intersection, from whichever side of it the bot is on
+ while (cf.state != 'y') {
+  cmd_drive(count <= 2 ? -10 : 10);
+  sense_color(&cf, &ev);
  }
- for(int i=0;i<5;i++){
-   BT_drive(MOTOR_A, MOTOR_D, 10);
- }
- BT_all_stop(0);
+ cmd_stop(0);
  center_sensor();
-
- return(0); 
+ log_scan(colour[0] ? change_color(colour[0]) : 0, colour[1] ? change_color(colour[1]) : 0,
+          colour[2] ? change_color(colour[2]) : 0, colour[3] ? change_color(colour[3]) : 0);
+ return count;
 }
 // 0 is right 1 is left
 int turn_at_intersection(int turn_direction)
@@ -686,6 +790,7 @@ int turn_at_intersection(int turn_direction)
   * You can use the return value to indicate success or failure, or to inform your code of the state of the bot
   */
   int target_angle = turn_direction == 1 ? -90 : 90;
+  set_behaviour(BEHAVIOUR_TURN);
   isRotating = 1;
   init_angle = get_angle();
   past_angle = get_angle();
@@ -747,50 +852,19 @@ int robot_localization(int *robot_x, int *robot_y, int *direction)
   /************************************************************************************************************************
    *   TO DO  -   Complete this function
    ***********************************************************************************************************************/
-   printBeliefs();
+   printBeliefs(&beliefs);
    printf("\n");
-  while (!beliefsHasUnipueMax()) {
-  
-  
-    printf("localization\n");
-    int a[4];
-    scan_intersection(&a[0], &a[1], &a[2], &a[3]);
-    a[0] = change_color(a[0]);
-    a[1] = change_color(a[1]);
-    a[2] = change_color(a[2]);
-    a[3] = change_color(a[3]);
-
-    printf("%d %d %d %d\n", a[0], a[1], a[2], a[3]);
-
-    updateBeliefByColor(&a[0], &a[1], &a[2], &a[3]);
-    printBeliefs();
-    printf("color\n");
-
-    int red = drive_along_street();
-    updateBeliefByAction(red);
-    printBeliefs();
-    printf("action\n");
-  }
-
-  int length = sx*sy;
-  double max = 0;
-  int max_x = 0, max_y = 0, max_dir = 0;
-
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      if (beliefs[i][j] > max) {
-        max = beliefs[i][j];
-        max_x = i%sx;
-        max_y = i/sx;
-        max_dir = j;
-      }
-    }
-  }
-  *robot_x = max_x;
-  *robot_y = max_y;
-  *direction = max_dir;
+  // the loop itself is in EV3_Explore.c, so Tools/mc_eval can run it on a simulated robot.
+  // With a policy it follows the tree until it names the pose, the beliefs are updated all
+  // along and take over (with the planner) if an observation leaves the tree
+  robot_io io;
+  io.ctx = NULL;
+  io.scan = io_scan;
+  io.scan_stream = stream_scans ? io_scan_stream : NULL;
+  io.turn = io_turn;
+  io.drive = io_drive;
+  io.event = io_event;
+  int found = localize(&beliefs, use_policy ? &loc_policy : NULL, &io, 0, robot_x, robot_y, direction);
   
   // printf("%d\n",beliefsHasUnipueMax());
   // int a[4];
@@ -800,11 +874,7 @@ int robot_localization(int *robot_x, int *robot_y, int *direction)
   //   int a[4];
   //   scan_intersection(&a[0], &a[1], &a[2], &a[3]);
   // }
- // Return an invalid location/direction and notify that localization was unsuccessful (you will delete this and replace it
- // with your code).
-
- 
- return(0);
+ return(found);
 }
 // perform an intersection scan and verify whether the colors scanned are the same as the colors on the map at the given robot location and direction
 int verify_colors(int robot_x, int robot_y, int direction) {
@@ -867,116 +937,147 @@ int go_to_target(int robot_x, int robot_y, int direction, int target_x, int targ
   /************************************************************************************************************************
    *   TO DO  -   Complete this function
    ***********************************************************************************************************************/
-  
-    if (robot_x > target_x) {
-      if (direction == 0) {
-        // rotate_to(-90);
-        turn_at_intersection(1);
-        direction = 3;
-      } else if (direction == 1) {
-        // rotate_to(190);
-        turn_at_intersection(0);
-        turn_at_intersection(0);
-        direction = 3;
-      } else if (direction == 2) {
-        // rotate_to(90);
-        turn_at_intersection(0);
-        direction = 3;
-      }
-  } else if (robot_x < target_x) {
-    if (direction == 0) {
-      // rotate_to(90);
-      turn_at_intersection(0);
-      direction = 1;
-    } else if (direction == 2) {
-      // rotate_to(-90);
-      turn_at_intersection(1);
-      direction = 1;
-    } else if (direction == 3) {
-      // rotate_to(190);
-      turn_at_intersection(0);
-      turn_at_intersection(0);
-      direction = 1;
-    }
-  }
-  // if (!verify_colors(robot_x, robot_y, direction)) {
-  //   return 0;
-  // }
 
-  while (robot_x != target_x) {
-    drive_along_street();
-    if (robot_x > target_x) {
-      robot_x--;
-    } else {
-      robot_x++;
+  // One intersection at a time, along x first and then along y. Every turn and drive updates
+  // the beliefs, and every intersection is scanned: the next step starts from the most likely
+  // pose, so the bot follows the belief rather than dead reckoning, and gives up as soon as
+  // the scans say it is somewhere else
+  while (robot_x != target_x || robot_y != target_y) {
+    int heading;
+    if (robot_x != target_x) {
+      heading = robot_x < target_x ? 1 : 3;
     }
-    // if (!verify_colors(robot_x, robot_y, direction)) {
-    //   return 0;
-    // }
+    else {
+      heading = robot_y < target_y ? 2 : 0;
+    }
+    turn_quarters((heading - direction + 4)%4);
+    save_checkpoint(PENDING_DRIVE);
+    updateBeliefByAction(&beliefs, drive_along_street());
+    save_checkpoint(PENDING_NONE);
+    if (!track_scan()) {
+      return 0;
+    }
+    beliefsArgMax(&beliefs, &robot_x, &robot_y, &direction);
+    printf("at %d, %d facing %d\n", robot_x, robot_y, direction);
   }
+  return 1;
+}
 
-  if (robot_y == target_y) {
-    return 1;
+// turn in place at an intersection by quarter_turns clockwise quarter turns (0-3), and turn
+// the beliefs with the bot
+void turn_quarters(int quarter_turns)
+{
+  io_turn(NULL, quarter_turns);
+  updateBeliefByTurn(&beliefs, quarter_turns);
+}
+
+// robot_io for localize(): scan the intersection, as colour indices
+void io_scan(void *ctx, int colour[4])
+{
+  (void)ctx;
+  printf("localization\n");
+  scan_intersection(&colour[0], &colour[1], &colour[2], &colour[3]);
+  for (int k = 0; k < 4; k++)
+  {
+    colour[k] = change_color(colour[k]);
   }
+  printf("%d %d %d %d\n", colour[0], colour[1], colour[2], colour[3]);
+}
 
-  if (robot_y > target_y) {
-    if (direction == 2) {
-      // rotate_to(190);
-      turn_at_intersection(0);
-      turn_at_intersection(0);
-      direction = 0;
-    } else if (direction == 1) {
-      // rotate_to(90);
-      turn_at_intersection(1);
-      direction = 0;
-    } else if (direction == 3) {
-      // rotate_to(-90);
-      turn_at_intersection(0);
-      direction = 0;
-    }
-  } else if (robot_y < target_y) {
-    if (direction == 0) {
-      // rotate_to(-90);
-      turn_at_intersection(0);
-      turn_at_intersection(0);
-      direction = 2;
-    } else if (direction == 1) {
-      // rotate_to(190);
-      turn_at_intersection(0);
-      direction = 2;
-    } else if (direction == 3) {
-      // rotate_to(90);
-      turn_at_intersection(1);
-      direction = 2;
-    }
+// robot_io for localize(): scan the intersection a building at a time
+void io_scan_stream(void *ctx, building_sink read, void *arg)
+{
+  int colour[4];
+  (void)ctx;
+  printf("localization\n");
+  int count = scan_buildings(colour, read, arg);
+  printf("%d of 4 buildings read\n", count);
+}
+
+// building_sink for track_scan(): into the beliefs, and stop once the rest can not matter
+int track_building(void *arg, int position, int colour)
+{
+  (void)arg;
+  updateBeliefByBuilding(&beliefs, position, colour);
+  return !beliefs_scan_settled(&beliefs);
+}
+
+// robot_io for localize(): turn in place, without touching the beliefs
+void io_turn(void *ctx, int quarter_turns)
+{
+  (void)ctx;
+  if (quarter_turns == 1 || quarter_turns == 2) {
+    turn_at_intersection(0);
   }
-  // if (!verify_colors(robot_x, robot_y, direction)) {
-  //   return 0;
-  // }
+  if (quarter_turns == 2) {
+    turn_at_intersection(0);
+  }
+  if (quarter_turns == 3) {
+    turn_at_intersection(1);
+  }
+}
 
-  while (robot_y != target_y) {
-    drive_along_street();
-    if (robot_y > target_y) {
-      robot_y--;
-    } else {
-      robot_y++;
-    }
-    // if (!verify_colors(robot_x, robot_y, direction)) {
-    //   return 0;
-    // }
+// robot_io for localize(): drive to the next intersection, checkpointing first in case the
+// link drops on the way
+int io_drive(void *ctx)
+{
+  (void)ctx;
+  save_checkpoint(PENDING_DRIVE);
+  return drive_along_street();
+}
+
+// robot_io for localize(): checkpoint and report after every update
+void io_event(void *ctx, int event, int arg)
+{
+  (void)ctx;
+  if (event == EXPLORE_TURN) {
+    printf("next: %d quarter turns\n", arg);
+    return;
   }
+  save_checkpoint(PENDING_NONE);
+  printBeliefs(&beliefs);
+  printf(event == EXPLORE_SCANNED ? "color\n" : "action\n");
+  if (event == EXPLORE_DROVE && use_particles) {
+    double px, py, ptheta;
+    double spread = particles_estimate(&particles, &px, &py, &ptheta);
+    printf("particles: %.0f, %.0f heading %.0f deg, spread %.1f px\n", px, py, ptheta*180.0/M_PI, spread);
+  }
+}
 
-  return 1;
+// scan the intersection and update the beliefs with it (a building at a time with --stream,
+// which once converged mostly skips the rear pair). Returns 0 if the scans no longer fit the
+// belief - the bot has been moved, or was never where the belief said
+int track_scan(void)
+{
+  int a[4];
+  if (stream_scans) {
+    scan_buildings(a, track_building, NULL);
+    beliefs_scan_done(&beliefs);
+  } else {
+    scan_intersection(&a[0], &a[1], &a[2], &a[3]);
+  }
+  for (int k = 0; k < 4; k++)
+  {
+    a[k] = a[k] ? change_color(a[k]) : 0;
   }
+  if (!stream_scans) updateBeliefByColor(&beliefs, &a[0], &a[1], &a[2], &a[3]);
+  save_checkpoint(PENDING_NONE);
+  printf("scan %d %d %d %d, likelihood %.4f\n", a[0], a[1], a[2], a[3], beliefs.obs_p);
+  return !beliefs_kidnapped(&beliefs);
+}
 
-// compute the distance between two colors
-// reference https://www.compuphase.com/cmetric.htm
-double color_distance(int* rgba, int* rgbb) {
-  long rmean = ((long)rgba[0] + (long)rgbb[0])/2;
-  long r = (long)rgba[0]-(long)rgbb[0];
-  long g = (long)rgba[1]-(long)rgbb[1];
-  long b = (long)rgba[2]-(long)rgbb[2];
-  return sqrt((((512+rmean)*r*r)>>8) + 4*g*g + (((767-rmean)*b*b)>>8));
+// save the beliefs and the mission to the checkpoint file, pending says whether the bot is
+// about to drive. A failed save is reported and the run goes on
+void save_checkpoint(int pending)
+{
+  int x, y, dir;
+  beliefsArgMax(&beliefs, &x, &y, &dir);
+  mission.pending = pending;
+  mission.x = x;
+  mission.y = y;
+  mission.dir = dir;
+  mission.seq++;
+  checkpoint_save(checkpoint_name, &mission, &beliefs);
 }
 
 // Rotate to angle
@@ -988,15 +1089,15 @@ void rotate_to(int angle) {
   }
   if(abs(cur_angle-init_angle-angle)<3){
     isRotating = 0;
-    BT_all_stop(0);
+    cmd_stop(0);
   }else if(cur_angle-init_angle>angle){
     if(angle>100){
-      BT_turn(MOTOR_A, -10, MOTOR_D, 10);
+      cmd_turn(-10, 10);
     }else{
-      BT_turn(MOTOR_A, -10, MOTOR_D, 9);
+      cmd_turn(-10, 9);
     }
   }else if(cur_angle-init_angle<=angle){
-    BT_turn(MOTOR_A, 10, MOTOR_D, -8);
+    cmd_turn(10, -8);
   }
   past_angle = cur_angle;
   return;
@@ -1008,20 +1109,22 @@ int get_angle() {
   if(angle<0){
     angle += 360;
   }
+  gyro_angle = angle;
+  log_state(LOG_EVENT_GYRO, NULL, 0);
   return angle;
 }
 // center the color sensor
 void center_sensor(){
   for (int i = 0; i < 300; i++)
   {
-    BT_motor_port_start(MOTOR_C, -5);
+    cmd_arm(-5);
   }
-  BT_all_stop(1);
+  cmd_stop(1);
   for (int i = 0; i < 68; i++)
   {
-    BT_motor_port_start(MOTOR_C, 5);
+    cmd_arm(5);
   }
-  BT_all_stop(1);
+  cmd_stop(1);
 }
 void calibrate_sensor(void)
 {
@@ -1040,6 +1143,7 @@ void calibrate_sensor(void)
   * 
   * How to do this part is up to you, but feel free to talk with your TA and instructor about it!
   */   
+  set_behaviour(BEHAVIOUR_CALIBRATE);
 //  if any value is over 255, take 255
   // GREEN: (60, 170, 80)
   // RED: (255, 60, 60)
@@ -1128,546 +1232,114 @@ void calibrate_sensor(void)
   fprintf(stderr,"Calibration function called!\n");
   return;
 }
-//convert char color values to int color values
-int change_color(char c) {
-  if (c == 'k') {
-    return 1;
-  } else if (c == 'b') {
-    return 2;
-  } else if (c == 'y') {
-    return 4;
-  } else if (c == 'g') {
-    return 3;
-  } else if (c == 'r') {
-    return 5;
-  } else {
-    return 6;
-  }
-}
-// returns the char associated with the color given in rgb
-char what_color(int* rgb) {
-  int green[3] = {60, 170, 80};
-  int red[3] = {255, 60, 60};
-  int blue[3] = {30, 70, 130};
-  int black[3] = {35, 45, 40};
-  int yellow[3] = {255, 255, 95};
-  int white[3] = {200, 230, 255};
-
-  double min_dist = fmin(fmin(fmin(color_distance(rgb, green), color_distance(rgb, red)), fmin(color_distance(rgb, blue), color_distance(rgb, black))), fmin(color_distance(rgb, yellow), color_distance(rgb, white)));
-  if (color_distance(rgb, red) == min_dist) {
-    return 'r';
-  } else if (color_distance(rgb, green) == min_dist) {
-    return 'g';
-  } else if (color_distance(rgb, blue) == min_dist) {
-    return 'b';
-  } else if (color_distance(rgb, black) == min_dist) {
-    return 'k';
-  } else if (color_distance(rgb, yellow) == min_dist) {
-    return 'y';
-  } else {
-    return 'w';
+// read the colour sensor and push the classified sample through the colour filter,
+// returns 1 when the filter reports a debounced colour transition (left in ev)
+int sense_color(color_filter *f, color_event *ev) {
+  int rgb[3];
+  char c;
+  BT_read_colour_sensor_RGB(PORT_2, rgb);
+  c = what_color(rgb);
+  log_state(LOG_EVENT_SAMPLE, rgb, c);
+  if (use_particles) {
+    particle_step(c);
   }
-}
-// get index for map array given x and y location
-int get_index(int x, int y){
-  return x*sx+y;
-}
-// print the beliefs array
-void printBeliefs(){
-  int length = sx*sy;
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      printf("%f ", beliefs[i][j]);
-    }
-    printf("\n ");
+  if (!color_filter_push(f, c, ev)) {
+    return 0;
   }
+  log_state(LOG_EVENT_TRANSITION, rgb, ev->to);
+  return 1;
 }
-// normalize the beliefs array
-void normalizeBeliefs(){
-  int length = sx*sy;
-  //sum up
-  double sum = 0;
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      sum += beliefs[i][j];
-    }
+// feed a colour sample to the particle filter, with the odometry since the last one: the
+// distance from the commanded wheel powers and the elapsed time, the turn from the gyro.
+// A gyro read is a Bluetooth round trip as slow as the colour read, so the gyro is only read
+// while the wheels are commanded to turn the robot, every PARTICLE_GYRO_EVERY samples. Other
+// samples reuse the last reading anyone took. The first sample always reads it, to start from
+void particle_step(char c) {
+  uint64_t now = log_now_ns();
+  int angle = gyro_angle;
+  if (particle_t_ns == 0 ||
+      (motor_power[0] != motor_power[1] && particle_samples++ % PARTICLE_GYRO_EVERY == 0)) {
+    angle = get_angle();
   }
-  //divide
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      beliefs[i][j] = beliefs[i][j]/sum;
-    }
+  if (particle_t_ns != 0) {
+    double dt = (now - particle_t_ns)*1e-9;
+    double dist = 0.5*(motor_power[0] + motor_power[1])*PARTICLE_PX_PER_POWER*dt;
+    int turn = (angle - particle_gyro + 540)%360 - 180;
+    particles_update(&particles, dist, turn*M_PI/180.0, change_color(c));
   }
+  particle_t_ns = now;
+  particle_gyro = angle;
 }
-// return whether belief array has a unique max or not
-int beliefsHasUnipueMax(){
-  int length = sx*sy;
-  double max = 0;
-  //find max
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      if(beliefs[i][j] > max){
-        max = beliefs[i][j];
-      }
-    }
+// write a telemetry record with the robot's current state (does nothing if there is no log)
+void log_state(int event, const int *rgb, char color) {
+  log_record rec;
+  if (telemetry == NULL) {
+    return;
   }
-
-  //find unipue
-  int count = 0;
-  for (int i = 0; i < length; i++)
+  memset(&rec, 0, sizeof(rec));
+  rec.t_ns = log_now_ns();
+  for (int k = 0; k < 3; k++)
   {
-    for (int j = 0; j < 4; j++)
-    {
-      if(beliefs[i][j] == max){
-        count += 1;
-      }
-    }
+    rec.rgb[k] = rgb != NULL ? rgb[k] : -1;
   }
-  
-  return count == 1;
+  rec.gyro = gyro_angle;
+  rec.motor_l = motor_power[0];
+  rec.motor_r = motor_power[1];
+  rec.motor_c = motor_power[2];
+  rec.color = color;
+  rec.event = event;
+  rec.state = behaviour;
+  log_write(telemetry, &rec);
 }
-
-void updateBeliefByColor(int *tl, int *tr, int *br, int *bl){
-  int length = sx*sy;
-  int direction;
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      direction = color_match(tl, tr, br, bl, &map[i][0], &map[i][1], &map[i][2], &map[i][3]);
-      if(direction >= 0){
-        beliefs[i][direction] = 9*beliefs[i][direction];
-      }
-    }
+// log an intersection scan, colours are map codes
+void log_scan(int tl, int tr, int br, int bl) {
+  log_record rec;
+  if (telemetry == NULL) {
+    return;
   }
-  normalizeBeliefs();
+  memset(&rec, 0, sizeof(rec));
+  rec.t_ns = log_now_ns();
+  rec.rgb[0] = rec.rgb[1] = rec.rgb[2] = -1;
+  rec.gyro = gyro_angle;
+  rec.event = LOG_EVENT_SCAN;
+  rec.state = behaviour;
+  rec.scan[0] = tl;
+  rec.scan[1] = tr;
+  rec.scan[2] = br;
+  rec.scan[3] = bl;
+  log_write(telemetry, &rec);
 }
-
-void updateBeliefByAction(int touchRed){
-  int length = sx*sy;
-  double p = 0;
-  double beliefsCopy[400][4];
-  double small = 0.000001;
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      beliefsCopy[i][j] = beliefs[i][j];
-    }
-  }
-  if(touchRed){
-    for (int i = 0; i < length; i++)
-    {
-        if (i%sx == 0 && i/sx == 0) {//left top
-          beliefs[i][0] = beliefsCopy[i][0]*small;
-          beliefs[i][1] = beliefsCopy[i][3];
-          beliefs[i][2] = beliefsCopy[i][0];
-          beliefs[i][3] = beliefsCopy[i][3]*small;
-        } else if (i%sx == sx-1 && i/sx == 0) {//right top
-          beliefs[i][0] = beliefsCopy[i][0]*small;
-          beliefs[i][1] = beliefsCopy[i][1]*small;
-          beliefs[i][2] = beliefsCopy[i][0];
-          beliefs[i][3] = beliefsCopy[i][1];
-        }else if (i/sx == 0){//top mid
-          beliefs[i][0] = beliefsCopy[i][0]*small;
-          beliefs[i][1] = beliefsCopy[i][1]*small;
-          beliefs[i][2] = beliefsCopy[i][0];
-          beliefs[i][3] = beliefsCopy[i][3]*small;
-        }else if(i/sx == sy-1 && i%sx == 0){//bottom left
-          beliefs[i][0] = beliefsCopy[i][2];
-          beliefs[i][1] = beliefsCopy[i][3];
-          beliefs[i][2] = beliefsCopy[i][0]*small;
-          beliefs[i][3] = beliefsCopy[i][3]*small;
-        }else if (i/sx == sy-1 && i%sx == sx-1){//bottom right
-          beliefs[i][0] = beliefsCopy[i][2];
-          beliefs[i][1] = beliefsCopy[i][1]*small;
-          beliefs[i][2] = beliefsCopy[i][0]*small;
-          beliefs[i][3] = beliefsCopy[i][1];
-        } else if (i/sx == sy-1) {//bottom mid
-          beliefs[i][0] = beliefsCopy[i][2];
-          beliefs[i][1] = beliefsCopy[i][1]*small;
-          beliefs[i][2] = beliefsCopy[i][0]*small;
-          beliefs[i][3] = beliefsCopy[i][3]*small;
-        } else if (i%sx == 0) {//left mid
-          beliefs[i][0] = beliefsCopy[i][0]*small;
-          beliefs[i][1] = beliefsCopy[i][3];
-          beliefs[i][2] = beliefsCopy[i][0]*small;
-          beliefs[i][3] = beliefsCopy[i][3]*small;
-        } else if (i%sx == sx-1) {
-          beliefs[i][0] = beliefsCopy[i][0]*small;
-          beliefs[i][1] = beliefsCopy[i][0]*small;
-          beliefs[i][2] = beliefsCopy[i][0]*small;
-          beliefs[i][3] = beliefsCopy[i][1];
-        } else {
-          beliefs[i][0] = beliefsCopy[i][0]*small;
-          beliefs[i][1] = beliefsCopy[i][0]*small;
-          beliefs[i][2] = beliefsCopy[i][0]*small;
-          beliefs[i][3] = beliefsCopy[i][3]*small;
-        }
-    }
-  }else{
-    for (int i = 0; i < length; i++)
-    {
-      if (i%sx == 0 && i/sx == 0) {//left top
-        beliefs[i][0] = beliefsCopy[i+sx][0];
-        beliefs[i][1] = beliefsCopy[i][1]*small;
-        beliefs[i][2] = beliefsCopy[i][2]*small;
-        beliefs[i][3] = beliefsCopy[i+1][3];
-      } else if (i%sx == sx-1 && i/sx == 0) {//right top
-        beliefs[i][0] = beliefsCopy[i+sx][0];
-        beliefs[i][1] = beliefsCopy[i-1][1];
-        beliefs[i][2] = beliefsCopy[i][2]*small;
-        beliefs[i][3] = beliefsCopy[i][3]*small;
-      }else if (i/sx == 0){//top mid
-        beliefs[i][0] = beliefsCopy[i+sx][0];
-        beliefs[i][1] = beliefsCopy[i-1][1];
-        beliefs[i][2] = beliefsCopy[i][2]*small;
-        beliefs[i][3] = beliefsCopy[i+1][3];
-      }else if(i/sx == sy-1 && i%sx == 0){//bottom left
-        beliefs[i][0] = beliefsCopy[i][0]*small;
-        beliefs[i][1] = beliefsCopy[i][1]*small;
-        beliefs[i][2] = beliefsCopy[i-sx][2];
-        beliefs[i][3] = beliefsCopy[i+1][3];
-      }else if (i/sx == sy-1 && i%sx == sx-1){//bottom right
-        beliefs[i][0] = beliefsCopy[i][0]*small;
-        beliefs[i][1] = beliefsCopy[i-1][1];
-        beliefs[i][2] = beliefsCopy[i-sx][2];
-        beliefs[i][3] = beliefsCopy[i][3]*small;
-      } else if (i/sx == sy-1) {//bottom mid
-        beliefs[i][0] = beliefsCopy[i][0]*small;
-        beliefs[i][1] = beliefsCopy[i-1][1];
-        beliefs[i][2] = beliefsCopy[i-sx][2];
-        beliefs[i][3] = beliefsCopy[i+1][3];
-      } else if (i%sx == 0) {//left mid
-        beliefs[i][0] = beliefsCopy[i+sx][0];
-        beliefs[i][1] = beliefsCopy[i][1]*small;
-        beliefs[i][2] = beliefsCopy[i-sx][2];
-        beliefs[i][3] = beliefsCopy[i+1][3];
-      } else if (i%sx == sx-1) {
-        beliefs[i][0] = beliefsCopy[i+sx][0];
-        beliefs[i][1] = beliefsCopy[i-1][1];
-        beliefs[i][2] = beliefsCopy[i-sx][2];
-        beliefs[i][3] = beliefsCopy[i][3]*small;
-      } else {
-        beliefs[i][0] = beliefsCopy[i+sx][0];
-        beliefs[i][1] = beliefsCopy[i-1][1];
-        beliefs[i][2] = beliefsCopy[i-sx][2];
-        beliefs[i][3] = beliefsCopy[i+1][3];
-      }
-    }
+// change the behaviour state recorded in the telemetry log
+void set_behaviour(int state) {
+  if (state != behaviour) {
+    behaviour = state;
+    log_state(LOG_EVENT_STATE, NULL, 0);
   }
-  normalizeBeliefs();
 }
-
-int color_match(int *tl1, int *tr1, int *br1, int *bl1, int *tl2, int *tr2, int *br2, int *bl2){
-  //return direction if color match in any direction, -1 if no match
-  if(*(tl1)==*(tl2) && *(tr1)==*(tr2) && *(br1)==*(br2) && *(bl1)==*(bl2)){
-    return 0;
-  }
-  else if(*(tl1)==*(tr2) && *(tr1)==*(br2) && *(br1)==*(bl2) && *(bl1)==*(tl2)){
-    return 1;
-  }else if(*(tl1)==*(br2) && *(tr1)==*(bl2) && *(br1)==*(tl2) && *(bl1)==*(tr2)){
-    return 2;
-  }else if (*(tl1)==*(bl2) && *(tr1)==*(tl2) && *(br1)==*(tr2) && *(bl1)==*(br2))
-  {
-    return 3;
+// remember the commanded motor powers, logging any change
+void set_motor_state(int left, int right, int arm) {
+  if (left == motor_power[0] && right == motor_power[1] && arm == motor_power[2]) {
+    return;
   }
-  return -1;
+  motor_power[0] = left;
+  motor_power[1] = right;
+  motor_power[2] = arm;
+  log_state(LOG_EVENT_MOTOR, NULL, 0);
 }
-
-int parse_map(unsigned char *map_img, int rx, int ry)
-{
- /*
-   This function takes an input image map array, and two integers that specify the image size.
-   It attempts to parse this image into a representation of the map in the image. The size
-   and resolution of the map image should not affect the parsing (i.e. you can make your own
-   maps without worrying about the exact position of intersections, roads, buildings, etc.).
-
-   However, this function requires:
-   
-   * White background for the image  [255 255 255]
-   * Red borders around the map  [255 0 0]
-   * Black roads  [0 0 0]
-   * Yellow intersections  [255 255 0]
-   * Buildings that are pure green [0 255 0], pure blue [0 0 255], or white [255 255 255]
-   (any other colour values are ignored - so you can add markings if you like, those 
-    will not affect parsing)
-
-   The image must be a properly formated .ppm image, see readPPMimage below for details of
-   the format. The GIMP image editor saves properly formatted .ppm images, as does the
-   imagemagick image processing suite.
-   
-   The map representation is read into the map array, with each row in the array corrsponding
-   to one intersection, in raster order, that is, for a map with k intersections along its width:
-   
-    (row index for the intersection)
-    
-    0     1     2    3 ......   k-1
-    
-    k    k+1   k+2  ........    
-    
-    Each row will then contain the colour values for buildings around the intersection 
-    clockwise from top-left, that is
-    
-    
-    top-left               top-right
-            
-            intersection
-    
-    bottom-left           bottom-right
-    
-    So, for the first intersection (at row 0 in the map array)
-    map[0][0] <---- colour for the top-left building
-    map[0][1] <---- colour for the top-right building
-    map[0][2] <---- colour for the bottom-right building
-    map[0][3] <---- colour for the bottom-left building
-    
-    Color values for map locations are defined as follows (this agrees with what the
-    EV3 sensor returns in indexed-colour-reading mode):
-    
-    1 -  Black
-    2 -  Blue
-    3 -  Green
-    4 -  Yellow
-    5 -  Red
-    6 -  White
-    
-    If you find a 0, that means you're trying to access an intersection that is not on the
-    map! Also note that in practice, because of how the map is defined, you should find
-    only Green, Blue, or White around a given intersection.
-    
-    The map size (the number of intersections along the horizontal and vertical directions) is
-    updated and left in the global variables sx and sy.
-
-    Feel free to create your own maps for testing (you'll have to print them to a reasonable
-    size to use with your bot).
-    
- */    
- 
- int last3[3];
- int x,y;
- unsigned char R,G,B;
- int ix,iy;
- int bx,by,dx,dy,wx,wy;         // Intersection geometry parameters
- int tgl;
- int idx;
- 
- ix=iy=0;       // Index to identify the current intersection
- 
- // Determine the spacing and size of intersections in the map
- tgl=0;
- for (int i=0; i<rx; i++)
- {
-  for (int j=0; j<ry; j++)
-  {
-   R=*(map_img+((i+(j*rx))*3));
-   G=*(map_img+((i+(j*rx))*3)+1);
-   B=*(map_img+((i+(j*rx))*3)+2);
-   if (R==255&&G==255&&B==0)
-   {
-    // First intersection, top-left pixel. Scan right to find width and spacing
-    bx=i;           // Anchor for intersection locations
-    by=j;
-    for (int k=i; k<rx; k++)        // Find width and horizontal distance to next intersection
-    {
-     R=*(map_img+((k+(by*rx))*3));
-     G=*(map_img+((k+(by*rx))*3)+1);
-     B=*(map_img+((k+(by*rx))*3)+2);
-     if (tgl==0&&(R!=255||G!=255||B!=0))
-     {
-      tgl=1;
-      wx=k-i;
-     }
-     if (tgl==1&&R==255&&G==255&&B==0)
-     {
-      tgl=2;
-      dx=k-i;
-     }
-    }
-    for (int k=j; k<ry; k++)        // Find height and vertical distance to next intersection
-    {
-     R=*(map_img+((bx+(k*rx))*3));
-     G=*(map_img+((bx+(k*rx))*3)+1);
-     B=*(map_img+((bx+(k*rx))*3)+2);
-     if (tgl==2&&(R!=255||G!=255||B!=0))
-     {
-      tgl=3;
-      wy=k-j;
-     }
-     if (tgl==3&&R==255&&G==255&&B==0)
-     {
-      tgl=4;
-      dy=k-j;
-     }
-    }
-    
-    if (tgl!=4)
-    {
-     fprintf(stderr,"Unable to determine intersection geometry!\n");
-     return(0);
-    }
-    else break;
-   }
-  }
-  if (tgl==4) break;
- }
-  fprintf(stderr,"Intersection parameters: base_x=%d, base_y=%d, width=%d, height=%d, horiz_distance=%d, vertical_distance=%d\n",bx,by,wx,wy,dx,dy);
-
-  sx=0;
-  for (int i=bx+(wx/2);i<rx;i+=dx)
-  {
-   R=*(map_img+((i+(by*rx))*3));
-   G=*(map_img+((i+(by*rx))*3)+1);
-   B=*(map_img+((i+(by*rx))*3)+2);
-   if (R==255&&G==255&&B==0) sx++;
-  }
-
-  sy=0;
-  for (int j=by+(wy/2);j<ry;j+=dy)
-  {
-   R=*(map_img+((bx+(j*rx))*3));
-   G=*(map_img+((bx+(j*rx))*3)+1);
-   B=*(map_img+((bx+(j*rx))*3)+2);
-   if (R==255&&G==255&&B==0) sy++;
-  }
-  
-  fprintf(stderr,"Map size: Number of horizontal intersections=%d, number of vertical intersections=%d\n",sx,sy);
-
-  // Scan for building colours around each intersection
-  idx=0;
-  for (int j=0; j<sy; j++)
-   for (int i=0; i<sx; i++)
-   {
-    x=bx+(i*dx)+(wx/2);
-    y=by+(j*dy)+(wy/2);
-    
-    fprintf(stderr,"Intersection location: %d, %d\n",x,y);
-    // Top-left
-    x-=wx;
-    y-=wy;
-    R=*(map_img+((x+(y*rx))*3));
-    G=*(map_img+((x+(y*rx))*3)+1);
-    B=*(map_img+((x+(y*rx))*3)+2);
-    if (R==0&&G==255&&B==0) map[idx][0]=3;
-    else if (R==0&&G==0&&B==255) map[idx][0]=2;
-    else if (R==255&&G==255&&B==255) map[idx][0]=6;
-    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Top-Left RGB=%d,%d,%d\n",i,j,R,G,B);
-
-    // Top-right
-    x+=2*wx;
-    R=*(map_img+((x+(y*rx))*3));
-    G=*(map_img+((x+(y*rx))*3)+1);
-    B=*(map_img+((x+(y*rx))*3)+2);
-    if (R==0&&G==255&&B==0) map[idx][1]=3;
-    else if (R==0&&G==0&&B==255) map[idx][1]=2;
-    else if (R==255&&G==255&&B==255) map[idx][1]=6;
-    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Top-Right RGB=%d,%d,%d\n",i,j,R,G,B);
-
-    // Bottom-right
-    y+=2*wy;
-    R=*(map_img+((x+(y*rx))*3));
-    G=*(map_img+((x+(y*rx))*3)+1);
-    B=*(map_img+((x+(y*rx))*3)+2);
-    if (R==0&&G==255&&B==0) map[idx][2]=3;
-    else if (R==0&&G==0&&B==255) map[idx][2]=2;
-    else if (R==255&&G==255&&B==255) map[idx][2]=6;
-    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Bottom-Right RGB=%d,%d,%d\n",i,j,R,G,B);
-    
-    // Bottom-left
-    x-=2*wx;
-    R=*(map_img+((x+(y*rx))*3));
-    G=*(map_img+((x+(y*rx))*3)+1);
-    B=*(map_img+((x+(y*rx))*3)+2);
-    if (R==0&&G==255&&B==0) map[idx][3]=3;
-    else if (R==0&&G==0&&B==255) map[idx][3]=2;
-    else if (R==255&&G==255&&B==255) map[idx][3]=6;
-    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Bottom-Left RGB=%d,%d,%d\n",i,j,R,G,B);
-    
-    fprintf(stderr,"Colours for this intersection: %d, %d, %d, %d\n",map[idx][0],map[idx][1],map[idx][2],map[idx][3]);
-    
-    idx++;
-   }
-
- return(1);  
+// motor commands go through these wrappers so the telemetry log sees the commanded powers
+void cmd_drive(int power) {
+  BT_drive(MOTOR_A, MOTOR_D, power);
+  set_motor_state(power, power, motor_power[2]);
+}
+void cmd_turn(int left, int right) {
+  BT_turn(MOTOR_A, left, MOTOR_D, right);
+  set_motor_state(left, right, motor_power[2]);
+}
+void cmd_arm(int power) {
+  BT_motor_port_start(MOTOR_C, power);
+  set_motor_state(motor_power[0], motor_power[1], power);
+}
+void cmd_stop(int brake) {
+  BT_all_stop(brake);
+  set_motor_state(0, 0, 0);
 }
-
-unsigned char *readPPMimage(const char *filename, int *rx, int *ry)
-{
- // Reads an image from a .ppm file. A .ppm file is a very simple image representation
- // format with a text header followed by the binary RGB data at 24bits per pixel.
- // The header has the following form:
- //
- // P6
- // # One or more comment lines preceded by '#'
- // 340 200
- // 255
- //
- // The first line 'P6' is the .ppm format identifier, this is followed by one or more
- // lines with comments, typically used to inidicate which program generated the
- // .ppm file.
- // After the comments, a line with two integer values specifies the image resolution
- // as number of pixels in x and number of pixels in y.
- // The final line of the header stores the maximum value for pixels in the image,
- // usually 255.
- // After this last header line, binary data stores the RGB values for each pixel
- // in row-major order. Each pixel requires 3 bytes ordered R, G, and B.
- //
- // NOTE: Windows file handling is rather crotchetty. You may have to change the
- //       way this file is accessed if the images are being corrupted on read
- //       on Windows.
- //
-
- FILE *f;
- unsigned char *im;
- char line[1024];
- int i;
- unsigned char *tmp;
- double *fRGB;
-
- im=NULL;
- f=fopen(filename,"rb+");
- if (f==NULL)
- {
-  fprintf(stderr,"Unable to open file %s for reading, please check name and path\n",filename);
-  return(NULL);
- }
- fgets(&line[0],1000,f);
- if (strcmp(&line[0],"P6\n")!=0)
- {
-  fprintf(stderr,"Wrong file format, not a .ppm file or header end-of-line characters missing\n");
-  fclose(f);
-  return(NULL);
- }
- fprintf(stderr,"%s\n",line);
- // Skip over comments
- fgets(&line[0],511,f);
- while (line[0]=='#')
- {
-  fprintf(stderr,"%s",line);
-  fgets(&line[0],511,f);
- }
- sscanf(&line[0],"%d %d\n",rx,ry);                  // Read image size
- fprintf(stderr,"nx=%d, ny=%d\n\n",*rx,*ry);
-
- fgets(&line[0],9,f);  	                // Read the remaining header line
- fprintf(stderr,"%s\n",line);
- im=(unsigned char *)calloc((*rx)*(*ry)*3,sizeof(unsigned char));
- if (im==NULL)
- {
-  fprintf(stderr,"Out of memory allocating space for image\n");
-  fclose(f);
-  return(NULL);
- }
- fread(im,(*rx)*(*ry)*3*sizeof(unsigned char),1,f);
- fclose(f);
-
- return(im);    
-}
\ No newline at end of file
@@ -67,34 +67,51 @@ code that you have to complete in order to implement the localization algorithms
 #include<math.h>
 #include<malloc.h>
 #include "./EV3_RobotControl/btcomm.h"
+#include "EV3_Color.h"
+#include "EV3_Log.h"
+#include "EV3_Map.h"
+#include "EV3_Beliefs.h"
+#include "EV3_Particles.h"
+#include "EV3_Policy.h"
+#include "EV3_Checkpoint.h"
+#include "EV3_Explore.h"
 
 #ifndef HEXKEY
 	#define HEXKEY "00:16:53:56:4c:53"	// <--- SET UP YOUR EV3's HEX ID here
 #endif
 
-int parse_map(unsigned char *map_img, int rx, int ry);
 int robot_localization(int *robot_x, int *robot_y, int *direction);
 int go_to_target(int robot_x, int robot_y, int direction, int target_x, int target_y);
 int find_street(void);
 int drive_along_street(void);
 int scan_intersection(int *tl, int *tr, int *br, int *bl);
+int scan_buildings(int colour[4], building_sink read, void *arg);
+int sweep_building(color_filter *cf, color_event *ev, int power);
 int turn_at_intersection(int turn_direction);
 void calibrate_sensor(void);
-unsigned char *readPPMimage(const char *filename, int *rx, int*ry);
-double color_distance(int* rgba, int* rgbb);
-char what_color(int* rgb);
 void rotate_to(int angle);
 int get_angle();
 void center_sensor(void);
-int get_index(int x, int y);
-int beliefsHasUnipueMax();
-void printBeliefs();
-void normalizeBeliefs();
-void updateBeliefByColor(int *tl, int *tr, int *br, int *bl);
-int color_match(int *tl1, int *tr1, int *br1, int *bl1, int *tl2, int *tr2, int *br2, int *bl2);
 int verify_colors(int robot_x, int robot_y, int direction);
-int change_color(char c);
-void updateBeliefByAction(int touchRed);
+void turn_quarters(int quarter_turns);
+int track_scan(void);
+void save_checkpoint(int pending);
+void io_scan(void *ctx, int colour[4]);
+void io_scan_stream(void *ctx, building_sink read, void *arg);
+int track_building(void *arg, int position, int colour);
+void io_turn(void *ctx, int quarter_turns);
+int io_drive(void *ctx);
+void io_event(void *ctx, int event, int arg);
+int sense_color(color_filter *f, color_event *ev);
+void particle_step(char c);
+void log_state(int event, const int *rgb, char color);
+void log_scan(int tl, int tr, int br, int bl);
+void set_behaviour(int state);
+void set_motor_state(int left, int right, int arm);
+void cmd_drive(int power);
+void cmd_turn(int left, int right);
+void cmd_arm(int power);
+void cmd_stop(int brake);
 
 
 #endif
@@ -0,0 +1,348 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Binary telemetry log - see EV3_Log.h for the file layout.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<pthread.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include "EV3_Log.h"
+
+static_assert(sizeof(log_record) == 32, "log records must stay 32 bytes");
+
+#define LOG_BATCH 256               // Records the writer thread moves out of the ring at a time
+
+struct log_writer
+{
+ FILE *f;
+ pthread_t thread;
+ pthread_mutex_t lock;
+ pthread_cond_t wake;
+ log_record ring[LOG_RING_SIZE];
+ uint64_t head;                 // Records put in the ring (producer)
+ uint64_t tail;                 // Records taken out of the ring (writer thread)
+ int closing;
+ uint64_t dropped;
+ uint64_t written;              // Records on disk, also the next record number
+ log_time_entry *time_index;    // Index, built by the writer thread as records go out
+ uint64_t time_count, time_cap;
+ uint32_t *events[LOG_EVENT_TYPES];
+ uint64_t event_count[LOG_EVENT_TYPES], event_cap[LOG_EVENT_TYPES];
+};
+
+// current monotonic time in nanoseconds
+uint64_t log_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// append to one of the writer's growable index arrays
+static void *grow(void *array, uint64_t *cap, uint64_t count, size_t item)
+{
+  if (count < *cap) return array;
+  *cap = *cap ? 2*(*cap) : 1024;
+  return realloc(array, (*cap)*item);
+}
+
+// write a batch of records out and add them to the index
+static void write_batch(log_writer *w, const log_record *batch, int n)
+{
+  fwrite(batch, sizeof(log_record), n, w->f);
+  for (int i = 0; i < n; i++, w->written++)
+  {
+    int e = batch[i].event < LOG_EVENT_TYPES ? batch[i].event : LOG_EVENT_SAMPLE;
+    if (w->written % LOG_TIME_STRIDE == 0) {
+      w->time_index = (log_time_entry *)grow(w->time_index, &w->time_cap, w->time_count, sizeof(log_time_entry));
+      w->time_index[w->time_count].t_ns = batch[i].t_ns;
+      w->time_index[w->time_count].record = w->written;
+      w->time_count++;
+    }
+    w->events[e] = (uint32_t *)grow(w->events[e], &w->event_cap[e], w->event_count[e], sizeof(uint32_t));
+    w->events[e][w->event_count[e]++] = (uint32_t)w->written;
+  }
+}
+
+// background thread, drains the ring buffer to disk until the log is closed
+static void *writer_thread(void *arg)
+{
+  log_writer *w = (log_writer *)arg;
+  log_record batch[LOG_BATCH];
+
+  while (1)
+  {
+    int n = 0;
+    pthread_mutex_lock(&w->lock);
+    while (w->head == w->tail && !w->closing)
+    {
+      pthread_cond_wait(&w->wake, &w->lock);
+    }
+    if (w->head == w->tail && w->closing) {
+      pthread_mutex_unlock(&w->lock);
+      break;
+    }
+    while (w->tail < w->head && n < LOG_BATCH)
+    {
+      batch[n++] = w->ring[w->tail % LOG_RING_SIZE];
+      w->tail++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    write_batch(w, batch, n);
+  }
+  return NULL;
+}
+
+// create a new log file and start its writer thread, returns NULL on failure
+log_writer *log_open(const char *filename)
+{
+  log_writer *w;
+  log_file_header hdr;
+
+  w = (log_writer *)calloc(1, sizeof(log_writer));
+  if (w == NULL) return NULL;
+  w->f = fopen(filename, "wb");
+  if (w->f == NULL) {
+    fprintf(stderr, "Unable to open log file %s for writing\n", filename);
+    free(w);
+    return NULL;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, LOG_MAGIC, 8);
+  hdr.record_size = sizeof(log_record);
+  hdr.version = 1;
+  hdr.start_ns = log_now_ns();
+  fwrite(&hdr, sizeof(hdr), 1, w->f);
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+    fprintf(stderr, "Unable to start log writer thread\n");
+    fclose(w->f);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+// queue a record for writing. Never blocks on disk, if the ring is full the record is dropped
+void log_write(log_writer *w, const log_record *rec)
+{
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  if (w->head - w->tail == LOG_RING_SIZE) {
+    w->dropped++;
+  } else {
+    w->ring[w->head % LOG_RING_SIZE] = *rec;
+    w->head++;
+    pthread_cond_signal(&w->wake);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+// flush everything still queued, write the index and trailer, and close the file
+void log_close(log_writer *w)
+{
+  log_file_trailer tr;
+  long pos;
+
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  memset(&tr, 0, sizeof(tr));
+  tr.record_count = w->written;
+  pos = ftell(w->f);
+  tr.time_offset = pos;
+  tr.time_count = w->time_count;
+  fwrite(w->time_index, sizeof(log_time_entry), w->time_count, w->f);
+  pos += w->time_count*sizeof(log_time_entry);
+  for (int e = 0; e < LOG_EVENT_TYPES; e++)
+  {
+    tr.event_offset[e] = pos;
+    tr.event_count[e] = w->event_count[e];
+    fwrite(w->events[e], sizeof(uint32_t), w->event_count[e], w->f);
+    pos += w->event_count[e]*sizeof(uint32_t);
+  }
+  if (pos % 8) {
+    // keep the trailer 8-byte aligned in the mapped file
+    uint32_t zero = 0;
+    fwrite(&zero, sizeof(uint32_t), 1, w->f);
+  }
+  tr.dropped = w->dropped;
+  memcpy(tr.magic, LOG_TRAILER_MAGIC, 8);
+  fwrite(&tr, sizeof(tr), 1, w->f);
+  fclose(w->f);
+
+  if (w->dropped) fprintf(stderr, "Telemetry log: %lu records dropped\n", (unsigned long)w->dropped);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->wake);
+  free(w->time_index);
+  for (int e = 0; e < LOG_EVENT_TYPES; e++) free(w->events[e]);
+  free(w);
+}
+
+// true if count entries of the given size, starting at offset, lie inside [start, end)
+static int table_fits(uint64_t offset, uint64_t count, uint64_t entry, uint64_t start, uint64_t end)
+{
+  return offset >= start && offset <= end && count <= (end - offset)/entry;
+}
+
+// check every table the trailer points at lies between the header and the trailer, and the
+// records end before the time index, so a corrupt trailer can't send the reader out of the file.
+// The tables' contents are record numbers the seeks index records[] with, so they are checked
+// too: time index entries in order and not past the end, event lists below record_count
+static int trailer_valid(const unsigned char *base, const log_file_trailer *tr, size_t size)
+{
+  uint64_t start = sizeof(log_file_header);
+  uint64_t end = size - sizeof(log_file_trailer);
+  const log_time_entry *ti;
+
+  if (!table_fits(tr->time_offset, tr->time_count, sizeof(log_time_entry), start, end)) return 0;
+  if (!table_fits(start, tr->record_count, sizeof(log_record), start, tr->time_offset)) return 0;
+  ti = (const log_time_entry *)(base + tr->time_offset);
+  for (uint64_t k = 0; k < tr->time_count; k++)
+  {
+    if (ti[k].record > tr->record_count || (k > 0 && ti[k].record < ti[k-1].record)) return 0;
+  }
+  for (int e = 0; e < LOG_EVENT_TYPES; e++)
+  {
+    const uint32_t *ev;
+    if (!table_fits(tr->event_offset[e], tr->event_count[e], sizeof(uint32_t), start, end)) {
+      return 0;
+    }
+    ev = (const uint32_t *)(base + tr->event_offset[e]);
+    for (uint64_t k = 0; k < tr->event_count[e]; k++)
+    {
+      if (ev[k] >= tr->record_count) return 0;
+    }
+  }
+  return 1;
+}
+
+// map a log file for reading, returns 1 on success
+int log_reader_open(log_reader *r, const char *filename)
+{
+  struct stat st;
+  const log_file_header *hdr;
+  const log_file_trailer *tr;
+
+  memset(r, 0, sizeof(log_reader));
+  r->base = NULL;
+  r->fd = open(filename, O_RDONLY);
+  if (r->fd < 0) {
+    fprintf(stderr, "Unable to open log file %s\n", filename);
+    return 0;
+  }
+  if (fstat(r->fd, &st) != 0 || (size_t)st.st_size < sizeof(log_file_header)) {
+    fprintf(stderr, "Log file %s is too short\n", filename);
+    close(r->fd);
+    r->fd = -1;
+    return 0;
+  }
+  r->size = st.st_size;
+  r->base = (const unsigned char *)mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+  if (r->base == MAP_FAILED) {
+    fprintf(stderr, "Unable to map log file %s\n", filename);
+    close(r->fd);
+    r->fd = -1;
+    r->base = NULL;
+    return 0;
+  }
+  hdr = (const log_file_header *)r->base;
+  if (memcmp(hdr->magic, LOG_MAGIC, 8) != 0 || hdr->record_size != sizeof(log_record)) {
+    fprintf(stderr, "%s is not a telemetry log\n", filename);
+    log_reader_close(r);
+    return 0;
+  }
+  r->records = (const log_record *)(r->base + sizeof(log_file_header));
+
+  tr = NULL;
+  if (r->size >= sizeof(log_file_header) + sizeof(log_file_trailer)) {
+    tr = (const log_file_trailer *)(r->base + r->size - sizeof(log_file_trailer));
+  }
+  if (tr != NULL && memcmp(tr->magic, LOG_TRAILER_MAGIC, 8) == 0 &&
+      !trailer_valid(r->base, tr, r->size)) {
+    fprintf(stderr, "%s has a damaged index, reading its records directly\n", filename);
+    tr = NULL;
+  }
+  if (tr != NULL && memcmp(tr->magic, LOG_TRAILER_MAGIC, 8) == 0) {
+    r->record_count = tr->record_count;
+    r->time_index = (const log_time_entry *)(r->base + tr->time_offset);
+    r->time_count = tr->time_count;
+    for (int e = 0; e < LOG_EVENT_TYPES; e++)
+    {
+      r->events[e] = (const uint32_t *)(r->base + tr->event_offset[e]);
+      r->event_count[e] = tr->event_count[e];
+    }
+    r->dropped = tr->dropped;
+  } else {
+    // the run was cut short (or the trailer is damaged), use whatever complete records made it
+    // to disk
+    r->record_count = (r->size - sizeof(log_file_header))/sizeof(log_record);
+  }
+  return 1;
+}
+
+void log_reader_close(log_reader *r)
+{
+  if (r->base != NULL && r->base != MAP_FAILED) munmap((void *)r->base, r->size);
+  if (r->fd >= 0) close(r->fd);
+  memset(r, 0, sizeof(log_reader));
+  r->fd = -1;
+}
+
+// first record number with a timestamp >= t_ns (record_count if there is none)
+uint64_t log_seek_time(const log_reader *r, uint64_t t_ns)
+{
+  uint64_t lo = 0, hi = r->record_count;
+
+  // narrow the range down to one index stride first, if the log has an index
+  if (r->time_index != NULL && r->time_count > 0) {
+    uint64_t a = 0, b = r->time_count;
+    while (a < b)
+    {
+      uint64_t m = (a + b)/2;
+      if (r->time_index[m].t_ns < t_ns) a = m + 1;
+      else b = m;
+    }
+    if (a > 0) lo = r->time_index[a-1].record;
+    if (a < r->time_count) hi = r->time_index[a].record;
+  }
+  while (lo < hi)
+  {
+    uint64_t m = (lo + hi)/2;
+    if (r->records[m].t_ns < t_ns) lo = m + 1;
+    else hi = m;
+  }
+  return lo;
+}
+
+// position in events[event] of the first event of that type at or after t_ns
+// (event_count[event] if there is none, or the log has no index)
+uint64_t log_seek_event(const log_reader *r, int event, uint64_t t_ns)
+{
+  uint64_t lo = 0, hi;
+
+  if (event < 0 || event >= LOG_EVENT_TYPES) return 0;
+  hi = r->event_count[event];
+  while (lo < hi)
+  {
+    uint64_t m = (lo + hi)/2;
+    if (r->records[r->events[event][m]].t_ns < t_ns) lo = m + 1;
+    else hi = m;
+  }
+  return lo;
+}
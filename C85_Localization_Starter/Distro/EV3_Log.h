@@ -0,0 +1,124 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Binary telemetry log. A run is recorded as an append-only file of fixed-size records, each
+ holding a monotonic timestamp, the raw colour sample and its classification, the gyro angle,
+ the commanded motor powers and the robot's behaviour state at that moment.
+
+ File layout:
+
+    log_file_header                         (32 bytes)
+    log_record[record_count]                (32 bytes each, in time order)
+    log_time_entry[time_count]              (one per LOG_TIME_STRIDE records)
+    uint32_t[...]                           (record numbers, grouped by event type)
+    log_file_trailer                        (at the very end of the file)
+
+ The index and trailer are written when the log is closed. A log whose run was cut short has
+ no trailer, the reader then falls back to searching the records directly - they are in time
+ order, so seeks are O(log n) either way.
+
+ Writing is off the control path: log_write() copies the record into a ring buffer and returns,
+ a background thread drains the buffer to disk. If the disk falls behind and the buffer fills
+ up, records are dropped (and counted) rather than stalling the robot.
+
+ Reading is done through mmap(), so hours of runs can be browsed without loading them.
+
+*/
+
+#ifndef __log_header
+#define __log_header
+
+#include<stdint.h>
+#include<stddef.h>
+
+#define LOG_MAGIC "EV3LOG01"
+#define LOG_TRAILER_MAGIC "EV3IDX01"
+#define LOG_RING_SIZE 4096          // Records buffered between the robot and the writer thread
+#define LOG_TIME_STRIDE 256         // Records between time index entries
+
+// Event types - what caused a record to be written
+#define LOG_EVENT_SAMPLE 0          // Colour sensor sample
+#define LOG_EVENT_TRANSITION 1      // Debounced colour transition
+#define LOG_EVENT_MOTOR 2           // Change in commanded motor power
+#define LOG_EVENT_GYRO 3            // Gyro reading
+#define LOG_EVENT_STATE 4           // Change of behaviour state
+#define LOG_EVENT_SCAN 5            // Completed intersection scan (colours in scan[])
+#define LOG_EVENT_TYPES 6
+
+// Behaviour states
+#define BEHAVIOUR_IDLE 0
+#define BEHAVIOUR_FIND_STREET 1
+#define BEHAVIOUR_DRIVE 2
+#define BEHAVIOUR_SCAN 3
+#define BEHAVIOUR_TURN 4
+#define BEHAVIOUR_CALIBRATE 5
+
+typedef struct log_record
+{
+ uint64_t t_ns;             // Monotonic timestamp, nanoseconds
+ int16_t rgb[3];            // Raw colour sample, [0,1020]
+ int16_t gyro;              // Gyro angle, degrees [0,360)
+ int8_t motor_l;            // Commanded powers, left/right wheel and sensor arm
+ int8_t motor_r;
+ int8_t motor_c;
+ char color;                // Classified colour ('r','g','b','k','y','w'), 0 if none
+ uint8_t event;             // LOG_EVENT_*
+ uint8_t state;             // BEHAVIOUR_*
+ uint8_t scan[4];           // LOG_EVENT_SCAN only: building colours tl,tr,br,bl as map codes
+ uint8_t pad[6];
+} log_record;
+
+typedef struct log_file_header
+{
+ char magic[8];             // LOG_MAGIC
+ uint32_t record_size;      // sizeof(log_record)
+ uint32_t version;
+ uint64_t start_ns;         // Timestamp when the log was opened
+ uint64_t reserved;
+} log_file_header;
+
+typedef struct log_time_entry
+{
+ uint64_t t_ns;             // Timestamp of record number record
+ uint64_t record;
+} log_time_entry;
+
+typedef struct log_file_trailer
+{
+ uint64_t record_count;
+ uint64_t time_offset;                      // File offset of the time index
+ uint64_t time_count;
+ uint64_t event_offset[LOG_EVENT_TYPES];    // File offset of each event type's record list
+ uint64_t event_count[LOG_EVENT_TYPES];
+ uint64_t dropped;                          // Records lost to a full ring buffer
+ char magic[8];                             // LOG_TRAILER_MAGIC, last bytes of the file
+} log_file_trailer;
+
+typedef struct log_writer log_writer;
+
+typedef struct log_reader
+{
+ int fd;
+ const unsigned char *base;     // mmap()ed file
+ size_t size;
+ const log_record *records;
+ uint64_t record_count;
+ const log_time_entry *time_index;      // NULL if the log has no trailer
+ uint64_t time_count;
+ const uint32_t *events[LOG_EVENT_TYPES];
+ uint64_t event_count[LOG_EVENT_TYPES];
+ uint64_t dropped;
+} log_reader;
+
+uint64_t log_now_ns(void);
+log_writer *log_open(const char *filename);
+void log_write(log_writer *w, const log_record *rec);
+void log_close(log_writer *w);
+
+int log_reader_open(log_reader *r, const char *filename);
+void log_reader_close(log_reader *r);
+uint64_t log_seek_time(const log_reader *r, uint64_t t_ns);
+uint64_t log_seek_event(const log_reader *r, int event, uint64_t t_ns);
+
+#endif
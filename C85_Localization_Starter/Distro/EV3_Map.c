@@ -0,0 +1,442 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Map representation and map image parsing - see EV3_Map.h.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "EV3_Map.h"
+
+int (*map)[4] = NULL;       // This holds the representation of the map, raster ordered,
+                            // 4 building colours per intersection.
+uint8_t *map_sig = NULL;    // Same colours, one byte signature per intersection
+uint8_t sig_rotate[256][4];
+uint32_t sig_index_start[257];
+uint32_t *sig_index = NULL;   // (intersection<<2)|direction, grouped by matching scan signature
+uint32_t sig_code_count[4];   // Buildings on the map with each 2-bit code
+int sx, sy;                 // Size of the map (number of intersections along x and y)
+
+// allocate size bytes aligned to a 64-byte cache line (size is rounded up to match)
+void *alloc_aligned(size_t size)
+{
+  size = (size + 63) & ~(size_t)63;
+  return aligned_alloc(64, size ? size : 64);
+}
+
+// (re)allocate the map array for a map of nx by ny intersections, cleared to 0 (no colour).
+// Returns 1 on success, 0 if the map is too large
+int alloc_map(int nx, int ny)
+{
+  free_map();
+  if (nx<=0||ny<=0||nx>MAX_MAP_DIM||ny>MAX_MAP_DIM)
+  {
+    fprintf(stderr,"Map size %d x %d is not supported (at most %d x %d intersections)\n",nx,ny,MAX_MAP_DIM,MAX_MAP_DIM);
+    return(0);
+  }
+  map=(int (*)[4])alloc_aligned((size_t)nx*ny*4*sizeof(int));
+  if (map==NULL)
+  {
+    fprintf(stderr,"Out of memory allocating space for the map\n");
+    return(0);
+  }
+  map_sig=(uint8_t *)alloc_aligned((size_t)nx*ny);
+  sig_index=(uint32_t *)alloc_aligned((size_t)nx*ny*4*sizeof(uint32_t));
+  if (map_sig==NULL||sig_index==NULL)
+  {
+    fprintf(stderr,"Out of memory allocating space for the map\n");
+    free_map();
+    return(0);
+  }
+  memset(map,0,(size_t)nx*ny*4*sizeof(int));
+  memset(map_sig,0xff,(size_t)nx*ny);         // all SIG_OTHER
+  return(1);
+}
+
+void free_map(void)
+{
+  free(map);
+  free(map_sig);
+  free(sig_index);
+  map=NULL;
+  map_sig=NULL;
+  sig_index=NULL;
+}
+
+// 2-bit code for a building colour (map colour values, see parse_map())
+static int building_code(int colour)
+{
+  return colour==2 ? SIG_BLUE : colour==3 ? SIG_GREEN : colour==6 ? SIG_WHITE : SIG_OTHER;
+}
+
+// signature of four building colours, clockwise from the top-left
+uint8_t color_signature(int tl, int tr, int br, int bl)
+{
+  return (uint8_t)(building_code(tl) | (building_code(tr) << 2) | (building_code(br) << 4) | (building_code(bl) << 6));
+}
+
+// rebuild map_sig[] from map[][], fill in the rotation table and build the inverted index
+// (a counting sort of all (intersection, direction) pairs by the scan signature they match).
+// Call after changing map[][]
+void sign_map(void)
+{
+  uint32_t fill[256];
+
+  for (int s = 0; s < 256; s++)
+  {
+    // rotating by d moves the building at position k to position k+d
+    for (int d = 0; d < 4; d++)
+    {
+      sig_rotate[s][d] = (uint8_t)(((s << (2*d)) | (s >> (8 - 2*d))) & 0xff);
+    }
+  }
+  memset(sig_code_count, 0, sizeof(sig_code_count));
+  for (int i = 0; i < sx*sy; i++)
+  {
+    map_sig[i] = color_signature(map[i][0], map[i][1], map[i][2], map[i][3]);
+    for (int k = 0; k < 4; k++)
+    {
+      sig_code_count[(map_sig[i] >> (2*k)) & 3]++;
+    }
+  }
+
+  // facing d, intersection i is seen as its own signature rotated back by d
+  memset(sig_index_start, 0, sizeof(sig_index_start));
+  for (int i = 0; i < sx*sy; i++)
+  {
+    for (int d = 0; d < 4; d++)
+    {
+      sig_index_start[sig_rotate[map_sig[i]][(4 - d) & 3] + 1]++;
+    }
+  }
+  for (int s = 0; s < 256; s++)
+  {
+    sig_index_start[s + 1] += sig_index_start[s];
+    fill[s] = sig_index_start[s];
+  }
+  for (int i = 0; i < sx*sy; i++)
+  {
+    for (int d = 0; d < 4; d++)
+    {
+      sig_index[fill[sig_rotate[map_sig[i]][(4 - d) & 3]]++] = ((uint32_t)i << 2) | d;
+    }
+  }
+}
+
+// FNV-1a over the map size and signatures, identifies the map a saved policy or checkpoint
+// was made for
+uint32_t map_hash(void){
+  uint32_t h = 2166136261u;
+  int dims[2] = {sx, sy};
+  const uint8_t *d = (const uint8_t *)dims;
+  for (size_t k = 0; k < sizeof(dims); k++)
+  {
+    h = (h ^ d[k])*16777619u;
+  }
+  for (int i = 0; i < sx*sy; i++)
+  {
+    h = (h ^ map_sig[i])*16777619u;
+  }
+  return h;
+}
+
+// get index for map array given x and y location
+int get_index(int x, int y){
+  return x+y*sx;
+}
+
+int parse_map(unsigned char *map_img, int rx, int ry)
+{
+ /*
+   This function takes an input image map array, and two integers that specify the image size.
+   It attempts to parse this image into a representation of the map in the image. The size
+   and resolution of the map image should not affect the parsing (i.e. you can make your own
+   maps without worrying about the exact position of intersections, roads, buildings, etc.).
+
+   However, this function requires:
+   
+   * White background for the image  [255 255 255]
+   * Red borders around the map  [255 0 0]
+   * Black roads  [0 0 0]
+   * Yellow intersections  [255 255 0]
+   * Buildings that are pure green [0 255 0], pure blue [0 0 255], or white [255 255 255]
+   (any other colour values are ignored - so you can add markings if you like, those 
+    will not affect parsing)
+
+   The image must be a properly formated .ppm image, see readPPMimage below for details of
+   the format. The GIMP image editor saves properly formatted .ppm images, as does the
+   imagemagick image processing suite.
+   
+   The map representation is read into the map array, with each row in the array corrsponding
+   to one intersection, in raster order, that is, for a map with k intersections along its width:
+   
+    (row index for the intersection)
+    
+    0     1     2    3 ......   k-1
+    
+    k    k+1   k+2  ........    
+    
+    Each row will then contain the colour values for buildings around the intersection 
+    clockwise from top-left, that is
+    
+    
+    top-left               top-right
+            
+            intersection
+    
+    bottom-left           bottom-right
+    
+    So, for the first intersection (at row 0 in the map array)
+    map[0][0] <---- colour for the top-left building
+    map[0][1] <---- colour for the top-right building
+    map[0][2] <---- colour for the bottom-right building
+    map[0][3] <---- colour for the bottom-left building
+    
+    Color values for map locations are defined as follows (this agrees with what the
+    EV3 sensor returns in indexed-colour-reading mode):
+    
+    1 -  Black
+    2 -  Blue
+    3 -  Green
+    4 -  Yellow
+    5 -  Red
+    6 -  White
+    
+    If you find a 0, that means you're trying to access an intersection that is not on the
+    map! Also note that in practice, because of how the map is defined, you should find
+    only Green, Blue, or White around a given intersection.
+    
+    The map size (the number of intersections along the horizontal and vertical directions) is
+    updated and left in the global variables sx and sy, and the map array is (re)allocated to
+    hold sx*sy intersections. The signature array map_sig[] and the rotation table sig_rotate[][]
+    are built from the parsed map (see EV3_Map.h). For large maps the per-intersection output is skipped.
+
+    Feel free to create your own maps for testing (you'll have to print them to a reasonable
+    size to use with your bot).
+    
+ */    
+ 
+ int last3[3];
+ int x,y;
+ unsigned char R,G,B;
+ int ix,iy;
+ int bx,by,dx,dy,wx,wy;         // Intersection geometry parameters
+ int tgl;
+ int idx;
+ 
+ ix=iy=0;       // Index to identify the current intersection
+ 
+ // Determine the spacing and size of intersections in the map
+ tgl=0;
+ for (int i=0; i<rx; i++)
+ {
+  for (int j=0; j<ry; j++)
+  {
+   R=*(map_img+((i+(j*rx))*3));
+   G=*(map_img+((i+(j*rx))*3)+1);
+   B=*(map_img+((i+(j*rx))*3)+2);
+   if (R==255&&G==255&&B==0)
+   {
+    // First intersection, top-left pixel. Scan right to find width and spacing
+    bx=i;           // Anchor for intersection locations
+    by=j;
+    for (int k=i; k<rx; k++)        // Find width and horizontal distance to next intersection
+    {
+     R=*(map_img+((k+(by*rx))*3));
+     G=*(map_img+((k+(by*rx))*3)+1);
+     B=*(map_img+((k+(by*rx))*3)+2);
+     if (tgl==0&&(R!=255||G!=255||B!=0))
+     {
+      tgl=1;
+      wx=k-i;
+     }
+     if (tgl==1&&R==255&&G==255&&B==0)
+     {
+      tgl=2;
+      dx=k-i;
+     }
+    }
+    for (int k=j; k<ry; k++)        // Find height and vertical distance to next intersection
+    {
+     R=*(map_img+((bx+(k*rx))*3));
+     G=*(map_img+((bx+(k*rx))*3)+1);
+     B=*(map_img+((bx+(k*rx))*3)+2);
+     if (tgl==2&&(R!=255||G!=255||B!=0))
+     {
+      tgl=3;
+      wy=k-j;
+     }
+     if (tgl==3&&R==255&&G==255&&B==0)
+     {
+      tgl=4;
+      dy=k-j;
+     }
+    }
+    
+    if (tgl!=4)
+    {
+     fprintf(stderr,"Unable to determine intersection geometry!\n");
+     return(0);
+    }
+    else break;
+   }
+  }
+  if (tgl==4) break;
+ }
+  fprintf(stderr,"Intersection parameters: base_x=%d, base_y=%d, width=%d, height=%d, horiz_distance=%d, vertical_distance=%d\n",bx,by,wx,wy,dx,dy);
+
+  sx=0;
+  for (int i=bx+(wx/2);i<rx;i+=dx)
+  {
+   R=*(map_img+((i+(by*rx))*3));
+   G=*(map_img+((i+(by*rx))*3)+1);
+   B=*(map_img+((i+(by*rx))*3)+2);
+   if (R==255&&G==255&&B==0) sx++;
+  }
+
+  sy=0;
+  for (int j=by+(wy/2);j<ry;j+=dy)
+  {
+   R=*(map_img+((bx+(j*rx))*3));
+   G=*(map_img+((bx+(j*rx))*3)+1);
+   B=*(map_img+((bx+(j*rx))*3)+2);
+   if (R==255&&G==255&&B==0) sy++;
+  }
+  
+  fprintf(stderr,"Map size: Number of horizontal intersections=%d, number of vertical intersections=%d\n",sx,sy);
+  if (!alloc_map(sx,sy)) return(0);
+
+  // Scan for building colours around each intersection
+  idx=0;
+  for (int j=0; j<sy; j++)
+   for (int i=0; i<sx; i++)
+   {
+    x=bx+(i*dx)+(wx/2);
+    y=by+(j*dy)+(wy/2);
+    
+    if (sx*sy<=400) fprintf(stderr,"Intersection location: %d, %d\n",x,y);
+    // Top-left
+    x-=wx;
+    y-=wy;
+    R=*(map_img+((x+(y*rx))*3));
+    G=*(map_img+((x+(y*rx))*3)+1);
+    B=*(map_img+((x+(y*rx))*3)+2);
+    if (R==0&&G==255&&B==0) map[idx][0]=3;
+    else if (R==0&&G==0&&B==255) map[idx][0]=2;
+    else if (R==255&&G==255&&B==255) map[idx][0]=6;
+    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Top-Left RGB=%d,%d,%d\n",i,j,R,G,B);
+
+    // Top-right
+    x+=2*wx;
+    R=*(map_img+((x+(y*rx))*3));
+    G=*(map_img+((x+(y*rx))*3)+1);
+    B=*(map_img+((x+(y*rx))*3)+2);
+    if (R==0&&G==255&&B==0) map[idx][1]=3;
+    else if (R==0&&G==0&&B==255) map[idx][1]=2;
+    else if (R==255&&G==255&&B==255) map[idx][1]=6;
+    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Top-Right RGB=%d,%d,%d\n",i,j,R,G,B);
+
+    // Bottom-right
+    y+=2*wy;
+    R=*(map_img+((x+(y*rx))*3));
+    G=*(map_img+((x+(y*rx))*3)+1);
+    B=*(map_img+((x+(y*rx))*3)+2);
+    if (R==0&&G==255&&B==0) map[idx][2]=3;
+    else if (R==0&&G==0&&B==255) map[idx][2]=2;
+    else if (R==255&&G==255&&B==255) map[idx][2]=6;
+    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Bottom-Right RGB=%d,%d,%d\n",i,j,R,G,B);
+    
+    // Bottom-left
+    x-=2*wx;
+    R=*(map_img+((x+(y*rx))*3));
+    G=*(map_img+((x+(y*rx))*3)+1);
+    B=*(map_img+((x+(y*rx))*3)+2);
+    if (R==0&&G==255&&B==0) map[idx][3]=3;
+    else if (R==0&&G==0&&B==255) map[idx][3]=2;
+    else if (R==255&&G==255&&B==255) map[idx][3]=6;
+    else fprintf(stderr,"Colour is not valid for intersection %d,%d, Bottom-Left RGB=%d,%d,%d\n",i,j,R,G,B);
+    
+    if (sx*sy<=400) fprintf(stderr,"Colours for this intersection: %d, %d, %d, %d\n",map[idx][0],map[idx][1],map[idx][2],map[idx][3]);
+    
+    idx++;
+   }
+
+ sign_map();
+ return(1);  
+}
+
+unsigned char *readPPMimage(const char *filename, int *rx, int *ry)
+{
+ // Reads an image from a .ppm file. A .ppm file is a very simple image representation
+ // format with a text header followed by the binary RGB data at 24bits per pixel.
+ // The header has the following form:
+ //
+ // P6
+ // # One or more comment lines preceded by '#'
+ // 340 200
+ // 255
+ //
+ // The first line 'P6' is the .ppm format identifier, this is followed by one or more
+ // lines with comments, typically used to inidicate which program generated the
+ // .ppm file.
+ // After the comments, a line with two integer values specifies the image resolution
+ // as number of pixels in x and number of pixels in y.
+ // The final line of the header stores the maximum value for pixels in the image,
+ // usually 255.
+ // After this last header line, binary data stores the RGB values for each pixel
+ // in row-major order. Each pixel requires 3 bytes ordered R, G, and B.
+ //
+ // NOTE: Windows file handling is rather crotchetty. You may have to change the
+ //       way this file is accessed if the images are being corrupted on read
+ //       on Windows.
+ //
+
+ FILE *f;
+ unsigned char *im;
+ char line[1024];
+ int i;
+ unsigned char *tmp;
+ double *fRGB;
+
+ im=NULL;
+ f=fopen(filename,"rb+");
+ if (f==NULL)
+ {
+  fprintf(stderr,"Unable to open file %s for reading, please check name and path\n",filename);
+  return(NULL);
+ }
+ fgets(&line[0],1000,f);
+ if (strcmp(&line[0],"P6\n")!=0)
+ {
+  fprintf(stderr,"Wrong file format, not a .ppm file or header end-of-line characters missing\n");
+  fclose(f);
+  return(NULL);
+ }
+ fprintf(stderr,"%s\n",line);
+ // Skip over comments
+ fgets(&line[0],511,f);
+ while (line[0]=='#')
+ {
+  fprintf(stderr,"%s",line);
+  fgets(&line[0],511,f);
+ }
+ sscanf(&line[0],"%d %d\n",rx,ry);                  // Read image size
+ fprintf(stderr,"nx=%d, ny=%d\n\n",*rx,*ry);
+
+ fgets(&line[0],9,f);  	                // Read the remaining header line
+ fprintf(stderr,"%s\n",line);
+ im=(unsigned char *)calloc((*rx)*(*ry)*3,sizeof(unsigned char));
+ if (im==NULL)
+ {
+  fprintf(stderr,"Out of memory allocating space for image\n");
+  fclose(f);
+  return(NULL);
+ }
+ fread(im,(*rx)*(*ry)*3*sizeof(unsigned char),1,f);
+ fclose(f);
+
+ return(im);    
+}
\ No newline at end of file
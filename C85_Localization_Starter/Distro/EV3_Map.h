@@ -0,0 +1,61 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Map representation. parse_map() reads a map image into the map[][] array, which holds one
+ row per intersection in raster order (index = x + y*sx), each with the colours of the four
+ buildings around it clockwise from the top-left. See parse_map() for the details.
+
+ Buildings can only be blue, green or white, so the four colours around an intersection are
+ also kept as a one byte signature in map_sig[], 2 bits per building clockwise from the
+ top-left (in the low bits). map_sig[] is a quarter of the size of a packed int per
+ intersection, so it stays in L1 cache for any realistic arena. sig_rotate[s][d] is the
+ signature s with its buildings rotated by d positions - a scan with signature s matches
+ intersection i with the robot facing d exactly when map_sig[i] == sig_rotate[s][d].
+
+ sign_map() also builds an inverted index from scan signatures to the (intersection,
+ direction) pairs they match: the pairs for scan signature s are
+
+    sig_index[sig_index_start[s]] ... sig_index[sig_index_start[s+1]-1]
+
+ each stored as (i<<2)|d. Every pair appears under exactly one signature, so the index holds
+ 4 entries per intersection. sig_code_count[] counts the map's buildings of each colour code,
+ which is also how many (intersection, direction) pairs put that colour at any one position.
+
+ The map array is allocated to fit the parsed map, so it is only limited by MAX_MAP_DIM and
+ available memory. It is 64-byte aligned.
+
+*/
+
+#ifndef __map_header
+#define __map_header
+
+#include<stddef.h>
+#include<stdint.h>
+
+#define MAX_MAP_DIM 2048            // Largest number of intersections along either side
+
+#define SIG_BLUE 0                  // 2-bit building codes used in signatures
+#define SIG_GREEN 1
+#define SIG_WHITE 2
+#define SIG_OTHER 3                 // Anything else (no building, or a misread colour)
+
+extern int (*map)[4];               // Building colours, one row per intersection
+extern uint8_t *map_sig;            // Signature of the buildings around each intersection
+extern uint8_t sig_rotate[256][4];  // Signatures rotated by 0..3 buildings
+extern uint32_t sig_index_start[257];   // Inverted index, see above
+extern uint32_t *sig_index;
+extern uint32_t sig_code_count[4];  // Buildings on the map with each 2-bit code
+extern int sx, sy;                  // Size of the map (number of intersections along x and y)
+
+int alloc_map(int nx, int ny);
+void free_map(void);
+void sign_map(void);
+uint8_t color_signature(int tl, int tr, int br, int bl);
+int parse_map(unsigned char *map_img, int rx, int ry);
+unsigned char *readPPMimage(const char *filename, int *rx, int*ry);
+uint32_t map_hash(void);
+int get_index(int x, int y);
+void *alloc_aligned(size_t size);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Particle filter localization - see EV3_Particles.h.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<math.h>
+#include "EV3_Map.h"
+#include "EV3_Particles.h"
+
+typedef struct particle_job
+{
+ particle_set *ps;
+ double dist, dtheta;
+ int colour;
+} particle_job;
+
+// splitmix64, used to seed the per-block streams
+static uint64_t mix64(uint64_t z){
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// xorshift64*, uniform in [0,1)
+static double uniform01(uint64_t *s){
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return (double)((*s*0x2545f4914f6cdd1dULL) >> 11)*(1.0/9007199254740992.0);
+}
+
+// two independent standard normal samples (Box-Muller)
+static void normal2(uint64_t *s, double *a, double *b){
+  double r = sqrt(-2.0*log(1.0 - uniform01(s))), v = 2.0*M_PI*uniform01(s);
+  *a = r*cos(v);
+  *b = r*sin(v);
+}
+
+// map colour code of an image pixel, as parse_map() reads them (other colours count as white)
+static uint8_t pixel_code(const unsigned char *p){
+  if (p[0] == 0 && p[1] == 0 && p[2] == 0) return 1;
+  if (p[0] == 0 && p[1] == 0 && p[2] == 255) return 2;
+  if (p[0] == 0 && p[1] == 255 && p[2] == 0) return 3;
+  if (p[0] == 255 && p[1] == 255 && p[2] == 0) return 4;
+  if (p[0] == 255 && p[1] == 0 && p[2] == 0) return 5;
+  return 6;
+}
+
+// set up a set of n particles over the map image, spread uniformly. threads is the number of
+// threads for the update (at most PARTICLE_MAX_THREADS, and no more than there are blocks).
+// Returns 1 on success, 0 on failure
+int particles_init(particle_set *ps, int n, int threads, const unsigned char *map_img, int rx, int ry, uint64_t seed){
+  size_t pixels = (size_t)rx*ry;
+  size_t stride = ((size_t)n + 7) & ~(size_t)7;
+  size_t blocks = ((size_t)n + PARTICLE_BLOCK - 1)/PARTICLE_BLOCK;
+  ps->arena = NULL;
+  ps->pool = NULL;
+  if (n <= 0 || rx <= 0 || ry <= 0) return 0;
+  ps->arena = alloc_aligned((7*stride + blocks)*sizeof(double) + pixels);
+  if (ps->arena == NULL) {
+    fprintf(stderr,"Out of memory allocating %d particles\n", n);
+    return 0;
+  }
+  ps->n = n;
+  ps->threads = threads > PARTICLE_MAX_THREADS ? PARTICLE_MAX_THREADS : threads;
+  ps->threads = ps->threads > (int)blocks ? (int)blocks : ps->threads;
+  if (ps->threads > 1) {
+    ps->pool = (work_pool *)malloc(sizeof(work_pool));
+    if (ps->pool == NULL || !pool_init(ps->pool, ps->threads)) {
+      // not fatal, the update just runs in the caller
+      fprintf(stderr, "Unable to start threads for the particle update\n");
+      free(ps->pool);
+      ps->pool = NULL;
+    }
+  }
+  if (ps->pool == NULL) ps->threads = 1;
+  ps->rx = rx;
+  ps->ry = ry;
+  ps->x = (double *)ps->arena;
+  ps->y = ps->x + stride;
+  ps->theta = ps->y + stride;
+  ps->w = ps->theta + stride;
+  ps->nx = ps->w + stride;
+  ps->ny = ps->nx + stride;
+  ps->ntheta = ps->ny + stride;
+  ps->block_sum = ps->ntheta + stride;
+  ps->raster = (uint8_t *)(ps->block_sum + blocks);
+  ps->seed = seed;
+
+  ps->x0 = rx;
+  ps->y0 = ry;
+  ps->x1 = ps->y1 = -1;
+  for (int j = 0; j < ry; j++)
+  {
+    for (int i = 0; i < rx; i++)
+    {
+      uint8_t c = pixel_code(map_img + 3*((size_t)i + (size_t)j*rx));
+      ps->raster[i + (size_t)j*rx] = c;
+      if (c == 5) {
+        if (i < ps->x0) ps->x0 = i;
+        if (i > ps->x1) ps->x1 = i;
+        if (j < ps->y0) ps->y0 = j;
+        if (j > ps->y1) ps->y1 = j;
+      }
+    }
+  }
+  if (ps->x1 < 0) {
+    // no border, use the whole image
+    ps->x0 = ps->y0 = 0;
+    ps->x1 = rx - 1;
+    ps->y1 = ry - 1;
+  }
+  particles_uniform(ps);
+  return 1;
+}
+
+void particles_free(particle_set *ps){
+  if (ps->pool != NULL) {
+    pool_free(ps->pool);
+    free(ps->pool);
+    ps->pool = NULL;
+  }
+  free(ps->arena);
+  ps->arena = NULL;
+}
+
+// spread the particles uniformly over the map, inside the border and off the red, with any
+// heading
+void particles_uniform(particle_set *ps){
+  uint64_t s = mix64(ps->seed++) | 1;
+  int w = ps->x1 - ps->x0 + 1, h = ps->y1 - ps->y0 + 1;
+  for (int k = 0; k < ps->n; k++)
+  {
+    double x, y;
+    int tries = 0;
+    do
+    {
+      x = ps->x0 + uniform01(&s)*w;
+      y = ps->y0 + uniform01(&s)*h;
+    } while (ps->raster[(int)x + (size_t)(int)y*ps->rx] == 5 && ++tries < 100);
+    ps->x[k] = x;
+    ps->y[k] = y;
+    ps->theta[k] = uniform01(&s)*2.0*M_PI;
+    ps->w[k] = 1.0/ps->n;
+  }
+  ps->ess = ps->n;
+}
+
+// predict and weight block b, a pool_task
+static void particle_block(void *arg, int b){
+  particle_job *job = (particle_job *)arg;
+  particle_set *ps = job->ps;
+  double sigma_theta = PARTICLE_SIGMA_THETA + 0.05*fabs(job->dtheta);
+  double sigma_dist = PARTICLE_SIGMA_DIST*fabs(job->dist);
+
+  uint64_t s = mix64(ps->seed ^ mix64((uint64_t)b)) | 1;
+  int end = (b + 1)*PARTICLE_BLOCK < ps->n ? (b + 1)*PARTICLE_BLOCK : ps->n;
+  double sum = 0;
+  for (int k = b*PARTICLE_BLOCK; k < end; k++)
+  {
+    // turn half way, drive, then turn the rest - a chord through the arc driven. The sensor
+    // position uses the chord direction too, the half turn left is small at the sample rate
+    double na, nb;
+    normal2(&s, &na, &nb);
+    double t = ps->theta[k] + 0.5*job->dtheta + sigma_theta*na;
+    double d = job->dist + sigma_dist*nb;
+    double c = cos(t), sn = sin(t);
+    ps->x[k] += d*c;
+    ps->y[k] += d*sn;
+    ps->theta[k] = t + 0.5*job->dtheta;
+
+    int px = (int)floor(ps->x[k] + PARTICLE_SENSOR_OFFSET*c);
+    int py = (int)floor(ps->y[k] + PARTICLE_SENSOR_OFFSET*sn);
+    double like;
+    if (px < 0 || py < 0 || px >= ps->rx || py >= ps->ry) like = PARTICLE_MISS*PARTICLE_MISS;
+    else like = ps->raster[px + (size_t)py*ps->rx] == job->colour ? 1.0 : PARTICLE_MISS;
+    ps->w[k] *= like;
+    sum += ps->w[k];
+  }
+  ps->block_sum[b] = sum;
+}
+
+// systematic resampling: one random offset, then n evenly spaced picks through the
+// cumulative weights
+static void particles_resample(particle_set *ps){
+  uint64_t s = mix64(ps->seed ^ 0x5851f42d4c957f2dULL) | 1;
+  double step = 1.0/ps->n, u = uniform01(&s)*step, c = ps->w[0];
+  double *t;
+  int j = 0;
+  for (int k = 0; k < ps->n; k++)
+  {
+    while (u > c && j < ps->n - 1) c += ps->w[++j];
+    ps->nx[k] = ps->x[j];
+    ps->ny[k] = ps->y[j];
+    ps->ntheta[k] = ps->theta[j];
+    u += step;
+  }
+  t = ps->x; ps->x = ps->nx; ps->nx = t;
+  t = ps->y; ps->y = ps->ny; ps->ny = t;
+  t = ps->theta; ps->theta = ps->ntheta; ps->ntheta = t;
+  for (int k = 0; k < ps->n; k++)
+  {
+    ps->w[k] = step;
+  }
+}
+
+// one filter step: the robot drove dist pixels and turned dtheta radians since the last
+// update, and the colour sensor now reads colour (a map colour code, 1-6)
+void particles_update(particle_set *ps, double dist, double dtheta, int colour){
+  int blocks = (ps->n + PARTICLE_BLOCK - 1)/PARTICLE_BLOCK;
+  particle_job job;
+  double sum = 0, sum2 = 0;
+
+  job.ps = ps;
+  job.dist = dist;
+  job.dtheta = dtheta;
+  job.colour = colour;
+  if (ps->pool != NULL) {
+    pool_run(ps->pool, blocks, particle_block, &job);
+  } else {
+    for (int b = 0; b < blocks; b++)
+    {
+      particle_block(&job, b);
+    }
+  }
+  ps->seed = mix64(ps->seed);
+
+  // block sums are added in block order, so the total does not depend on the threads
+  for (int b = 0; b < blocks; b++)
+  {
+    sum += ps->block_sum[b];
+  }
+  if (!(sum > 0)) {
+    // every particle is out of the map - the robot is lost, start over
+    particles_uniform(ps);
+    return;
+  }
+  for (int k = 0; k < ps->n; k++)
+  {
+    ps->w[k] /= sum;
+    sum2 += ps->w[k]*ps->w[k];
+  }
+  ps->ess = 1.0/sum2;
+  if (ps->ess < 0.5*ps->n) particles_resample(ps);
+}
+
+// weighted mean pose (circular mean for the heading), returns the spread of the particles
+// around it in pixels
+double particles_estimate(particle_set *ps, double *x, double *y, double *theta){
+  double mx = 0, my = 0, c = 0, s = 0, var = 0;
+  for (int k = 0; k < ps->n; k++)
+  {
+    mx += ps->w[k]*ps->x[k];
+    my += ps->w[k]*ps->y[k];
+    c += ps->w[k]*cos(ps->theta[k]);
+    s += ps->w[k]*sin(ps->theta[k]);
+  }
+  for (int k = 0; k < ps->n; k++)
+  {
+    double dx = ps->x[k] - mx, dy = ps->y[k] - my;
+    var += ps->w[k]*(dx*dx + dy*dy);
+  }
+  *x = mx;
+  *y = my;
+  *theta = atan2(s, c);
+  if (*theta < 0) *theta += 2.0*M_PI;
+  return sqrt(var);
+}
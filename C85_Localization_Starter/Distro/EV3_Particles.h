@@ -0,0 +1,74 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Particle filter localization. An alternative to the intersection histogram in EV3_Beliefs.h
+ that tracks the robot's continuous pose (x, y, theta) in map image pixels, so it can be
+ updated on every colour sample - between intersections too, while the robot follows a
+ street - instead of only after an intersection scan.
+
+ Each particle is one guess at the pose. particles_update() takes the odometry since the last
+ sample (distance driven, from the commanded motor power and elapsed time, and the change in
+ gyro heading) and the colour the sensor just read:
+
+ * predict - every particle drives the same distance and turns the same angle, each with its
+   own random error (PARTICLE_SIGMA_DIST, PARTICLE_SIGMA_THETA)
+ * weight - the map colour under each particle's sensor position (PARTICLE_SENSOR_OFFSET
+   pixels ahead of it) is compared with the colour read. A match keeps the particle's weight,
+   a mismatch scales it by PARTICLE_MISS
+ * resample - once the effective number of particles drops below half the set, a new set is
+   drawn by systematic resampling (one random offset, n evenly spaced picks through the
+   cumulative weights)
+
+ The map colours are classified once into a raster with one map colour code per pixel (the
+ codes of parse_map() in EV3_Map.c). Theta is in radians, 0 along +x and growing clockwise on
+ the image (towards +y), the same sense as the gyro.
+
+ The particle arrays and the raster live in one arena allocation, sized in particles_init()
+ and never reallocated. Predict and weight run in parallel over fixed blocks of
+ PARTICLE_BLOCK particles, each block with its own random stream seeded from the set's, so
+ the result does not depend on the number of threads. The threads are a work_pool
+ (EV3_Pool.h) started once by particles_init(), since an update runs on every colour sample.
+ A set of a single block starts no pool and updates in the caller.
+
+*/
+
+#ifndef __particles_header
+#define __particles_header
+
+#include<stdint.h>
+#include "EV3_Pool.h"
+
+#define PARTICLE_BLOCK 4096         // Particles per block of the parallel update
+#define PARTICLE_MAX_THREADS 16
+#define PARTICLE_SENSOR_OFFSET 20.0 // Pixels from the pose to the colour sensor, straight ahead
+#define PARTICLE_PX_PER_POWER 4.0   // Pixels per second driven per unit of motor power
+#define PARTICLE_GYRO_EVERY 8       // Samples per gyro read while the robot turns
+#define PARTICLE_SIGMA_DIST 0.10    // Error in distance driven, as a fraction of it
+#define PARTICLE_SIGMA_THETA 0.005  // Error in heading per update (radians), plus 5% of the turn
+#define PARTICLE_MISS 0.05          // Likelihood of reading a colour the map does not show
+
+typedef struct particle_set
+{
+ int n;                     // Number of particles
+ int threads;               // Threads used by the update, the caller included
+ work_pool *pool;           // NULL when the update runs in the caller alone
+ int rx, ry;                // Map image size in pixels
+ int x0, y0, x1, y1;        // Bounding box of the red border, particles start inside it
+ uint8_t *raster;           // Map colour code of every map pixel
+ double *x, *y, *theta;     // Particle poses
+ double *w;                 // Particle weights, normalized to sum to 1
+ double *nx, *ny, *ntheta;  // Resampling destination
+ double *block_sum;         // Weight of each block of PARTICLE_BLOCK particles
+ void *arena;               // The allocation holding all of the above
+ uint64_t seed;             // Random stream, advanced once per update
+ double ess;                // Effective number of particles after the last update
+} particle_set;
+
+int particles_init(particle_set *ps, int n, int threads, const unsigned char *map_img, int rx, int ry, uint64_t seed);
+void particles_free(particle_set *ps);
+void particles_uniform(particle_set *ps);
+void particles_update(particle_set *ps, double dist, double dtheta, int colour);
+double particles_estimate(particle_set *ps, double *x, double *y, double *theta);
+
+#endif
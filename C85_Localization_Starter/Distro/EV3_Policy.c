@@ -0,0 +1,121 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Precomputed localization policy - see EV3_Policy.h for the file layout.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "EV3_Map.h"
+#include "EV3_Policy.h"
+
+static_assert(sizeof(policy_header) == 40, "policy header layout is part of the file format");
+static_assert(sizeof(policy_node) == 8, "policy node layout is part of the file format");
+static_assert(sizeof(policy_edge) == 12, "policy edge layout is part of the file format");
+
+// first slot to probe for the edge (node, obs)
+uint32_t policy_slot(uint32_t node, uint32_t obs, uint32_t slots)
+{
+  uint32_t h = node*0x9e3779b1u ^ obs*0x85ebca6bu;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 13;
+  return h & (slots - 1);
+}
+
+// read a policy file and check it was built for the parsed map. Returns 1 on success
+int policy_load(policy *p, const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  int empty = 0, corrupt = 0;
+  p->node = NULL;
+  p->edge = NULL;
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open policy file %s\n", filename);
+    return 0;
+  }
+  if (fread(&p->h, sizeof(policy_header), 1, f) != 1 || memcmp(p->h.magic, POLICY_MAGIC, 8) != 0 ||
+      p->h.node_count == 0 || p->h.edge_slots == 0 || (p->h.edge_slots & (p->h.edge_slots - 1)) != 0) {
+    fprintf(stderr, "%s is not a localization policy\n", filename);
+    fclose(f);
+    return 0;
+  }
+  if (p->h.sx != sx || p->h.sy != sy || p->h.map_hash != map_hash()) {
+    fprintf(stderr, "Policy %s was built for a different map\n", filename);
+    fclose(f);
+    return 0;
+  }
+  p->node = (policy_node *)malloc((size_t)p->h.node_count*sizeof(policy_node));
+  p->edge = (policy_edge *)malloc((size_t)p->h.edge_slots*sizeof(policy_edge));
+  if (p->node == NULL || p->edge == NULL ||
+      fread(p->node, sizeof(policy_node), p->h.node_count, f) != p->h.node_count ||
+      fread(p->edge, sizeof(policy_edge), p->h.edge_slots, f) != p->h.edge_slots) {
+    fprintf(stderr, "Unable to read policy file %s\n", filename);
+    fclose(f);
+    policy_free(p);
+    return 0;
+  }
+  fclose(f);
+  // policy_next() probes until it finds the edge or a free slot, so the table needs one
+  for (uint32_t k = 0; k < p->h.edge_slots; k++)
+  {
+    if (p->edge[k].node == POLICY_EMPTY) empty = 1;
+    else if (p->edge[k].child >= p->h.node_count) corrupt = 1;
+  }
+  // localize() turns by a node's action and reports a leaf's pose as is
+  for (uint32_t k = 0; k < p->h.node_count; k++)
+  {
+    if (p->node[k].action == POLICY_LEAF) {
+      if (p->node[k].pose < -1 || p->node[k].pose >= 4*sx*sy) corrupt = 1;
+    } else if (p->node[k].action > 3) {
+      corrupt = 1;
+    }
+  }
+  if (corrupt || !empty) {
+    fprintf(stderr, "Policy file %s is corrupt\n", filename);
+    policy_free(p);
+    return 0;
+  }
+  return 1;
+}
+
+// write a policy file. Returns 1 on success
+int policy_save(const policy *p, const char *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  int ok;
+  if (f == NULL) {
+    fprintf(stderr, "Unable to create policy file %s\n", filename);
+    return 0;
+  }
+  ok = fwrite(&p->h, sizeof(policy_header), 1, f) == 1 &&
+       fwrite(p->node, sizeof(policy_node), p->h.node_count, f) == p->h.node_count &&
+       fwrite(p->edge, sizeof(policy_edge), p->h.edge_slots, f) == p->h.edge_slots;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok) fprintf(stderr, "Unable to write policy file %s\n", filename);
+  return ok;
+}
+
+void policy_free(policy *p)
+{
+  free(p->node);
+  free(p->edge);
+  p->node = NULL;
+  p->edge = NULL;
+}
+
+// the node reached from node by observing (red, sig), -1 if the tree has no such branch
+int policy_next(const policy *p, int node, int red, int sig)
+{
+  uint32_t obs = POLICY_OBS(red, sig);
+  uint32_t k = policy_slot((uint32_t)node, obs, p->h.edge_slots);
+  while (p->edge[k].node != POLICY_EMPTY)
+  {
+    if (p->edge[k].node == (uint32_t)node && p->edge[k].obs == obs) return (int)p->edge[k].child;
+    k = (k + 1) & (p->h.edge_slots - 1);
+  }
+  return -1;
+}
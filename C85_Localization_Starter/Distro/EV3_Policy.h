@@ -0,0 +1,80 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Precomputed localization policy. Tools/map_policy works out, for a given map, a decision
+ tree that tells the start poses apart with as few intersection scans as possible: each node
+ is the set of poses consistent with what the robot has seen so far, and says which way to
+ turn before driving to the next intersection. The observation made there - whether the
+ robot touched red on the way, and the scan signature (see EV3_Map.h) - selects the child.
+ A leaf says where the robot now is.
+
+ The tree assumes a noise-free robot: every drive ends at the next intersection and every
+ scan is right. An observation the tree has no child for means that did not hold, and the
+ robot falls back to the histogram filter in EV3_Beliefs.h.
+
+ File layout:
+
+    policy_header
+    policy_node[node_count]                 (node 0 is the root, before the first scan)
+    policy_edge[edge_slots]                 (hash table from (node, observation) to child)
+
+ The edge table is open-addressed with linear probing, at most half full, so following an
+ edge is O(1). policy_load() checks the header against the parsed map - a policy only fits
+ the map it was built for.
+
+*/
+
+#ifndef __policy_header
+#define __policy_header
+
+#include<stdint.h>
+
+#define POLICY_MAGIC "EV3POL01"
+#define POLICY_LEAF 0xff            // Action of a node where the pose is known (or never will be)
+#define POLICY_EMPTY 0xffffffffu    // Node of a free edge slot
+#define POLICY_OPTIMAL 1            // Flag: every node was solved exactly, scans are minimal
+
+// observation after a drive: whether red was touched, and the scan signature
+#define POLICY_OBS(red, sig) ((uint32_t)(((red) ? 256 : 0) | (sig)))
+
+typedef struct policy_header
+{
+ char magic[8];             // POLICY_MAGIC
+ int32_t sx, sy;            // Map size the policy was built for
+ uint32_t map_hash;         // map_hash() of that map
+ uint32_t node_count;
+ uint32_t edge_slots;       // Size of the edge table, a power of 2
+ uint32_t max_scans;        // Most scans any start pose needs
+ uint32_t flags;            // POLICY_OPTIMAL
+ uint32_t ambiguous;        // Leaves whose poses can not be told apart
+} policy_header;
+
+typedef struct policy_node
+{
+ uint8_t action;            // Clockwise quarter turns before driving on, or POLICY_LEAF
+ uint8_t pad[3];
+ int32_t pose;              // Leaves: current pose as i*4 + direction, -1 if ambiguous
+} policy_node;
+
+typedef struct policy_edge
+{
+ uint32_t node;             // Parent node, POLICY_EMPTY for a free slot
+ uint32_t obs;              // POLICY_OBS()
+ uint32_t child;
+} policy_edge;
+
+typedef struct policy
+{
+ policy_header h;
+ policy_node *node;
+ policy_edge *edge;
+} policy;
+
+uint32_t policy_slot(uint32_t node, uint32_t obs, uint32_t slots);
+int policy_load(policy *p, const char *filename);
+int policy_save(const policy *p, const char *filename);
+void policy_free(policy *p);
+int policy_next(const policy *p, int node, int red, int sig);
+
+#endif
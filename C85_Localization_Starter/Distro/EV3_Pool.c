@@ -0,0 +1,109 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Persistent worker thread pool - see EV3_Pool.h.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include "EV3_Pool.h"
+
+// take tasks from the current job until there are none left
+static void pool_drain(work_pool *p){
+  int task;
+  while ((task = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->tasks)
+  {
+    p->fn(p->arg, task);
+  }
+}
+
+static void *pool_worker(void *arg){
+  work_pool *p = (work_pool *)arg;
+  unsigned seen = 0;
+  pthread_mutex_lock(&p->lock);
+  for (;;)
+  {
+    while (p->generation == seen && !p->quit)
+    {
+      pthread_cond_wait(&p->start, &p->lock);
+    }
+    if (p->quit) break;
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+    pool_drain(p);
+    pthread_mutex_lock(&p->lock);
+    if (--p->busy == 0) pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// start threads - 1 workers (the caller of pool_run() is the other one). Returns 1 on
+// success, 0 if the pool could not be set up. If some workers fail to start, the pool runs
+// with those that did
+int pool_init(work_pool *p, int threads){
+  p->threads = 1;
+  p->tasks = p->next = p->busy = 0;
+  p->generation = 0;
+  p->quit = 0;
+  if (threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+  if (pthread_mutex_init(&p->lock, NULL) != 0) return 0;
+  if (pthread_cond_init(&p->start, NULL) != 0 || pthread_cond_init(&p->done, NULL) != 0) {
+    fprintf(stderr, "Unable to set up the thread pool\n");
+    pthread_mutex_destroy(&p->lock);
+    return 0;
+  }
+  while (p->threads < threads && pthread_create(&p->tid[p->threads - 1], NULL, pool_worker, p) == 0)
+  {
+    p->threads++;
+  }
+  return 1;
+}
+
+// stop the workers and wait for them to exit
+void pool_free(work_pool *p){
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (int t = 0; t < p->threads - 1; t++)
+  {
+    pthread_join(p->tid[t], NULL);
+  }
+  pthread_cond_destroy(&p->start);
+  pthread_cond_destroy(&p->done);
+  pthread_mutex_destroy(&p->lock);
+  p->threads = 1;
+}
+
+// run fn(arg, task) for every task in [0, tasks), on the workers and the calling thread.
+// Returns when all tasks are done
+void pool_run(work_pool *p, int tasks, pool_task fn, void *arg){
+  if (p->threads == 1 || tasks <= 1) {
+    for (int task = 0; task < tasks; task++)
+    {
+      fn(arg, task);
+    }
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->arg = arg;
+  p->tasks = tasks;
+  p->next = 0;
+  p->busy = p->threads - 1;
+  p->generation++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  pool_drain(p);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->busy > 0)
+  {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
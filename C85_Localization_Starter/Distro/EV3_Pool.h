@@ -0,0 +1,49 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Persistent worker thread pool. The threads are started once by pool_init() and sleep on a
+ condition variable between jobs, so handing out a job costs a wake-up rather than a
+ pthread_create() per thread.
+
+ pool_run() calls fn(arg, task) for every task in [0, tasks) and returns once all of them are
+ done. The calling thread works on the tasks too. Tasks are handed out one at a time from a
+ shared counter, so a thread that finishes early takes the next one - which thread runs a
+ task is not fixed. Anything that must come out the same whatever the number of threads
+ should write one result per task and combine them in task order afterwards.
+
+ A pool of 1 thread starts no workers and runs everything in the caller, as does a job of a
+ single task.
+
+*/
+
+#ifndef __pool_header
+#define __pool_header
+
+#include<pthread.h>
+
+#define POOL_MAX_THREADS 64
+
+typedef void (*pool_task)(void *arg, int task);
+
+typedef struct work_pool
+{
+ int threads;               // Threads working on a job, the caller included
+ pthread_t tid[POOL_MAX_THREADS];
+ pthread_mutex_t lock;
+ pthread_cond_t start;      // Signalled when a job is posted
+ pthread_cond_t done;       // Signalled when the last worker leaves a job
+ pool_task fn;              // Current job
+ void *arg;
+ int tasks;
+ int next;                  // Next task to hand out
+ int busy;                  // Workers still on the current job
+ unsigned generation;       // Bumped for every job, so workers can tell a new one
+ int quit;
+} work_pool;
+
+int pool_init(work_pool *p, int threads);
+void pool_free(work_pool *p);
+void pool_run(work_pool *p, int tasks, pool_task fn, void *arg);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Belief engine benchmark. Builds a random map of the requested size (buildings blue, green or
+ white, as parse_map() would produce), then times the measurement update (updateBeliefByColor)
+ the motion update (updateBeliefByAction), the turn update (updateBeliefByTurn) and the
+ exploration planner (beliefs_plan) over it, and reports the cost of each. The belief is
+ reset to uniform every few updates, so these are the costs of the dense updates.
+
+ It then follows a simulated robot driving around the map from a uniform belief, which lets
+ the belief concentrate and switch to hypothesis mode, and reports the average cost of a
+ scan + drive step there.
+
+ The planes' precision is fixed when the engine is compiled (BELIEF_PRECISION, see
+ EV3_Beliefs.h), compile.sh builds belief_bench (double), belief_bench_f (float) and
+ belief_bench_q (16-bit fixed point). Each reports the planes' memory and the bandwidth of the
+ motion update, which reads and writes every plane once and reads them again to normalize.
+ For accuracy, -a saves the probabilities of every pose after a short run from the uniform
+ belief (a few scans, one of them misread, and drives - the belief is still spread out, where
+ rounding matters most), and -c runs the same and compares against a file saved by another
+ build: the largest difference in any pose's probability, the total variation distance
+ between the two beliefs, and whether they agree on the most likely pose.
+
+ Usage: belief_bench [sx sy] [-r reps] [-t threads] [-a file | -c file]
+    sx sy  map size in intersections (default 200 200)
+    -r     number of updates timed for each kind (default 200)
+    -t     threads for the dense passes (default 1)
+    -a     save the probabilities after the accuracy run to file
+    -c     compare the probabilities after the accuracy run to file
+
+ e.g. ./belief_bench -a ref.bin; ./belief_bench_q -c ref.bin
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include "../EV3_Map.h"
+#include "../EV3_Beliefs.h"
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+// fill the map with random building colours
+static void random_map(int nx, int ny)
+{
+  static const int colours[3] = {2, 3, 6};
+  sx = nx;
+  sy = ny;
+  for (int i = 0; i < nx*ny; i++)
+  {
+    for (int k = 0; k < 4; k++)
+    {
+      map[i][k] = colours[rand()%3];
+    }
+  }
+  sign_map();
+}
+
+// from a uniform belief, a robot at a random pose scans (every third scan misread in one
+// building) and drives on, 6 times. Leaves the belief in dense mode
+static void accuracy_run(belief_state *bs, int nx, int ny)
+{
+  static const int step_x[4] = {0, 1, 0, -1}, step_y[4] = {-1, 0, 1, 0};
+  int rx, ry, rdir;
+  srand(2);
+  beliefs_uniform(bs);
+  rx = rand()%nx;
+  ry = rand()%ny;
+  rdir = rand()%4;
+  for (int r = 0; r < 6; r++)
+  {
+    int i = rx + ry*nx;
+    int scan[4], red = 0;
+    for (int k = 0; k < 4; k++)
+    {
+      scan[k] = map[i][(k + rdir)%4];
+    }
+    if (r%3 == 1) scan[rand()%4] = scan[0] == 6 ? 2 : 6;
+    int ax = rx + step_x[rdir], ay = ry + step_y[rdir];
+    if (ax < 0 || ax >= nx || ay < 0 || ay >= ny) {
+      red = 1;
+      rdir = (rdir + 2)%4;
+    } else {
+      rx = ax;
+      ry = ay;
+    }
+    updateBeliefByColor(bs, &scan[0], &scan[1], &scan[2], &scan[3]);
+    updateBeliefByAction(bs, red);
+  }
+  beliefs_dense(bs);
+}
+
+// save (compare == 0) or compare against (compare == 1) the probabilities of every pose.
+// Returns 0 on success, 1 if the file can not be used
+static int accuracy(belief_state *bs, const char *name, int compare)
+{
+  int n = 4*bs->n, head[2];
+  double *p = (double *)malloc(n*sizeof(double));
+  FILE *f = fopen(name, compare ? "rb" : "wb");
+  int ok = p != NULL && f != NULL;
+
+  for (int k = 0; ok && k < n; k++)
+  {
+    p[k] = beliefsGet(bs, k%bs->n, k/bs->n);
+  }
+  if (ok && !compare) {
+    head[0] = bs->sx;
+    head[1] = bs->sy;
+    ok = fwrite(head, sizeof(head), 1, f) == 1 && fwrite(p, sizeof(double), n, f) == (size_t)n;
+  } else if (ok) {
+    double *ref = (double *)malloc(n*sizeof(double));
+    ok = ref != NULL && fread(head, sizeof(head), 1, f) == 1 &&
+         head[0] == bs->sx && head[1] == bs->sy && fread(ref, sizeof(double), n, f) == (size_t)n;
+    if (ok) {
+      double max_err = 0, tv = 0;
+      int a = 0, b = 0;
+      for (int k = 0; k < n; k++)
+      {
+        double e = p[k] > ref[k] ? p[k] - ref[k] : ref[k] - p[k];
+        max_err = e > max_err ? e : max_err;
+        tv += e;
+        a = p[k] > p[a] ? k : a;
+        b = ref[k] > ref[b] ? k : b;
+      }
+      printf("accuracy vs %s: max |dp| %.3g (best pose p %.4f), total variation %.3g, "
+             "argmax %s\n", name, max_err, ref[b], tv/2, a == b ? "agrees" : "differs");
+    }
+    free(ref);
+  }
+  if (!ok) {
+    fprintf(stderr, "Unable to %s %s for this map\n", compare ? "compare against" : "write", name);
+  }
+  if (f != NULL) fclose(f);
+  free(p);
+  return !ok;
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *precision[3] = {"double", "float", "16-bit fixed point"};
+  int nx = 200, ny = 200, reps = 200, threads = 1;
+  const char *acc_name = NULL;
+  int acc_compare = 0;
+  int pos = 0;
+  belief_state bs;
+  double t0, t_color, t_action, t_turn, t_plan, t_track;
+  int x, y, dir;
+  int rx, ry, rdir, hyp_steps;
+  static const int step_x[4] = {0, 1, 0, -1}, step_y[4] = {-1, 0, 1, 0};
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) reps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) { acc_name = argv[++i]; acc_compare = 0; }
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) { acc_name = argv[++i]; acc_compare = 1; }
+    else if (pos == 0) { nx = atoi(argv[i]); pos++; }
+    else if (pos == 1) { ny = atoi(argv[i]); pos++; }
+    else {
+      fprintf(stderr, "Usage: belief_bench [sx sy] [-r reps] [-t threads] [-a file | -c file]\n");
+      return 1;
+    }
+  }
+  if (reps < 1 || !alloc_map(nx, ny)) return 1;
+  srand(1);
+  random_map(nx, ny);
+  if (!beliefs_init(&bs, nx, ny) || !beliefs_set_threads(&bs, threads)) return 1;
+
+  t_color = t_action = t_turn = t_plan = 0;
+  for (int r = 0; r < reps; r++)
+  {
+    // scan what the map shows at a random intersection, so the update always has a match
+    int i = rand()%(nx*ny);
+    t0 = now_ns();
+    updateBeliefByColor(&bs, &map[i][0], &map[i][1], &map[i][2], &map[i][3]);
+    t_color += now_ns() - t0;
+    t0 = now_ns();
+    beliefs_plan(&bs, NULL);
+    t_plan += now_ns() - t0;
+    t0 = now_ns();
+    updateBeliefByAction(&bs, r%7 == 6);
+    t_action += now_ns() - t0;
+    t0 = now_ns();
+    updateBeliefByTurn(&bs, 1 + r%3);
+    t_turn += now_ns() - t0;
+    // keep the beliefs from collapsing onto one pose, which would make later updates trivial
+    if (r%4 == 3) beliefs_uniform(&bs);
+  }
+  beliefsArgMax(&bs, &x, &y, &dir);
+
+  // tracking: the robot scans, drives to the next intersection (turning around at the
+  // border) and every few steps turns in place
+  beliefs_uniform(&bs);
+  rx = rand()%nx;
+  ry = rand()%ny;
+  rdir = rand()%4;
+  t_track = 0;
+  hyp_steps = 0;
+  for (int r = 0; r < reps; r++)
+  {
+    int i = rx + ry*nx;
+    int scan[4], red = 0;
+    for (int k = 0; k < 4; k++)
+    {
+      scan[k] = map[i][(k + rdir)%4];
+    }
+    int ax = rx + step_x[rdir], ay = ry + step_y[rdir];
+    if (ax < 0 || ax >= nx || ay < 0 || ay >= ny) {
+      red = 1;
+      rdir = (rdir + 2)%4;
+    } else {
+      rx = ax;
+      ry = ay;
+    }
+    t0 = now_ns();
+    updateBeliefByColor(&bs, &scan[0], &scan[1], &scan[2], &scan[3]);
+    updateBeliefByAction(&bs, red);
+    if (r%5 == 4) {
+      updateBeliefByTurn(&bs, 1);
+      rdir = (rdir + 1)%4;
+    }
+    t_track += now_ns() - t0;
+    hyp_steps += bs.hyp_mode;
+  }
+
+#ifdef __AVX2__
+  printf("Measurement kernel: AVX2\n");
+#else
+  printf("Measurement kernel: scalar\n");
+#endif
+  printf("Belief precision: %s, %d bytes per pose\n", precision[BELIEF_PRECISION],
+         (int)sizeof(belief_t));
+  printf("Map %d x %d, %d intersections, beliefs %.1f KB, %d tiles, %d threads\n", nx, ny, nx*ny,
+         (double)bs.stride*8*sizeof(belief_t)/1024.0, bs.tiles,
+         bs.pool != NULL ? bs.pool->threads : 1);
+  printf("%-12s %12.1f us/update %8.2f ns/cell\n", "measurement", t_color/reps/1e3,
+         t_color/reps/(4.0*nx*ny));
+  printf("%-12s %12.1f us/update %8.2f ns/cell %6.2f GB/s\n", "motion", t_action/reps/1e3,
+         t_action/reps/(4.0*nx*ny), 3.0*4*nx*ny*sizeof(belief_t)*reps/t_action);
+  printf("%-12s %12.3f us/update\n", "turn", t_turn/reps/1e3);
+  printf("%-12s %12.1f us/plan   %8.2f ns/cell\n", "plan", t_plan/reps/1e3,
+         t_plan/reps/(4.0*nx*ny));
+  printf("%-12s %12.1f us/step   %d of %d steps in hypothesis mode\n", "tracking", t_track/reps/1e3,
+         hyp_steps, reps);
+  if (acc_name != NULL) {
+    accuracy_run(&bs, nx, ny);
+    if (accuracy(&bs, acc_name, acc_compare)) return 1;
+  }
+
+  beliefs_free(&bs);
+  free_map();
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Colour classifier benchmark. Runs every available colour classifier over a recorded dataset
+ of labelled raw sensor samples, and reports for each one the cost (ns/sample, throughput),
+ the accuracy, per-colour precision and recall, and the full confusion matrix.
+
+ Results can be checked against a stored baseline: the benchmark fails (exit status 1) if a
+ classifier's accuracy drops, or its cost per sample grows, by more than the tolerances below.
+
+ Usage: color_bench dataset.txt [-b baseline.txt] [-w baseline.txt]
+    -b  compare against the baseline in this file, fail on regression
+    -w  write this run's results as the new baseline
+
+ The dataset format is described in color_dataset.h. A baseline file has one line per
+ classifier: name accuracy(%) ns_per_sample
+
+ compile.sh runs the check on every build once a recorded dataset is checked in as
+ Tools/color_data.txt (log_dump --samples writes one) with its baseline, written on the
+ same machine with -w, as Tools/color_baseline.txt.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include "../EV3_Color.h"
+#include "color_dataset.h"
+
+#define ACCURACY_TOLERANCE 0.5      // Allowed accuracy drop, in percentage points
+#define SPEED_TOLERANCE 0.25        // Allowed growth in ns/sample, as a fraction of the baseline
+
+typedef struct classifier
+{
+ const char *name;
+ char (*classify)(int *rgb);
+} classifier;
+
+static const classifier classifiers[]={{"rgb", what_color_rgb},
+                                       {"hsv", what_color_hsv},
+                                       {"lab", what_color_lab}};
+#define N_CLASSIFIERS ((int)(sizeof(classifiers)/sizeof(classifiers[0])))
+
+typedef struct bench_result
+{
+ double accuracy;           // percent
+ double ns_per_sample;
+ int confusion[7][7];       // [true][predicted], slot 6 is for labels outside color_names
+} bench_result;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+static int label_slot(char c)
+{
+  for (int i = 0; i < 6; i++)
+  {
+    if (color_names[i] == c) return i;
+  }
+  return 6;
+}
+
+static void run_classifier(const classifier *c, const int *rgb, const char *label, int n, bench_result *res)
+{
+  int correct = 0;
+  int reps = 0;
+  double t0, t1;
+  volatile char sink;
+
+  memset(res->confusion, 0, sizeof(res->confusion));
+  for (int i = 0; i < n; i++)
+  {
+    char p = c->classify((int *)&rgb[3*i]);
+    res->confusion[label_slot(label[i])][label_slot(p)]++;
+    if (p == label[i]) correct++;
+  }
+  res->accuracy = 100.0*correct/n;
+
+  // repeat the pass until the timing is long enough to be meaningful
+  t0 = now_ns();
+  do {
+    for (int i = 0; i < n; i++)
+    {
+      sink = c->classify((int *)&rgb[3*i]);
+    }
+    reps++;
+    t1 = now_ns();
+  } while (t1 - t0 < 2e8);
+  (void)sink;
+  res->ns_per_sample = (t1 - t0)/((double)reps*n);
+}
+
+static void print_result(const classifier *c, const bench_result *res)
+{
+  printf("\n== %s ==\n", c->name);
+  printf("accuracy %.2f%%, %.1f ns/sample, %.2f Msamples/s\n", res->accuracy, res->ns_per_sample, 1e3/res->ns_per_sample);
+  printf("colour  precision  recall\n");
+  for (int i = 0; i < 6; i++)
+  {
+    int tp = res->confusion[i][i], pred = 0, actual = 0;
+    for (int j = 0; j < 7; j++)
+    {
+      pred += res->confusion[j][i];
+      actual += res->confusion[i][j];
+    }
+    printf("  %c     %7.2f%%  %6.2f%%\n", color_names[i], pred ? 100.0*tp/pred : 0.0, actual ? 100.0*tp/actual : 0.0);
+  }
+  printf("confusion (rows: label, columns: predicted)\n      ");
+  for (int j = 0; j < 6; j++) printf("%7c", color_names[j]);
+  printf("\n");
+  for (int i = 0; i < 7; i++)
+  {
+    int row = 0;
+    for (int j = 0; j < 7; j++) row += res->confusion[i][j];
+    if (i == 6 && row == 0) continue;
+    printf("  %c   ", i < 6 ? color_names[i] : '?');
+    for (int j = 0; j < 6; j++) printf("%7d", res->confusion[i][j]);
+    printf("\n");
+  }
+}
+
+// compare against a stored baseline, returns the number of regressions (or -1 if unreadable)
+static int check_baseline(const char *filename, const bench_result *res)
+{
+  FILE *f;
+  char name[64];
+  double acc, ns;
+  int regressions = 0;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open baseline %s\n", filename);
+    return -1;
+  }
+  printf("\n== baseline %s ==\n", filename);
+  while (fscanf(f, "%63s %lf %lf", name, &acc, &ns) == 3)
+  {
+    for (int c = 0; c < N_CLASSIFIERS; c++)
+    {
+      if (strcmp(name, classifiers[c].name) != 0) continue;
+      if (res[c].accuracy < acc - ACCURACY_TOLERANCE) {
+        printf("REGRESSION %s: accuracy %.2f%% < baseline %.2f%%\n", name, res[c].accuracy, acc);
+        regressions++;
+      }
+      if (res[c].ns_per_sample > ns*(1.0 + SPEED_TOLERANCE)) {
+        printf("REGRESSION %s: %.1f ns/sample > baseline %.1f\n", name, res[c].ns_per_sample, ns);
+        regressions++;
+      }
+    }
+  }
+  fclose(f);
+  if (regressions == 0) printf("no regressions\n");
+  return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+  int *rgb;
+  char *label;
+  int n;
+  const char *baseline_in = NULL, *baseline_out = NULL;
+  bench_result res[N_CLASSIFIERS];
+  int status = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: color_bench dataset.txt [-b baseline.txt] [-w baseline.txt]\n");
+    exit(1);
+  }
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-b") == 0 && i+1 < argc) baseline_in = argv[++i];
+    else if (strcmp(argv[i], "-w") == 0 && i+1 < argc) baseline_out = argv[++i];
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  n = read_color_dataset(argv[1], &rgb, &label);
+  if (n <= 0) {
+    fprintf(stderr, "No samples in dataset\n");
+    exit(1);
+  }
+  color_space_init();
+
+  printf("%d samples\n", n);
+  for (int c = 0; c < N_CLASSIFIERS; c++)
+  {
+    run_classifier(&classifiers[c], rgb, label, n, &res[c]);
+    print_result(&classifiers[c], &res[c]);
+  }
+
+  if (baseline_in != NULL && check_baseline(baseline_in, res) != 0) {
+    status = 1;
+  }
+  if (baseline_out != NULL) {
+    FILE *f = fopen(baseline_out, "w");
+    if (f == NULL) {
+      fprintf(stderr, "Unable to open %s for writing\n", baseline_out);
+      status = 1;
+    } else {
+      for (int c = 0; c < N_CLASSIFIERS; c++)
+      {
+        fprintf(f, "%s %.2f %.1f\n", classifiers[c].name, res[c].accuracy, res[c].ns_per_sample);
+      }
+      fclose(f);
+    }
+  }
+
+  free(rgb);
+  free(label);
+  exit(status);
+}
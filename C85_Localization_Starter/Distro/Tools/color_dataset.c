@@ -0,0 +1,46 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Labelled colour sample datasets - see color_dataset.h for the format.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include "color_dataset.h"
+
+// read a dataset into rgb[] (3 ints per sample) and label[], returns the number of samples or
+// -1 on error. The caller frees both arrays
+int read_color_dataset(const char *filename, int **rgb, char **label)
+{
+  FILE *f;
+  char line[256];
+  int n = 0, cap = 1024;
+  int r, g, b;
+  char l;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open dataset %s\n", filename);
+    return -1;
+  }
+  *rgb = (int *)malloc(cap*3*sizeof(int));
+  *label = (char *)malloc(cap*sizeof(char));
+  while (fgets(&line[0], 255, f) != NULL)
+  {
+    if (line[0] == '#' || sscanf(&line[0], "%d %d %d %c", &r, &g, &b, &l) != 4) continue;
+    if (n == cap) {
+      cap *= 2;
+      *rgb = (int *)realloc(*rgb, cap*3*sizeof(int));
+      *label = (char *)realloc(*label, cap*sizeof(char));
+    }
+    (*rgb)[3*n] = r;
+    (*rgb)[3*n+1] = g;
+    (*rgb)[3*n+2] = b;
+    (*label)[n] = l;
+    n++;
+  }
+  fclose(f);
+  return n;
+}
@@ -0,0 +1,20 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Labelled colour sample datasets for the offline colour tools. Plain text, one sample per line,
+ as read from BT_read_colour_sensor_RGB():
+
+    R G B label
+
+ where label is one of r, g, b, k, y, w (red, green, blue, black, yellow, white). Lines
+ starting with '#' are comments.
+
+*/
+
+#ifndef __color_dataset_header
+#define __color_dataset_header
+
+int read_color_dataset(const char *filename, int **rgb, char **label);
+
+#endif
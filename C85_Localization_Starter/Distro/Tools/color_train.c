@@ -0,0 +1,206 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Colour classifier training. Fits a nearest-prototype model to a labelled log of raw colour
+ sensor samples, and writes it out as the generated header EV3_ColorModel.h that what_color()
+ is compiled against.
+
+ Each colour gets k prototypes, found by k-means over that colour's samples using the same
+ redmean distance what_color() uses at runtime. Initial centres are picked farthest-first, so
+ training is deterministic.
+
+ Usage: color_train dataset.txt [-k prototypes_per_colour] [-o output_header]
+
+ The dataset format is described in color_dataset.h. Rebuild after retraining.
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "../EV3_Color.h"
+#include "color_dataset.h"
+
+#define MAX_K 8
+#define KMEANS_ITERATIONS 50
+
+// k-means over the samples in idx[0..n-1], leaves up to k centres in centre[][] and returns
+// how many were found (fewer than k if there are fewer distinct samples)
+static int kmeans(const int *rgb, const int *idx, int n, int k, int centre[MAX_K][3])
+{
+  int m = 0;
+  long sum[MAX_K][3];
+  int count[MAX_K];
+
+  // farthest-first initialization, starting from the first sample
+  for (int c = 0; c < 3; c++) centre[0][c] = rgb[3*idx[0]+c];
+  m = 1;
+  while (m < k)
+  {
+    long far_dist = 0;
+    int far = -1;
+    for (int i = 0; i < n; i++)
+    {
+      long d = -1;
+      for (int j = 0; j < m; j++)
+      {
+        long dj = color_distance2(&rgb[3*idx[i]], centre[j]);
+        if (d < 0 || dj < d) d = dj;
+      }
+      if (d > far_dist) {
+        far_dist = d;
+        far = i;
+      }
+    }
+    if (far < 0) break;
+    for (int c = 0; c < 3; c++) centre[m][c] = rgb[3*idx[far]+c];
+    m++;
+  }
+
+  for (int it = 0; it < KMEANS_ITERATIONS; it++)
+  {
+    int moved = 0;
+    memset(sum, 0, sizeof(sum));
+    memset(count, 0, sizeof(count));
+    for (int i = 0; i < n; i++)
+    {
+      int best = 0;
+      long best_dist = color_distance2(&rgb[3*idx[i]], centre[0]);
+      for (int j = 1; j < m; j++)
+      {
+        long d = color_distance2(&rgb[3*idx[i]], centre[j]);
+        if (d < best_dist) {
+          best_dist = d;
+          best = j;
+        }
+      }
+      for (int c = 0; c < 3; c++) sum[best][c] += rgb[3*idx[i]+c];
+      count[best]++;
+    }
+    for (int j = 0; j < m; j++)
+    {
+      if (count[j] == 0) continue;
+      for (int c = 0; c < 3; c++)
+      {
+        int v = (int)((sum[j][c] + count[j]/2)/count[j]);
+        if (v != centre[j][c]) moved = 1;
+        centre[j][c] = v;
+      }
+    }
+    if (!moved) break;
+  }
+  return m;
+}
+
+int main(int argc, char *argv[])
+{
+  int *rgb;
+  char *label;
+  int *idx;
+  int n, k = 2;
+  const char *out_name = "EV3_ColorModel.h";
+  int proto[6*MAX_K][3];
+  char proto_label[6*MAX_K];
+  int np = 0, correct = 0;
+  FILE *f;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: color_train dataset.txt [-k prototypes_per_colour] [-o output_header]\n");
+    exit(1);
+  }
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-k") == 0 && i+1 < argc) k = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) out_name = argv[++i];
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (k < 1 || k > MAX_K) {
+    fprintf(stderr, "Prototypes per colour must be between 1 and %d\n", MAX_K);
+    exit(1);
+  }
+
+  n = read_color_dataset(argv[1], &rgb, &label);
+  if (n <= 0) {
+    fprintf(stderr, "No samples in dataset\n");
+    exit(1);
+  }
+  idx = (int *)malloc(n*sizeof(int));
+
+  for (int c = 0; c < 6; c++)
+  {
+    int nc = 0;
+    int centre[MAX_K][3];
+    int m;
+    for (int i = 0; i < n; i++)
+    {
+      if (label[i] == color_names[c]) idx[nc++] = i;
+    }
+    if (nc == 0) {
+      fprintf(stderr, "Warning: no samples labelled '%c', this colour will never be reported\n", color_names[c]);
+      continue;
+    }
+    m = kmeans(rgb, idx, nc, k, centre);
+    for (int j = 0; j < m; j++)
+    {
+      memcpy(proto[np], centre[j], sizeof(centre[j]));
+      proto_label[np++] = color_names[c];
+    }
+    fprintf(stderr, "'%c': %d samples, %d prototypes\n", color_names[c], nc, m);
+  }
+  if (np == 0) {
+    fprintf(stderr, "No samples carry a known colour label (r, g, b, k, y, w), no model written\n");
+    exit(1);
+  }
+
+  // training accuracy under the runtime (redmean) classifier
+  for (int i = 0; i < n; i++)
+  {
+    int best = 0;
+    long best_dist = color_distance2(&rgb[3*i], proto[0]);
+    for (int j = 1; j < np; j++)
+    {
+      long d = color_distance2(&rgb[3*i], proto[j]);
+      if (d < best_dist) {
+        best_dist = d;
+        best = j;
+      }
+    }
+    if (proto_label[best] == label[i]) correct++;
+  }
+  fprintf(stderr, "Training accuracy: %.2f%% over %d samples\n", 100.0*correct/n, n);
+
+  f = fopen(out_name, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open %s for writing\n", out_name);
+    exit(1);
+  }
+  fprintf(f, "/*\n\n  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization\n\n");
+  fprintf(f, " Colour classifier model: a set of labelled RGB prototypes in raw sensor units. what_color()\n");
+  fprintf(f, " returns the label of the nearest prototype under the selected metric.\n\n");
+  fprintf(f, " Generated by Tools/color_train from %s (%d samples, %d prototypes per colour,\n", argv[1], n, k);
+  fprintf(f, " training accuracy %.2f%%). Do not edit by hand, retrain instead.\n\n*/\n\n", 100.0*correct/n);
+  fprintf(f, "#ifndef __color_model_header\n#define __color_model_header\n\n");
+  fprintf(f, "constexpr int COLOR_MODEL_SIZE = %d;\n\n", np);
+  fprintf(f, "constexpr int color_model_proto[COLOR_MODEL_SIZE][3] = {\n");
+  for (int j = 0; j < np; j++)
+  {
+    fprintf(f, "  {%d, %d, %d},\n", proto[j][0], proto[j][1], proto[j][2]);
+  }
+  fprintf(f, "};\n\nconstexpr char color_model_label[COLOR_MODEL_SIZE] = {");
+  for (int j = 0; j < np; j++)
+  {
+    fprintf(f, "'%c'%s", proto_label[j], j < np-1 ? ", " : "");
+  }
+  fprintf(f, "};\n\n#endif\n");
+  fclose(f);
+  fprintf(stderr, "Model written to %s\n", out_name);
+
+  free(idx);
+  free(rgb);
+  free(label);
+  exit(0);
+}
@@ -0,0 +1,109 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Telemetry log reader. Prints a summary of a log written with --log=, lists records from a
+ given time or of a given event type, or exports the colour samples in the dataset format used
+ by color_train and color_bench (labelled with the colour the robot classified them as, so
+ check and correct the labels before training on them).
+
+ Usage: log_dump run.log [-t seconds] [-e event_type] [-n count] [--samples]
+    -t  start listing at this many seconds after the log was opened
+    -e  only list events of this type (see LOG_EVENT_* in EV3_Log.h)
+    -n  number of records to list (default 20)
+    --samples  write every colour sample as "R G B label" to stdout
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "../EV3_Log.h"
+
+static const char *event_names[LOG_EVENT_TYPES]={"sample", "transition", "motor", "gyro", "state", "scan"};
+
+static void print_record(const log_reader *r, uint64_t i, uint64_t start_ns)
+{
+  const log_record *rec = &r->records[i];
+  printf("%8lu %10.3f %-10s state=%u gyro=%3d motors=%4d,%4d,%4d",
+         (unsigned long)i, (double)(rec->t_ns - start_ns)*1e-9,
+         rec->event < LOG_EVENT_TYPES ? event_names[rec->event] : "?",
+         rec->state, rec->gyro, rec->motor_l, rec->motor_r, rec->motor_c);
+  if (rec->event == LOG_EVENT_SCAN) {
+    printf(" scan=%u,%u,%u,%u", rec->scan[0], rec->scan[1], rec->scan[2], rec->scan[3]);
+  } else if (rec->rgb[0] >= 0) {
+    printf(" rgb=%d,%d,%d", rec->rgb[0], rec->rgb[1], rec->rgb[2]);
+  }
+  if (rec->color) printf(" colour=%c", rec->color);
+  printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  log_reader r;
+  const log_file_header *hdr;
+  double t = 0;
+  int event = -1, count = 20, samples = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: log_dump run.log [-t seconds] [-e event_type] [-n count] [--samples]\n");
+    exit(1);
+  }
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-t") == 0 && i+1 < argc) t = atof(argv[++i]);
+    else if (strcmp(argv[i], "-e") == 0 && i+1 < argc) event = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) count = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--samples") == 0) samples = 1;
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (!log_reader_open(&r, argv[1])) {
+    exit(1);
+  }
+  hdr = (const log_file_header *)r.base;
+
+  if (samples) {
+    for (uint64_t i = 0; i < r.record_count; i++)
+    {
+      const log_record *rec = &r.records[i];
+      if (rec->event == LOG_EVENT_SAMPLE && rec->color) {
+        printf("%d %d %d %c\n", rec->rgb[0], rec->rgb[1], rec->rgb[2], rec->color);
+      }
+    }
+    log_reader_close(&r);
+    exit(0);
+  }
+
+  printf("%lu records", (unsigned long)r.record_count);
+  if (r.record_count > 0) {
+    printf(", %.3f s", (double)(r.records[r.record_count-1].t_ns - hdr->start_ns)*1e-9);
+  }
+  if (r.time_index == NULL) {
+    printf(" (no index - the run did not close its log)\n");
+  } else {
+    printf(", %lu dropped\n", (unsigned long)r.dropped);
+    for (int e = 0; e < LOG_EVENT_TYPES; e++)
+    {
+      printf("  %-10s %lu\n", event_names[e], (unsigned long)r.event_count[e]);
+    }
+  }
+
+  uint64_t start_ns = hdr->start_ns + (uint64_t)(t*1e9);
+  if (event >= 0 && event < LOG_EVENT_TYPES) {
+    for (uint64_t k = log_seek_event(&r, event, start_ns); k < r.event_count[event] && count > 0; k++, count--)
+    {
+      print_record(&r, r.events[event][k], hdr->start_ns);
+    }
+  } else {
+    for (uint64_t i = log_seek_time(&r, start_ns); i < r.record_count && count > 0; i++, count--)
+    {
+      print_record(&r, i, hdr->start_ns);
+    }
+  }
+
+  log_reader_close(&r);
+  exit(0);
+}
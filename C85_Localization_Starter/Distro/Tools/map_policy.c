@@ -0,0 +1,417 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Map ambiguity analyzer. Parses a map, works out which start poses look alike, and builds the
+ decision tree that tells them apart with the fewest intersection scans (see EV3_Policy.h),
+ for robot_localization() to follow with --policy=.
+
+ Each node of the tree is a set of poses the robot could be in. Every action (0-3 clockwise
+ quarter turns, then drive to the next intersection and scan) moves each pose and splits the
+ set by what the robot would see. The fewest scans that resolve a set is found by iterative
+ deepening: can the set be resolved in 1 more scan, in 2, ... - with the answers for sets
+ already tried kept in a table. Sets for which this search runs over its budget (-b) are
+ split greedily instead (the action giving the most, and most even, parts), and the policy is
+ then no longer guaranteed minimal. Sets the search proves can not be resolved within -d
+ scans are split greedily as far as they go, and end in ambiguous leaves.
+
+ The tree is checked by walking every start pose through it before it is written.
+
+ Usage: map_policy map.ppm policy.out [-d max_scans] [-b budget]
+    -d  deepest tree searched, in scans (default 12)
+    -b  sets visited by the exact search per node before giving up (default 1000000)
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "../EV3_Map.h"
+#include "../EV3_Policy.h"
+
+#define MEMO_BITS 22
+
+typedef struct moved_pose
+{
+ uint32_t obs;              // What the robot sees after the move
+ int pose;                  // Where it ends up, i*4 + direction
+} moved_pose;
+
+static int max_depth = 12;
+static long budget = 1000000, visits;
+static int optimal = 1;
+static uint64_t *memo_key;         // Pose set hash and depth, 0 for a free slot
+static uint8_t *memo_val;
+static policy_node *nodes;
+static policy_edge *edges;
+static int node_count, node_cap, edge_count, edge_cap;
+static int max_scans, ambiguous;
+static double scan_sum;
+
+static const int step_x[4] = {0, 1, 0, -1}, step_y[4] = {-1, 0, 1, 0};
+
+// where a noise-free robot at pose p ends up after turning q quarter turns clockwise and
+// driving to the next intersection, and what it sees there
+static moved_pose move_pose(int p, int q)
+{
+  int i = p >> 2, d = ((p & 3) + q)%4;
+  int x = i%sx + step_x[d], y = i/sx + step_y[d];
+  int red = 0;
+  moved_pose m;
+  if (x < 0 || x >= sx || y < 0 || y >= sy) {
+    // facing the border, turns around on red at the same intersection
+    x = i%sx;
+    y = i/sx;
+    d = (d + 2)%4;
+    red = 1;
+  }
+  i = x + y*sx;
+  m.pose = i*4 + d;
+  // the scan a robot facing d at i reads, see EV3_Map.h
+  m.obs = POLICY_OBS(red, sig_rotate[map_sig[i]][(4 - d)%4]);
+  return m;
+}
+
+static int cmp_moved(const void *a, const void *b)
+{
+  const moved_pose *x = (const moved_pose *)a, *y = (const moved_pose *)b;
+  if (x->obs != y->obs) return x->obs < y->obs ? -1 : 1;
+  return (x->pose > y->pose) - (x->pose < y->pose);
+}
+
+// move every pose in set by action q and sort by observation. Returns the number of parts
+static int split(const int *set, int k, int q, moved_pose *out)
+{
+  int parts = 1;
+  for (int j = 0; j < k; j++)
+  {
+    out[j] = move_pose(set[j], q);
+  }
+  qsort(out, k, sizeof(moved_pose), cmp_moved);
+  for (int j = 1; j < k; j++)
+  {
+    parts += out[j].obs != out[j - 1].obs;
+  }
+  return parts;
+}
+
+static uint64_t set_hash(const int *set, int k, int depth)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)k;
+  for (int j = 0; j < k; j++)
+  {
+    h = (h ^ (uint64_t)set[j])*0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  return (h ^ ((uint64_t)depth << 56)) | 1;
+}
+
+// whether the poses in set (sorted) can always be told apart with depth more scans
+static int solvable(const int *set, int k, int depth)
+{
+  uint64_t key;
+  uint32_t slot;
+  int ok = 0;
+  moved_pose *moved;
+  int *part;
+
+  if (k == 1) return 1;
+  if (depth == 0) return 0;
+  // a scan has at most 512 outcomes
+  if (depth < 3 && k > (depth == 1 ? 512 : 512*512)) return 0;
+  key = set_hash(set, k, depth);
+  slot = (uint32_t)(key >> 11) & ((1u << MEMO_BITS) - 1);
+  if (memo_key[slot] == key) return memo_val[slot];
+  if (++visits > budget) return 0;
+
+  moved = (moved_pose *)malloc(k*sizeof(moved_pose));
+  part = (int *)malloc(k*sizeof(int));
+  for (int q = 0; q < 4 && !ok && visits <= budget; q++)
+  {
+    split(set, k, q, moved);
+    ok = 1;
+    for (int a = 0; a < k && ok; )
+    {
+      int b = a;
+      while (b < k && moved[b].obs == moved[a].obs)
+      {
+        part[b - a] = moved[b].pose;
+        b++;
+      }
+      ok = solvable(part, b - a, depth - 1);
+      a = b;
+    }
+  }
+  free(moved);
+  free(part);
+  if (visits <= budget) {
+    memo_key[slot] = key;
+    memo_val[slot] = (uint8_t)ok;
+  }
+  return ok;
+}
+
+static int add_node(int action, int pose)
+{
+  if (node_count == node_cap) {
+    node_cap = node_cap ? 2*node_cap : 1024;
+    nodes = (policy_node *)realloc(nodes, node_cap*sizeof(policy_node));
+    if (nodes == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  memset(&nodes[node_count], 0, sizeof(policy_node));
+  nodes[node_count].action = (uint8_t)action;
+  nodes[node_count].pose = pose;
+  return node_count++;
+}
+
+static void add_edge(int node, uint32_t obs, int child)
+{
+  if (edge_count == edge_cap) {
+    edge_cap = edge_cap ? 2*edge_cap : 1024;
+    edges = (policy_edge *)realloc(edges, edge_cap*sizeof(policy_edge));
+    if (edges == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  edges[edge_count].node = node;
+  edges[edge_count].obs = obs;
+  edges[edge_count].child = child;
+  edge_count++;
+}
+
+// pick the action for a set of poses, scans have been made so far. Exact when the search
+// stays in budget, greedy otherwise - and greedy too for a set the search proves can not be
+// resolved in the scans left, which is no loss of minimality. Returns -1 if no action can
+// split the set
+static int choose(const int *set, int k, int scans, moved_pose *moved)
+{
+  int best = -1, best_parts = 1, best_big = k;
+  for (int depth = 1; scans + depth <= max_depth; depth++)
+  {
+    visits = 0;
+    if (solvable(set, k, depth)) {
+      // the memo table makes finding the action that did it cheap
+      for (int q = 0; q < 4; q++)
+      {
+        int ok = 1;
+        int *part = (int *)malloc(k*sizeof(int));
+        split(set, k, q, moved);
+        for (int a = 0; a < k && ok; )
+        {
+          int b = a;
+          while (b < k && moved[b].obs == moved[a].obs)
+          {
+            part[b - a] = moved[b].pose;
+            b++;
+          }
+          ok = solvable(part, b - a, depth - 1);
+          a = b;
+        }
+        free(part);
+        if (ok) return q;
+      }
+    }
+    if (visits > budget) {
+      optimal = 0;
+      break;
+    }
+  }
+  for (int q = 0; q < 4; q++)
+  {
+    int parts = split(set, k, q, moved), big = 0;
+    for (int a = 0; a < k; )
+    {
+      int b = a;
+      while (b < k && moved[b].obs == moved[a].obs) b++;
+      if (b - a > big) big = b - a;
+      a = b;
+    }
+    if (parts > best_parts || (parts == best_parts && parts > 1 && big < best_big)) {
+      best = q;
+      best_parts = parts;
+      best_big = big;
+    }
+  }
+  return best;
+}
+
+// build the subtree for a set of poses after scans scans, returns its node
+static int build(const int *set, int k, int scans)
+{
+  moved_pose *moved;
+  int node, q;
+
+  if (k == 1 || scans >= max_depth) {
+    if (k > 1) ambiguous++;
+    if (scans > max_scans) max_scans = scans;
+    scan_sum += (double)scans*k;
+    return add_node(POLICY_LEAF, k == 1 ? set[0] : -1);
+  }
+  moved = (moved_pose *)malloc(k*sizeof(moved_pose));
+  q = choose(set, k, scans, moved);
+  if (q < 0) {
+    // no action tells these poses apart
+    free(moved);
+    ambiguous++;
+    if (scans > max_scans) max_scans = scans;
+    scan_sum += (double)scans*k;
+    return add_node(POLICY_LEAF, -1);
+  }
+  node = add_node(q, -1);
+  split(set, k, q, moved);
+  int *part = (int *)malloc(k*sizeof(int));
+  for (int a = 0; a < k; )
+  {
+    int b = a;
+    while (b < k && moved[b].obs == moved[a].obs)
+    {
+      part[b - a] = moved[b].pose;
+      b++;
+    }
+    int child = build(part, b - a, scans + 1);
+    add_edge(node, moved[a].obs, child);
+    a = b;
+  }
+  free(part);
+  free(moved);
+  return node;
+}
+
+// walk every start pose through the tree, returns the number that end up in the wrong place
+static int check(const policy *p)
+{
+  int bad = 0;
+  for (int start = 0; start < 4*sx*sy; start++)
+  {
+    int pose = start, node = 0, red = 0;
+    for (int scans = 0; ; scans++)
+    {
+      int i = pose >> 2, d = pose & 3;
+      node = policy_next(p, node, red, sig_rotate[map_sig[i]][(4 - d)%4]);
+      if (node < 0) {
+        bad++;
+        break;
+      }
+      if (p->node[node].action == POLICY_LEAF) {
+        bad += p->node[node].pose >= 0 && p->node[node].pose != pose;
+        break;
+      }
+      moved_pose m = move_pose(pose, p->node[node].action);
+      pose = m.pose;
+      red = m.obs >= 256;
+    }
+  }
+  return bad;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned char *map_image;
+  int rx, ry, n;
+  int *all;
+  moved_pose *moved;
+  policy p;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: map_policy map.ppm policy.out [-d max_scans] [-b budget]\n");
+    exit(1);
+  }
+  for (int i = 3; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-d") == 0 && i+1 < argc) max_depth = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-b") == 0 && i+1 < argc) budget = atol(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (max_depth < 1 || max_depth > 250 || budget < 1) {
+    fprintf(stderr, "Invalid -d or -b\n");
+    exit(1);
+  }
+  map_image = readPPMimage(argv[1], &rx, &ry);
+  if (map_image == NULL || !parse_map(map_image, rx, ry)) {
+    fprintf(stderr, "Unable to read map %s\n", argv[1]);
+    exit(1);
+  }
+  n = 4*sx*sy;
+  memo_key = (uint64_t *)calloc((size_t)1 << MEMO_BITS, sizeof(uint64_t));
+  memo_val = (uint8_t *)calloc((size_t)1 << MEMO_BITS, 1);
+  all = (int *)malloc(n*sizeof(int));
+  moved = (moved_pose *)malloc(n*sizeof(moved_pose));
+  if (memo_key == NULL || memo_val == NULL || all == NULL || moved == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  // the root: nothing seen yet, the first scan splits the start poses by what they show
+  add_node(0, -1);
+  for (int j = 0; j < n; j++)
+  {
+    int i = j >> 2, d = j & 3;
+    moved[j].obs = POLICY_OBS(0, sig_rotate[map_sig[i]][(4 - d)%4]);
+    moved[j].pose = j;
+  }
+  qsort(moved, n, sizeof(moved_pose), cmp_moved);
+  for (int a = 0; a < n; )
+  {
+    int b = a;
+    while (b < n && moved[b].obs == moved[a].obs)
+    {
+      all[b - a] = moved[b].pose;
+      b++;
+    }
+    add_edge(0, moved[a].obs, build(all, b - a, 1));
+    a = b;
+  }
+
+  // hash the edges into a table at most half full
+  memset(&p.h, 0, sizeof(policy_header));
+  memcpy(p.h.magic, POLICY_MAGIC, 8);
+  p.h.sx = sx;
+  p.h.sy = sy;
+  p.h.map_hash = map_hash();
+  p.h.node_count = node_count;
+  p.h.edge_slots = 16;
+  while (p.h.edge_slots < 2u*edge_count) p.h.edge_slots *= 2;
+  p.h.max_scans = max_scans;
+  p.h.flags = optimal ? POLICY_OPTIMAL : 0;
+  p.h.ambiguous = ambiguous;
+  p.node = nodes;
+  p.edge = (policy_edge *)malloc(p.h.edge_slots*sizeof(policy_edge));
+  if (p.edge == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memset(p.edge, 0xff, p.h.edge_slots*sizeof(policy_edge));
+  for (int e = 0; e < edge_count; e++)
+  {
+    uint32_t k = policy_slot(edges[e].node, edges[e].obs, p.h.edge_slots);
+    while (p.edge[k].node != POLICY_EMPTY) k = (k + 1) & (p.h.edge_slots - 1);
+    p.edge[k] = edges[e];
+  }
+
+  printf("Map %d x %d, %d start poses\n", sx, sy, n);
+  printf("Policy: %d nodes, %d edges, %s\n", node_count, edge_count, optimal ? "minimal" : "not guaranteed minimal");
+  printf("Scans: %d at most, %.2f on average, %d ambiguous leaves\n", max_scans, scan_sum/n, ambiguous);
+  if (check(&p) != 0) {
+    fprintf(stderr, "Policy check failed\n");
+    exit(1);
+  }
+  if (!policy_save(&p, argv[2])) exit(1);
+
+  free(p.edge);
+  free(nodes);
+  free(edges);
+  free(all);
+  free(moved);
+  free(memo_key);
+  free(memo_val);
+  free_map();
+  free(map_image);
+  return 0;
+}
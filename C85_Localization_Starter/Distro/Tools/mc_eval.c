@@ -0,0 +1,370 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Monte Carlo localization evaluation. Parses a map, and for each noise level runs many
+ episodes of the full localization loop robot_localization() runs - localize() in
+ EV3_Explore.h, with the planner and, with -p, the precomputed policy - on a simulated robot:
+ a random start pose, every building misread with the given probability, and drives that
+ overshoot or stop short of the next intersection as the slip model (-s) says. It reports,
+ per noise level, how often localization finished, how often it named the wrong pose, and
+ the distribution of scans it took. Use it to pick the motion model (-m), the convergence
+ test (-c) and whether to use a policy before touching the hardware.
+
+ With -b the simulated robot streams its scans a building at a time, in the order the real
+ robot reads them (the front pair, then the rear pair after driving back), and stops when
+ localize() says the rest can not change the most likely pose. The last two columns of the
+ table are the buildings read per scan and the share of scans that needed the drive back to
+ the rear pair (4 and 100% without -b).
+
+ Episodes are independent. Each worker has its own belief and takes the next episode from a
+ shared counter, so a worker that drew short episodes goes on to take more. Every episode
+ draws from its own random stream, seeded from -r and the episode number, so the results
+ are the same whatever the number of threads.
+
+ Usage: mc_eval map.ppm [-n misread,...] [-k episodes] [-s p_over,p_under] [-m p_over,p_under]
+                        [-c ratio,entropy] [-p policy] [-l max_scans] [-t threads] [-r seed] [-b]
+    -n  building misread rates to evaluate, one noise level each (default 0,0.01,0.02,0.05,0.1)
+    -k  episodes per noise level (default 1000)
+    -s  slip of the simulated robot (default BELIEF_P_OVER,BELIEF_P_UNDER)
+    -m  motion model of the belief (default the same as -s)
+    -c  convergence test, as --converge= (default BELIEF_CONVERGE_RATIO,BELIEF_CONVERGE_ENTROPY)
+    -p  follow this policy (built by Tools/map_policy for the same map)
+    -l  give up on an episode after this many scans (default 100)
+    -t  worker threads (default: all cores)
+    -r  random seed (default 1)
+    -b  stream the scans, a building at a time
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+#include "../EV3_Map.h"
+#include "../EV3_Beliefs.h"
+#include "../EV3_Explore.h"
+
+#define MAX_LEVELS 16
+
+typedef struct sim_robot
+{
+ int x, y, dir;             // True pose
+ int scans;
+ int reads, rear;           // Buildings read, and scans that read the rear pair
+ double misread, p_over, p_under;
+ uint64_t rng;
+} sim_robot;
+
+typedef struct episode
+{
+ int scans;                 // Scans until localize() returned
+ int reads, rear;           // Buildings read, scans that read the rear pair
+ int finished;              // 1 if it localized within the scan limit
+ int wrong;                 // 1 if it localized on the wrong pose
+} episode;
+
+typedef struct eval_job
+{
+ double misread[MAX_LEVELS];
+ int levels, episodes, max_scans, stream;
+ double slip_over, slip_under, p_over, p_under, ratio, entropy;
+ const policy *pol;
+ uint64_t seed;
+ episode *result;           // levels*episodes, level by level
+ int next;                  // Next episode to hand out
+} eval_job;
+
+static const int step_x[4] = {0, 1, 0, -1}, step_y[4] = {-1, 0, 1, 0};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+// splitmix64, small and good enough for a simulation, with its state in the robot
+static uint64_t next_random(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static double sim_uniform(sim_robot *r)
+{
+  return (double)(next_random(&r->rng) >> 11)*(1.0/9007199254740992.0);
+}
+
+// what the robot sees of the building at position k, misread with probability misread
+static int sim_building(sim_robot *r, int k)
+{
+  int colour = map[r->x + r->y*sx][(k + r->dir)%4];
+  // a misread is any of the other five colours
+  if (sim_uniform(r) < r->misread) colour = 1 + (colour + (int)(next_random(&r->rng)%5))%6;
+  return colour;
+}
+
+// what the robot sees at its intersection
+static void sim_scan(void *ctx, int colour[4])
+{
+  sim_robot *r = (sim_robot *)ctx;
+  r->scans++;
+  r->reads += 4;
+  r->rear++;
+  for (int k = 0; k < 4; k++)
+  {
+    colour[k] = sim_building(r, k);
+  }
+}
+
+// the same, a building at a time in the robot's order: top-left, top-right, then after the
+// drive back bottom-left, bottom-right
+static void sim_scan_stream(void *ctx, building_sink read, void *arg)
+{
+  static const int order[4] = {0, 1, 3, 2};
+  sim_robot *r = (sim_robot *)ctx;
+  r->scans++;
+  for (int k = 0; k < 4; k++)
+  {
+    r->reads++;
+    if (k == 2) r->rear++;
+    if (!read(arg, order[k], sim_building(r, order[k]))) return;
+  }
+}
+
+static void sim_turn(void *ctx, int quarter_turns)
+{
+  sim_robot *r = (sim_robot *)ctx;
+  r->dir = (r->dir + quarter_turns)%4;
+}
+
+// one intersection on, two (overshoot) or none (stopping short), turning around on the red
+// border - the outcomes of the belief's motion model
+static int sim_drive(void *ctx)
+{
+  sim_robot *r = (sim_robot *)ctx;
+  double u = sim_uniform(r);
+  int red = 0;
+  for (int steps = u < r->p_under ? 0 : (u < r->p_under + r->p_over ? 2 : 1); steps > 0; steps--)
+  {
+    int ax = r->x + step_x[r->dir], ay = r->y + step_y[r->dir];
+    if (ax < 0 || ax >= sx || ay < 0 || ay >= sy) {
+      red = 1;
+      r->dir = (r->dir + 2)%4;
+    } else {
+      r->x = ax;
+      r->y = ay;
+    }
+  }
+  return red;
+}
+
+static void run_episode(eval_job *job, belief_state *bs, int k)
+{
+  episode *e = &job->result[k];
+  sim_robot r;
+  robot_io io;
+  int x, y, dir;
+
+  r.rng = job->seed ^ ((uint64_t)k*0xd1b54a32d192ed03ull);
+  r.x = (int)(next_random(&r.rng)%sx);
+  r.y = (int)(next_random(&r.rng)%sy);
+  r.dir = (int)(next_random(&r.rng)%4);
+  r.scans = 0;
+  r.reads = r.rear = 0;
+  r.misread = job->misread[k/job->episodes];
+  r.p_over = job->slip_over;
+  r.p_under = job->slip_under;
+  io.ctx = &r;
+  io.scan = sim_scan;
+  io.scan_stream = job->stream ? sim_scan_stream : NULL;
+  io.turn = sim_turn;
+  io.drive = sim_drive;
+  io.event = NULL;
+
+  beliefs_uniform(bs);
+  e->finished = localize(bs, job->pol, &io, job->max_scans, &x, &y, &dir);
+  e->wrong = e->finished && (x != r.x || y != r.y || dir != r.dir);
+  e->scans = r.scans;
+  e->reads = r.reads;
+  e->rear = r.rear;
+}
+
+static void eval_worker(void *arg, int task)
+{
+  eval_job *job = (eval_job *)arg;
+  belief_state bs;
+  int k;
+  (void)task;
+  if (!beliefs_init(&bs, sx, sy)) exit(1);
+  beliefs_set_motion(&bs, job->p_over, job->p_under);
+  beliefs_set_convergence(&bs, job->ratio, job->entropy);
+  while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->levels*job->episodes)
+  {
+    run_episode(job, &bs, k);
+  }
+  beliefs_free(&bs);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+int main(int argc, char *argv[])
+{
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  const char *policy_name = NULL;
+  int model_given = 0;
+  int rx, ry;
+  unsigned char *map_image;
+  policy pol;
+  eval_job job;
+  work_pool pool;
+  double t0, wall;
+  int *scans;
+
+  memset(&job, 0, sizeof(job));
+  job.levels = 5;
+  job.misread[0] = 0;
+  job.misread[1] = 0.01;
+  job.misread[2] = 0.02;
+  job.misread[3] = 0.05;
+  job.misread[4] = 0.1;
+  job.episodes = 1000;
+  job.max_scans = 100;
+  job.slip_over = BELIEF_P_OVER;
+  job.slip_under = BELIEF_P_UNDER;
+  job.ratio = BELIEF_CONVERGE_RATIO;
+  job.entropy = BELIEF_CONVERGE_ENTROPY;
+  job.seed = 1;
+  if (argc < 2) {
+    fprintf(stderr, "Usage: mc_eval map.ppm [-n misread,...] [-k episodes] [-s p_over,p_under] [-m p_over,p_under]\n");
+    fprintf(stderr, "                       [-c ratio,entropy] [-p policy] [-l max_scans] [-t threads] [-r seed] [-b]\n");
+    exit(1);
+  }
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      char *s = argv[++i], *end;
+      job.levels = 0;
+      while (job.levels < MAX_LEVELS)
+      {
+        job.misread[job.levels] = strtod(s, &end);
+        if (end == s || job.misread[job.levels] < 0 || job.misread[job.levels] > 1) {
+          fprintf(stderr, "Invalid misread rates %s\n", argv[i]);
+          exit(1);
+        }
+        job.levels++;
+        if (*end != ',') break;
+        s = end + 1;
+      }
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &job.slip_over, &job.slip_under) != 2 || job.slip_over < 0 ||
+          job.slip_under < 0 || job.slip_over + job.slip_under >= 1) {
+        fprintf(stderr, "Invalid slip %s, expected p_over,p_under\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &job.p_over, &job.p_under) != 2 || job.p_over < 0 || job.p_under < 0 ||
+          job.p_over + job.p_under >= 1) {
+        fprintf(stderr, "Invalid motion model %s, expected p_over,p_under\n", argv[i]);
+        exit(1);
+      }
+      model_given = 1;
+    }
+    else if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &job.ratio, &job.entropy) != 2 || (job.ratio != 0 && job.ratio <= 1) ||
+          job.entropy < 0 || (job.ratio == 0 && job.entropy == 0)) {
+        fprintf(stderr, "Invalid convergence test %s, expected ratio,entropy\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-k") == 0 && i+1 < argc) job.episodes = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) policy_name = argv[++i];
+    else if (strcmp(argv[i], "-l") == 0 && i+1 < argc) job.max_scans = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) job.seed = (uint64_t)atoll(argv[++i]);
+    else if (strcmp(argv[i], "-b") == 0) job.stream = 1;
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (!model_given) {
+    job.p_over = job.slip_over;
+    job.p_under = job.slip_under;
+  }
+  if (job.episodes < 1) job.episodes = 1;
+  if (job.max_scans < 1) job.max_scans = 1;
+  if (threads < 1) threads = 1;
+
+  map_image = readPPMimage(argv[1], &rx, &ry);
+  if (map_image == NULL || !parse_map(map_image, rx, ry)) {
+    fprintf(stderr, "Unable to read map %s\n", argv[1]);
+    exit(1);
+  }
+  free(map_image);
+  if (policy_name != NULL) {
+    if (!policy_load(&pol, policy_name)) exit(1);
+    job.pol = &pol;
+  }
+
+  job.result = (episode *)malloc((size_t)job.levels*job.episodes*sizeof(episode));
+  scans = (int *)malloc(job.episodes*sizeof(int));
+  if (job.result == NULL || scans == NULL || !pool_init(&pool, threads)) exit(1);
+  threads = pool.threads;
+  t0 = now_ns();
+  pool_run(&pool, threads, eval_worker, &job);
+  wall = now_ns() - t0;
+  pool_free(&pool);
+
+  printf("Map %d x %d, slip %g,%g, motion model %g,%g, convergence %g,%g, %s, %s scans\n", sx, sy, job.slip_over,
+         job.slip_under, job.p_over, job.p_under, job.ratio, job.entropy, job.pol != NULL ? policy_name : "no policy",
+         job.stream ? "streamed" : "whole");
+  printf("%d episodes in %.3f s on %d threads (%.0f episodes/s)\n", job.levels*job.episodes, wall*1e-9,
+         threads, job.levels*job.episodes/(wall*1e-9));
+  printf("%8s %9s %8s %8s %6s %6s %6s %6s %6s %6s\n", "misread", "finished", "wrong", "mean", "p50", "p90", "p99", "max",
+         "reads", "rear");
+  for (int level = 0; level < job.levels; level++)
+  {
+    episode *e = &job.result[level*job.episodes];
+    int finished = 0, wrong = 0;
+    long sum = 0, all_scans = 0, reads = 0, rear = 0;
+    for (int k = 0; k < job.episodes; k++)
+    {
+      finished += e[k].finished;
+      wrong += e[k].wrong;
+      all_scans += e[k].scans;
+      reads += e[k].reads;
+      rear += e[k].rear;
+      if (e[k].finished) {
+        scans[finished - 1] = e[k].scans;
+        sum += e[k].scans;
+      }
+    }
+    printf("%8g %8.2f%% %7.2f%%", job.misread[level], 100.0*finished/job.episodes,
+           finished > 0 ? 100.0*wrong/finished : 0.0);
+    if (finished > 0) {
+      qsort(scans, finished, sizeof(int), cmp_int);
+      printf(" %8.2f %6d %6d %6d %6d", (double)sum/finished, scans[(finished - 1)/2],
+             scans[(int)(0.9*(finished - 1))], scans[(int)(0.99*(finished - 1))], scans[finished - 1]);
+    } else {
+      printf(" %8s %6s %6s %6s %6s", "-", "-", "-", "-", "-");
+    }
+    if (all_scans > 0) printf(" %6.2f %5.1f%%", (double)reads/all_scans, 100.0*rear/all_scans);
+    printf("\n");
+  }
+
+  if (job.pol != NULL) policy_free(&pol);
+  free(job.result);
+  free(scans);
+  free_map();
+  return 0;
+}
@@ -0,0 +1,398 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Offline localization replay. Runs the belief engine robot_localization() uses (EV3_Beliefs.h)
+ over recorded observation sequences with known ground truth, and reports how well it
+ localizes: how many scans it takes to converge, how often it converges on the wrong pose,
+ and what an update costs. Use it to tune the motion model (-m) and the convergence test (-c)
+ against real runs before taking them to the robot.
+
+ Sequence file, one observation per line ('#' starts a comment):
+
+    seq                           start of a sequence, the belief starts out uniform
+    scan x y dir tl tr br bl      scan colours (1-6, as change_color() gives them) with the
+                                  robot really at intersection x,y facing dir
+    turn q                        q clockwise quarter turns in place
+    drive red                     drive to the next intersection, red is 1 if the border
+                                  was touched on the way
+
+ A sequence converges at the first scan after which beliefsHasUnipueMax() holds - where
+ robot_localization() would stop - and that convergence is false if the most likely pose is
+ not the true one. The rest of the sequence is still replayed, and the final pose is checked
+ against the last scan.
+
+ Sequences are independent, so they are spread over the cores: each worker has its own
+ belief and takes the next sequence from a shared counter until none are left. The map and
+ its index are only read.
+
+ With -g, the tool writes count simulated sequences to the file instead: random start poses,
+ drives that overshoot or stop short as the motion model given with -m says, a random turn
+ before a third of the drives, and each building misread with probability -e.
+
+ Usage: replay map.ppm sequences.txt [-t threads] [-m p_over,p_under] [-c ratio,entropy] [-v]
+        replay map.ppm sequences.txt -g count [-l scans] [-e misread] [-m p_over,p_under] [-s seed]
+    -t  worker threads (default: all cores)
+    -m  motion model (default BELIEF_P_OVER,BELIEF_P_UNDER)
+    -c  convergence test, as --converge= (default BELIEF_CONVERGE_RATIO,BELIEF_CONVERGE_ENTROPY)
+    -v  print the outcome of every sequence
+    -g  write count sequences
+    -l  scans per generated sequence (default 20)
+    -e  chance of misreading a building (default 0.02)
+    -s  random seed (default 1)
+
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+#include "../EV3_Map.h"
+#include "../EV3_Beliefs.h"
+
+#define OP_SCAN 0
+#define OP_TURN 1
+#define OP_DRIVE 2
+#define MAX_SCANS_HIST 256          // Convergence histogram bins, the last one is "or more"
+
+typedef struct replay_op
+{
+ uint8_t kind;              // OP_SCAN, OP_TURN or OP_DRIVE
+ uint8_t arg;               // Quarter turns, or whether red was touched
+ uint8_t colour[4];         // Scan colours
+ int32_t truth;             // Scan: true pose, i*4 + direction
+} replay_op;
+
+typedef struct replay_result
+{
+ int scans, updates;
+ int converged_at;          // Scans up to convergence, 0 if it never converged
+ int wrong;                 // 1 if it converged on the wrong pose
+ int final_ok;              // 1 if the most likely pose after the last scan is the true one
+ double ns;                 // Time spent in the belief updates
+} replay_result;
+
+typedef struct replay_job
+{
+ replay_op *op;
+ int *start;                // Sequence k is op[start[k]] ... op[start[k+1]-1]
+ int count;
+ replay_result *result;
+ int next;                  // Next sequence to hand out
+ double p_over, p_under, ratio, entropy;
+} replay_job;
+
+static const int step_x[4] = {0, 1, 0, -1}, step_y[4] = {-1, 0, 1, 0};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+static double uniform(void)
+{
+  return (double)rand()/((double)RAND_MAX + 1.0);
+}
+
+// read a sequence file into op[], with the start of each sequence in start[]. Returns the
+// number of sequences, -1 on error
+static int read_sequences(const char *filename, replay_op **op, int **start)
+{
+  FILE *f = fopen(filename, "r");
+  char line[256];
+  int nops = 0, ops_cap = 1024, nseq = 0, seq_cap = 64, lineno = 0;
+
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open sequence file %s\n", filename);
+    return -1;
+  }
+  *op = (replay_op *)malloc(ops_cap*sizeof(replay_op));
+  *start = (int *)malloc((seq_cap + 1)*sizeof(int));
+  while (*op != NULL && *start != NULL && fgets(line, sizeof(line), f) != NULL)
+  {
+    char word[16];
+    int v[7], n;
+    replay_op o;
+    lineno++;
+    if (strchr(line, '#') != NULL) *strchr(line, '#') = '\0';
+    if (sscanf(line, "%15s", word) != 1) continue;
+    memset(&o, 0, sizeof(o));
+    if (strcmp(word, "seq") == 0) {
+      if (nseq == seq_cap) {
+        seq_cap *= 2;
+        *start = (int *)realloc(*start, (seq_cap + 1)*sizeof(int));
+        if (*start == NULL) break;
+      }
+      (*start)[nseq++] = nops;
+      continue;
+    }
+    n = sscanf(line, "%*s %d %d %d %d %d %d %d", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]);
+    if (nseq > 0 && strcmp(word, "scan") == 0 && n == 7 && v[0] >= 0 && v[0] < sx && v[1] >= 0 && v[1] < sy &&
+        v[2] >= 0 && v[2] < 4) {
+      o.kind = OP_SCAN;
+      o.truth = (v[0] + v[1]*sx)*4 + v[2];
+      for (int k = 0; k < 4; k++)
+      {
+        o.colour[k] = (uint8_t)(v[3 + k] >= 1 && v[3 + k] <= 6 ? v[3 + k] : 6);
+      }
+    } else if (nseq > 0 && strcmp(word, "turn") == 0 && n == 1) {
+      o.kind = OP_TURN;
+      o.arg = (uint8_t)(((v[0]%4) + 4)%4);
+    } else if (nseq > 0 && strcmp(word, "drive") == 0 && n == 1) {
+      o.kind = OP_DRIVE;
+      o.arg = v[0] != 0;
+    } else {
+      fprintf(stderr, "%s:%d: not a sequence entry\n", filename, lineno);
+      fclose(f);
+      return -1;
+    }
+    if (nops == ops_cap) {
+      ops_cap *= 2;
+      *op = (replay_op *)realloc(*op, ops_cap*sizeof(replay_op));
+      if (*op == NULL) break;
+    }
+    (*op)[nops++] = o;
+  }
+  fclose(f);
+  if (*op == NULL || *start == NULL) {
+    fprintf(stderr, "Out of memory reading %s\n", filename);
+    return -1;
+  }
+  (*start)[nseq] = nops;
+  return nseq;
+}
+
+// replay sequence k on bs
+static void replay_sequence(replay_job *job, belief_state *bs, int k)
+{
+  replay_result *r = &job->result[k];
+  double t0;
+  int x, y, dir;
+
+  memset(r, 0, sizeof(replay_result));
+  beliefs_uniform(bs);
+  for (int j = job->start[k]; j < job->start[k + 1]; j++)
+  {
+    replay_op *o = &job->op[j];
+    int c[4];
+    t0 = now_ns();
+    if (o->kind == OP_SCAN) {
+      for (int m = 0; m < 4; m++)
+      {
+        c[m] = o->colour[m];
+      }
+      updateBeliefByColor(bs, &c[0], &c[1], &c[2], &c[3]);
+    } else if (o->kind == OP_TURN) {
+      updateBeliefByTurn(bs, o->arg);
+    } else {
+      updateBeliefByAction(bs, o->arg);
+    }
+    r->ns += now_ns() - t0;
+    r->updates++;
+    if (o->kind != OP_SCAN) continue;
+
+    r->scans++;
+    beliefsArgMax(bs, &x, &y, &dir);
+    r->final_ok = (x + y*sx)*4 + dir == o->truth;
+    if (r->converged_at == 0 && beliefsHasUnipueMax(bs)) {
+      r->converged_at = r->scans;
+      r->wrong = !r->final_ok;
+    }
+  }
+}
+
+// one worker: a belief of its own, and sequences from the shared counter until none are left
+static void replay_worker(void *arg, int task)
+{
+  replay_job *job = (replay_job *)arg;
+  belief_state bs;
+  int k;
+  (void)task;
+  if (!beliefs_init(&bs, sx, sy)) exit(1);
+  beliefs_set_motion(&bs, job->p_over, job->p_under);
+  beliefs_set_convergence(&bs, job->ratio, job->entropy);
+  while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+  {
+    replay_sequence(job, &bs, k);
+  }
+  beliefs_free(&bs);
+}
+
+// write count simulated sequences of scans scans each. Returns 1 on success
+static int generate(const char *filename, int count, int scans, double misread, double p_over, double p_under)
+{
+  static const int colours[6] = {1, 2, 3, 4, 5, 6};
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to create sequence file %s\n", filename);
+    return 0;
+  }
+  fprintf(f, "# %d sequences on a %d x %d map, misread %g, motion %g,%g\n", count, sx, sy, misread, p_over, p_under);
+  for (int s = 0; s < count; s++)
+  {
+    int x = rand()%sx, y = rand()%sy, dir = rand()%4;
+    fprintf(f, "seq\n");
+    for (int k = 0; k < scans; k++)
+    {
+      int i = x + y*sx, c[4], red = 0;
+      double u;
+      for (int m = 0; m < 4; m++)
+      {
+        c[m] = map[i][(m + dir)%4];
+        if (uniform() < misread) c[m] = colours[(c[m] + rand()%5)%6];
+      }
+      fprintf(f, "scan %d %d %d %d %d %d %d\n", x, y, dir, c[0], c[1], c[2], c[3]);
+      if (k == scans - 1) break;
+      if (rand()%3 == 0) {
+        int q = 1 + rand()%3;
+        dir = (dir + q)%4;
+        fprintf(f, "turn %d\n", q);
+      }
+      // the same outcomes as the belief's motion model: one intersection on, one further, or
+      // none, turning around on the red border
+      u = uniform();
+      for (int steps = u < p_under ? 0 : (u < p_under + p_over ? 2 : 1); steps > 0; steps--)
+      {
+        int ax = x + step_x[dir], ay = y + step_y[dir];
+        if (ax < 0 || ax >= sx || ay < 0 || ay >= sy) {
+          red = 1;
+          dir = (dir + 2)%4;
+        } else {
+          x = ax;
+          y = ay;
+        }
+      }
+      fprintf(f, "drive %d\n", red);
+    }
+  }
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Unable to write sequence file %s\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN), verbose = 0, gen = 0, scans = 20;
+  double misread = 0.02;
+  unsigned seed = 1;
+  int rx, ry;
+  unsigned char *map_image;
+  replay_job job;
+  work_pool pool;
+  double t0, wall, ns = 0;
+  long updates = 0, total_scans = 0, converged = 0, wrong = 0, final_ok = 0, scans_sum = 0;
+  int hist[MAX_SCANS_HIST + 1], median = 0, worst = 0;
+
+  memset(&job, 0, sizeof(job));
+  job.p_over = BELIEF_P_OVER;
+  job.p_under = BELIEF_P_UNDER;
+  job.ratio = BELIEF_CONVERGE_RATIO;
+  job.entropy = BELIEF_CONVERGE_ENTROPY;
+  if (argc < 3) {
+    fprintf(stderr, "Usage: replay map.ppm sequences.txt [-t threads] [-m p_over,p_under] [-c ratio,entropy] [-v]\n");
+    fprintf(stderr, "       replay map.ppm sequences.txt -g count [-l scans] [-e misread] [-m p_over,p_under] [-s seed]\n");
+    exit(1);
+  }
+  for (int i = 3; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-t") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &job.p_over, &job.p_under) != 2 || job.p_over < 0 || job.p_under < 0 ||
+          job.p_over + job.p_under >= 1) {
+        fprintf(stderr, "Invalid motion model %s, expected p_over,p_under\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &job.ratio, &job.entropy) != 2 || (job.ratio != 0 && job.ratio <= 1) ||
+          job.entropy < 0 || (job.ratio == 0 && job.entropy == 0)) {
+        fprintf(stderr, "Invalid convergence test %s, expected ratio,entropy\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-v") == 0) verbose = 1;
+    else if (strcmp(argv[i], "-g") == 0 && i+1 < argc) gen = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-l") == 0 && i+1 < argc) scans = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-e") == 0 && i+1 < argc) misread = atof(argv[++i]);
+    else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) seed = (unsigned)atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown or invalid option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (threads < 1) threads = 1;
+  if (scans < 1) scans = 1;
+
+  map_image = readPPMimage(argv[1], &rx, &ry);
+  if (map_image == NULL || !parse_map(map_image, rx, ry)) {
+    fprintf(stderr, "Unable to read map %s\n", argv[1]);
+    exit(1);
+  }
+  free(map_image);
+
+  if (gen > 0) {
+    srand(seed);
+    if (!generate(argv[2], gen, scans, misread, job.p_over, job.p_under)) exit(1);
+    printf("Wrote %d sequences of %d scans to %s\n", gen, scans, argv[2]);
+    free_map();
+    return 0;
+  }
+
+  job.count = read_sequences(argv[2], &job.op, &job.start);
+  if (job.count < 0) exit(1);
+  job.result = (replay_result *)malloc((job.count > 0 ? job.count : 1)*sizeof(replay_result));
+  if (job.result == NULL || !pool_init(&pool, threads)) exit(1);
+
+  threads = pool.threads;
+  t0 = now_ns();
+  pool_run(&pool, threads, replay_worker, &job);
+  wall = now_ns() - t0;
+  pool_free(&pool);
+
+  memset(hist, 0, sizeof(hist));
+  for (int k = 0; k < job.count; k++)
+  {
+    replay_result *r = &job.result[k];
+    if (verbose) {
+      printf("%6d %3d scans  converged after %3d  %-5s  final %s\n", k, r->scans, r->converged_at,
+             r->converged_at == 0 ? "-" : (r->wrong ? "wrong" : "right"), r->final_ok ? "right" : "wrong");
+    }
+    ns += r->ns;
+    updates += r->updates;
+    total_scans += r->scans;
+    final_ok += r->final_ok;
+    if (r->converged_at == 0) continue;
+    converged++;
+    wrong += r->wrong;
+    scans_sum += r->converged_at;
+    hist[r->converged_at < MAX_SCANS_HIST ? r->converged_at : MAX_SCANS_HIST]++;
+    if (r->converged_at > worst) worst = r->converged_at;
+  }
+  for (long seen = 0; median < MAX_SCANS_HIST && 2*(seen + hist[median]) < converged + 1; median++)
+  {
+    seen += hist[median];
+  }
+
+  printf("Map %d x %d, motion %g,%g, convergence %g,%g\n", sx, sy, job.p_over, job.p_under, job.ratio, job.entropy);
+  printf("%d sequences, %ld scans, %ld updates in %.3f s on %d threads (%.0f sequences/s)\n", job.count,
+         total_scans, updates, wall*1e-9, threads, job.count/(wall*1e-9));
+  if (job.count > 0) {
+    printf("converged         %ld (%.2f%%)", converged, 100.0*converged/job.count);
+    if (converged > 0) printf(" after %.2f scans on average, median %d, most %d", (double)scans_sum/converged, median, worst);
+    printf("\n");
+    printf("false convergence %ld (%.2f%% of converged)\n", wrong, converged > 0 ? 100.0*wrong/converged : 0.0);
+    printf("final pose right  %ld (%.2f%%)\n", final_ok, 100.0*final_ok/job.count);
+  }
+  if (updates > 0) printf("%.1f ns per update\n", ns/updates);
+
+  free(job.op);
+  free(job.start);
+  free(job.result);
+  free_map();
+  return 0;
+}
@@ -1 +1,12 @@
-g++ EV3_Localization.c ./EV3_RobotControl/btcomm.c -lbluetooth
+g++ -O2 -march=native EV3_Localization.c EV3_Color.c EV3_Log.c EV3_Map.c EV3_Beliefs.c EV3_Particles.c EV3_Policy.c EV3_Pool.c EV3_Checkpoint.c EV3_Explore.c ./EV3_RobotControl/btcomm.c -lbluetooth -pthread
+g++ -O2 -march=native Tools/color_bench.c Tools/color_dataset.c EV3_Color.c -o color_bench
+g++ -O2 Tools/color_train.c Tools/color_dataset.c EV3_Color.c -o color_train
+g++ -O2 Tools/log_dump.c EV3_Log.c -o log_dump -pthread
+g++ -O2 -march=native Tools/belief_bench.c EV3_Map.c EV3_Beliefs.c EV3_Pool.c -o belief_bench -pthread
+g++ -O2 -march=native -DBELIEF_PRECISION=1 Tools/belief_bench.c EV3_Map.c EV3_Beliefs.c EV3_Pool.c -o belief_bench_f -pthread
+g++ -O2 -march=native -DBELIEF_PRECISION=2 Tools/belief_bench.c EV3_Map.c EV3_Beliefs.c EV3_Pool.c -o belief_bench_q -pthread
+g++ -O2 Tools/map_policy.c EV3_Map.c EV3_Policy.c -o map_policy
+g++ -O2 -march=native Tools/replay.c EV3_Map.c EV3_Beliefs.c EV3_Pool.c -o replay -pthread
+g++ -O2 -march=native Tools/mc_eval.c EV3_Map.c EV3_Beliefs.c EV3_Pool.c EV3_Policy.c EV3_Explore.c -o mc_eval -pthread
+# Colour classifier regression gate, runs once a recorded dataset and its baseline are checked in
+if [ -f Tools/color_data.txt ] && [ -f Tools/color_baseline.txt ]; then ./color_bench Tools/color_data.txt -b Tools/color_baseline.txt || exit 1; fi